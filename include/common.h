@@ -108,10 +108,27 @@ EIGEN_AUTODIFF_DECLARE_GLOBAL_UNARY(log1p,
 
 inline void init_eigen() { Eigen::initParallel(); }
 
+// Dense matrix products. The adouble overload splits its arguments into a
+// value plane and stacked derivative planes, so that the work is carried
+// out by a handful of double-precision GEMMs rather than by scalar
+// adouble arithmetic.
+Matrix<double> dense_product(const Matrix<double> &A, const Matrix<double> &B);
+Matrix<adouble> dense_product(const Matrix<adouble> &A, const Matrix<adouble> &B);
+
 void store_matrix(const Matrix<double> &M, double* out);
 void store_matrix(const Matrix<adouble> &M, double* out);
 void store_matrix(const Matrix<adouble> &M, double *out, double *jac);
 
+// A name for a temporary file to be renamed to path. It is unique to the
+// call, as threads of one process may write the same path concurrently;
+// open it with O_EXCL.
+std::string atomic_tmp_path(const std::string &path);
+
+// Write to a temporary file which is then renamed into place, so that
+// readers in other processes never observe a partially written file.
+// The file is created with the given permissions (less the umask).
+bool write_file_atomic(const std::string &path, const char* data, const size_t len, const int mode = 0600);
+
 void init_logger_cb(void(*)(const std::string, const std::string, const std::string));
 void call_logger(const std::string, const std::string, const std::string);
 struct Logger
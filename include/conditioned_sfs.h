@@ -36,10 +36,17 @@ class OnePopConditionedSFS : public ConditionedSFS<T>
     std::vector<Matrix<T> > compute_above(const PiecewiseConstantRateFunction<T> &) const;
 
     private:
+    // Rows of tjj_below before first_state are assumed to be up to date.
+    std::vector<Matrix<T> > compute_below(const PiecewiseConstantRateFunction<T> &, 
+            Matrix<T> &, const int) const;
+
     const int n;
-    const MoranEigensystem mei;
-    const MatrixCache mcache;
-    const Matrix<double> Uinv_mp0, Uinv_mp2;
+    const std::shared_ptr<const MatrixCache> mcache;
+    // State of the last call to compute(). Below tau, the CSFS for a
+    // hidden state only depends on eta up to the end of that state, so
+    // these rows can be reused when only later pieces have changed.
+    std::unique_ptr<const PiecewiseConstantRateFunction<T> > last_eta;
+    Matrix<T> last_tjj_below;
 };
 
 template <typename T>
@@ -69,4 +76,19 @@ class DummySFS : public ConditionedSFS<T>
 template <typename T>
 std::vector<Matrix<T> > incorporate_theta(const std::vector<Matrix<T> > &, const double);
 
+// Computes single entries of incorporate_theta() applied to one CSFS,
+// for callers which only need a few of them. Holds a reference to csfs.
+template <typename T>
+class incorporated_sfs
+{
+    public:
+    incorporated_sfs(const Matrix<T> &csfs, const double theta);
+    T operator()(const int, const int) const;
+    const T tauh;
+
+    private:
+    const Matrix<T> &csfs;
+    T scale, tiny;
+};
+
 #endif
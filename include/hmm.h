@@ -3,8 +3,19 @@
 
 #include <map>
 
+#include "quantized_matrix.h"
+
 class InferenceManager;
 struct InferenceBundle;
+class posterior_stream;
+
+// Most probable sequence of hidden states, one per observation, and its
+// log probability.
+struct viterbi_path
+{
+    std::vector<int> states;
+    double logp;
+};
 
 class HMM
 {
@@ -15,26 +26,74 @@ class HMM
         const Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > &obs,
         const InferenceBundle *ib);
     void Estep(bool);
+    // Same as Estep, but always using the dynamically sized kernel.
+    void Estep_dynamic(bool);
+    // Copy the observations into storage owned by this HMM, and move it
+    // and the workspaces into memory first touched by the calling
+    // thread. Used to keep each HMM local to the NUMA node which runs it.
+    void localize();
+    // Bytes used to store the forward variables and gamma.
+    size_t forward_bytes() const;
     double loglik(void);
+    // Log likelihood computed by the forward algorithm alone, without
+    // storing the forward variables or changing the results of Estep.
+    double forward_loglik();
     Vector<adouble> Q(void);
+    // Viterbi decoding. An observation spanning several bases is one
+    // step of the chain, whose transition matrix sums over the states of
+    // its inner bases, so its state is that of its last base. Needs O(M)
+    // workspace and M 16 bit back pointers per observation.
+    viterbi_path viterbi();
 
     private:
     HMM(HMM const&) = delete;
     HMM& operator=(HMM const&) = delete;
     // Methods
+    // (Re)allocate workspaces for the number of hidden states in ib.
+    void reset();
     void domain_error(double);
+    template <int N> void Estep_impl(bool);
+    template <int N> double forward_loglik_impl();
+    // Set a to the normalized forward variable after observation ell - 1
+    // given a_prev, the one before it, and return the log of the
+    // normalizing constant.
+    template <int N> double forward_step(const int ell, const Eigen::Matrix<double, N, N> &T,
+            const Eigen::Matrix<double, N, 1> &a_prev, Eigen::Matrix<double, N, 1> &a);
+    // Log of the matrix whose (j, i) entry is the probability of moving
+    // from state i to state j while emitting span bases with this key.
+    Matrix<double> log_block_transition(const int span, const block_key &key) const;
+    // Storage of the forward variables, in either alpha_hat or alpha_q.
+    template <typename Derived> void store_alpha(const int, const Eigen::MatrixBase<Derived>&);
+    Vector<double> load_alpha(const int) const;
+    // gamma, expanded from gamma_q if it was quantized.
+    Matrix<double>& expanded_gamma();
     inline block_key ob_key(int i) { return block_key(obs.row(i).transpose().tail(obs.cols() - 1)); }
 
     // Instance variables
-    const int hmm_num;
-    const Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > obs;
+    // Position of the observation set in the InferenceManager, which
+    // renumbers the HMMs when some are removed.
+    int hmm_num;
+    Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > obs;
+    // Backing storage of obs once localized; empty until then.
+    Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> local_obs;
     const InferenceBundle *ib;
-    const int M, L;
+    int M;
+    const int L;
     double ll;
+    // Weight of this observation set in InferenceManager::Q() and
+    // loglik() (see InferenceManager::setWeights()).
+    double weight;
     Matrix<double> xisum, gamma;
     Matrix<float> alpha_hat;
+    // Forward variables are clamped below at 1e-10, and normalized to sum
+    // to one, so this floor loses nothing.
+    quantized_matrix alpha_q, gamma_q;
+    bool quantized;
     Vector<double> log_c;
     std::map<block_key, Vector<double> > gamma_sums;
+    // If set, the posterior of each observation is passed to this during
+    // the backward algorithm.
+    posterior_stream *posterior;
 };
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef HYPERGEOMETRIC_H
+#define HYPERGEOMETRIC_H
+
+#include <cmath>
+#include <vector>
+
+// Hypergeometric probabilities for populations of size at most n,
+// computed from a table of log factorials instead of from scratch for
+// every call. Immutable after construction, so it may be shared
+// between threads.
+class hypergeometric_table
+{
+    public:
+    hypergeometric_table(const int n) : log_factorial(n + 1)
+    {
+        for (int i = 0; i <= n; ++i)
+            log_factorial[i] = std::lgamma(i + 1.);
+    }
+
+    // Same as gsl_ran_hypergeometric_pdf(k, n1, n2, t): the probability
+    // of drawing k from the first group when t are drawn without
+    // replacement from groups of size n1 and n2.
+    double pdf(const int k, const int n1, const int n2, const int t) const
+    {
+        if (k > n1 or t - k > n2 or k > t or t > n1 + n2)
+            return 0.;
+        return std::exp(log_choose(n1, k) + log_choose(n2, t - k) - log_choose(n1 + n2, t));
+    }
+
+    private:
+    double log_choose(const int n, const int k) const
+    {
+        return log_factorial.at(n) - log_factorial[k] - log_factorial[n - k];
+    }
+
+    std::vector<double> log_factorial;
+};
+
+#endif
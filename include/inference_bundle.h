@@ -12,6 +12,7 @@ struct InferenceBundle
     TransitionBundle *tb;
     std::map<block_key, Vector<adouble> > *emission_probs;
     bool *saveGamma;
+    bool *quantizeForward;
 };
 
 #endif
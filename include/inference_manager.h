@@ -3,8 +3,10 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <utility>
 #include <memory>
+#include <Eigen/Sparse>
 #include "sparsepp/spp.h"
 
 #include "common.h"
@@ -14,6 +16,9 @@
 #include "conditioned_sfs.h"
 #include "hmm.h"
 #include "block_key.h"
+#include "lru_cache.h"
+#include "posterior_writer.h"
+#include "transition.h"
 
 class InferenceManager
 {
@@ -32,12 +37,58 @@ class InferenceManager
     void setAlpha(const double);
 
     void Estep(bool);
+    // Time the E step using the fixed-size HMM kernel for this number of
+    // hidden states (if there is one) and the dynamic kernel. Returns M,
+    // sites per second for each, and the largest difference between
+    // their log likelihoods.
+    std::vector<double> benchmarkEstep(const int);
+    // Run the E step and compute Q with and without quantizeForward.
+    // Returns the total log likelihood and Q for each, followed by the
+    // bytes used to store forward variables and gamma for each.
+    std::vector<double> validateQuantization();
     std::vector<adouble> Q();
     std::vector<double> loglik();
+    // Run the E step, streaming the posterior decoding of every
+    // observation set to a file (see posterior_writer.h) instead of
+    // storing gamma.
+    void writePosterior(const posterior_options&);
+    // Viterbi decoding of each observation set (see HMM::viterbi()).
+    std::vector<viterbi_path> viterbi();
+    // Log likelihood of each observation set by the forward algorithm
+    // alone. Cheaper than Estep followed by loglik, and leaves the
+    // results of the last E step intact.
+    std::vector<double> forwardLoglik();
+    // Weight the contribution of each observation set to Q and loglik,
+    // e.g. by the number of times it was drawn in a bootstrap replicate.
+    // Sets of weight zero are skipped by the E step, so it must be run
+    // again before Q after the weights change.
+    void setWeights(const std::vector<double>);
 
     void setParams(const ParameterVector &params);
 
+    // Change the discretization of the hidden states. Observations,
+    // keys, bins and targets are kept; everything which depends on the
+    // hidden states is resized and recomputed at the next E step.
+    virtual void setHiddenStates(const std::vector<double>);
+
+    // Add observation sets to the manager. Targets, keys and bins are
+    // extended with whatever the new data introduce, and everything
+    // already computed for the existing data is kept. The new sets are
+    // appended after the existing ones.
+    void addObservations(const std::vector<int>, const std::vector<int*>);
+    // Remove the observation sets at the given positions. Keys and bins
+    // which they introduced are retained, so adding them back is cheap.
+    void removeObservations(std::vector<int>);
+
     bool saveGamma;
+    // Store the forward variables and gamma of each HMM in 16 bits per
+    // entry instead of 32 and 64 (see quantized_matrix.h).
+    bool quantizeForward;
+    // Pin the worker threads to NUMA nodes, keep the observations and
+    // workspaces of each HMM in the memory of the node whose thread runs
+    // it, and give each node its own copy of the transition bundle and
+    // emission probabilities. Takes effect at the next E step or Q.
+    bool numaAware;
     std::vector<double> hidden_states;
     std::map<block_key, Vector<adouble> > emission_probs;
     std::vector<Matrix<double>*> getXisums();
@@ -53,17 +104,37 @@ class InferenceManager
 
     // Methods
     void parallel_do(std::function<void(hmmptr &)>);
+    // Bring the transition bundle and the per-node replicas up to date
+    // before a pass over the HMMs.
+    void prepare_hmms();
     template <typename T> std::vector<T> parallel_select(std::function<T(hmmptr &)>);
     void recompute_initial_distribution();
+    void create_hmms(const unsigned int);
+    void recompute_sfss();
+    void recompute_transition();
     std::vector<Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > > map_obs(const std::vector<int*>&, const std::vector<int>&);
-    spp::sparse_hash_set<std::pair<int, block_key> > fill_targets();
+    spp::sparse_hash_set<std::pair<int, block_key> > fill_targets(const unsigned int);
     void do_dirty_work();
+    // Apply (or undo) numaAware, and refresh the per-node copies of the
+    // shared structures if they are out of date.
+    void update_placement();
+    void refresh_replicas();
+
+    // Called before the CSFS is computed when it is not memoized, for
+    // managers whose CSFS depends on more than eta.
+    virtual void prepare_csfs() {}
 
     // These methods will differ according to number of populations and must be overridden.
     virtual void recompute_emission_probs() = 0;
+    // Add the keys and bins needed by observation sets first, first + 1, ...
+    virtual void register_observations(const unsigned int) = 0;
+    // The full emission matrix is only needed for inspection, so it is
+    // computed on request rather than by recompute_emission_probs().
+    virtual void materialize_emission() = 0;
 
     // Other members
-    const int npop, sfs_dim, M;
+    const int npop, sfs_dim;
+    int M;
     std::vector<Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > > obs;
     std::unique_ptr<ConditionedSFS<adouble> > csfs;
     double theta, rho, alpha;
@@ -71,7 +142,7 @@ class InferenceManager
     Vector<adouble> pi;
     Matrix<adouble> transition, emission;
     std::vector<block_key> bpm_keys;
-    const spp::sparse_hash_set<std::pair<int, block_key> > targets;
+    spp::sparse_hash_set<std::pair<int, block_key> > targets;
     TransitionBundle tb;
     std::vector<Matrix<adouble> > sfss;
 
@@ -79,6 +150,35 @@ class InferenceManager
     struct { bool theta, rho, eta; } dirty;
 
     std::unique_ptr<const PiecewiseConstantRateFunction<adouble> > eta;
+
+    // Results of the most expensive steps of do_dirty_work(), memoized
+    // on the parameter values and derivatives which determine them.
+    // Line searches frequently revisit the same point, or change only
+    // theta, rho or alpha.
+    struct eta_result { Vector<adouble> pi; std::vector<Matrix<adouble> > sfss; };
+    param_key eta_key;
+    LRUCache<param_key, eta_result, param_key_hash> eta_memo;
+    LRUCache<param_key, Matrix<adouble>, param_key_hash> transition_memo;
+    // Number of calls to do_dirty_work(), used to report the hit rates
+    // of the memos now and then.
+    long dirty_work_calls;
+    // Last transition computed, whose matrix exponentials are reused for
+    // pieces of eta which did not change.
+    std::unique_ptr<HJTransition<adouble> > last_transition;
+
+    // State of numaAware. HMM i is run by a thread on node hmm_nodes[i]
+    // and reads the replica of that node, as long as the parallel loops
+    // use a static schedule over a team of numa_threads threads.
+    struct numa_replica
+    {
+        std::unique_ptr<TransitionBundle> tb;
+        std::map<block_key, Vector<adouble> > emission_probs;
+        InferenceBundle ib;
+    };
+    std::vector<std::unique_ptr<numa_replica> > replicas;
+    std::vector<int> hmm_nodes;
+    int numa_threads; // 0 if the HMMs are not placed
+    bool placement_stale, replicas_stale;
 };
 
 template <size_t P>
@@ -97,9 +197,9 @@ class NPopInferenceManager : public InferenceManager
                 (na.tail(na.size() - 1).array() + 1).prod() * (n.array() + 1).prod(),
                 obs_lengths, observations, hidden_states, csfs),
                 n(n), na(na), tensordims(make_tensordims()),
-                bins(construct_bins(polarization_error))
+                polarization_error(polarization_error)
     {
-        populate_emission_probs();
+        register_observations(0);
     }
 
     virtual ~NPopInferenceManager() = default;
@@ -107,8 +207,9 @@ class NPopInferenceManager : public InferenceManager
 
     protected:
     // Virtual overrides
-    void populate_emission_probs();
+    void register_observations(const unsigned int);
     void recompute_emission_probs();
+    void materialize_emission();
     block_key folded_key(const block_key&);
     block_key_prob_map merge_monomorphic(const block_key_prob_map&);
     FixedVector<int, 2 * P> make_tensordims();
@@ -116,15 +217,21 @@ class NPopInferenceManager : public InferenceManager
     bool is_monomorphic(const block_key&);
     block_key convert_monomorphic(const block_key&);
 
-    Vector<adouble> tensorRef(const block_key &bk);
-
     // Passed-in parameters
     const FixedVector<int, P> n;
     const FixedVector<int, P> na;
     const FixedVector<int, 2 * P> tensordims;
+    const double polarization_error;
 
-    std::map<block_key, std::map<block_key, double> > construct_bins(const double);
+    std::set<block_key> observed_keys(const unsigned int);
+    std::map<block_key, std::map<block_key, double> > construct_bins(const std::set<block_key>&);
     std::map<block_key, std::map<block_key, double> > bins;
+    // Row i holds the weights of bins.at(bpm_keys[i]). Column j refers
+    // to column bin_columns[j] of the flattened emission matrix, which
+    // lists only the columns referenced by some bin.
+    Eigen::SparseMatrix<double, Eigen::RowMajor> compile_bins();
+    Eigen::SparseMatrix<double, Eigen::RowMajor> bin_weights;
+    std::vector<int> bin_columns;
 };
 
 class OnePopInferenceManager final : public NPopInferenceManager<1>
@@ -150,9 +257,18 @@ class TwoPopInferenceManager : public NPopInferenceManager<2>
             const double polarization_error);
                 
     void setParams(const ParameterVector&, const ParameterVector&, const ParameterVector&, const double);
+    void setHiddenStates(const std::vector<double>);
+
+    protected:
+    void prepare_csfs();
 
     private:
     const int a1, a2;
+    // Arguments of the last setParams(). The joint CSFS is only
+    // precomputed for them if the SFS are not memoized.
+    ParameterVector params1, params2;
+    double split;
+    bool jcsfs_stale;
 };
 
 Matrix<adouble> sfs_cython(const int, const ParameterVector, const double, const double, bool);
@@ -86,6 +86,14 @@ class JointCSFS : public ConditionedSFS<T>
         return J[m].coeffRef(i, ind);
     }
 
+    // Accumulate a (n1 + 1) x (n2 + 1) block into J[m](i, ., k, .)
+    void addBlock(const int m, const int i, const int k, const Matrix<T> &B)
+    {
+        for (int b1 = 0; b1 <= n1; ++b1)
+            for (int b2 = 0; b2 <= n2; ++b2)
+                tensorRef(m, i, b1, k, b2) += B(b1, b2);
+    }
+
     Vector<double> arange(int, int) const;
 
     void pre_compute_apart();
@@ -94,6 +102,8 @@ class JointCSFS : public ConditionedSFS<T>
     double scipy_stats_hypergeom_pmf(const int, const int, const int, const int);
     Matrix<double> make_hyp1();
     Matrix<double> make_hyp2();
+    Matrix<T> hyp_weights(const Matrix<double>&, const int, const Vector<T>&) const;
+    Matrix<T> moran_sandwich(const Matrix<T>&, const Matrix<T>&, const Matrix<T>&) const;
 
     std::map<int, OnePopConditionedSFS<T> > make_csfs();
     Vector<double> make_S2();
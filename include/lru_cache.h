@@ -0,0 +1,67 @@
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+
+// Bounded map which evicts the least recently used entry once it is
+// full. Not thread safe.
+template <typename K, typename V, typename Hash = std::hash<K> >
+class LRUCache
+{
+    public:
+    LRUCache(const size_t capacity) : capacity(capacity), hits(0), misses(0) {}
+
+    // Returns nullptr on a miss. The pointer is invalidated by the next
+    // call to insert().
+    const V* find(const K &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+        {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        items.splice(items.begin(), items, it->second);
+        return &it->second->second;
+    }
+
+    void insert(const K &key, const V &value)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            it->second->second = value;
+            items.splice(items.begin(), items, it->second);
+            return;
+        }
+        items.emplace_front(key, value);
+        index.emplace(key, items.begin());
+        if (items.size() > capacity)
+        {
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+
+    void clear() { items.clear(); index.clear(); }
+
+    double hit_rate() const { return (hits + misses) > 0 ? double(hits) / (hits + misses) : 0.; }
+
+    private:
+    const size_t capacity;
+    long hits, misses;
+    typedef std::list<std::pair<K, V> > item_list;
+    item_list items;
+    std::unordered_map<K, typename item_list::iterator, Hash> index;
+};
+
+typedef std::vector<double> param_key;
+typedef hash_helpers::hash_container<param_key> param_key_hash;
+
+#endif
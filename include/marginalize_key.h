@@ -2,9 +2,9 @@
 #define MARGINALIZE_KEY_H
 
 #include <map>
-#include "gsl/gsl_randist.h"
 
 #include "block_key.h"
+#include "hypergeometric.h"
 
 template <size_t P>
 struct marginalize_key
@@ -13,7 +13,8 @@ struct marginalize_key
     static std::map<block_key, double> run(
         const Eigen::MatrixBase<Derived1> &key,
         const Eigen::MatrixBase<Derived2> &n,
-        const Eigen::MatrixBase<Derived3> &na);
+        const Eigen::MatrixBase<Derived3> &na,
+        const hypergeometric_table &hyp);
 };
 
 template <>
@@ -21,7 +22,8 @@ template <typename Derived1, typename Derived2, typename Derived3>
 std::map<block_key, double> marginalize_key<1>::run(
     const Eigen::MatrixBase<Derived1> &key,
     const Eigen::MatrixBase<Derived2> &n,
-    const Eigen::MatrixBase<Derived3> &na)
+    const Eigen::MatrixBase<Derived3> &na,
+    const hypergeometric_table &hyp)
 {
     std::map<block_key, double> ret;
     assert(key.size() == 3);
@@ -42,9 +44,8 @@ std::map<block_key, double> marginalize_key<1>::run(
         int n2 = n(0) - n1;
         v(1) = n1;
         // p(k) =  C(n_1, k) C(n_2, t - k) / C(n_1 + n_2, t)
-        // gsl_ran_hypergeometric_pdf(unsigned int k, unsigned int n1, unsigned int n2, unsigned int t)
         // Here we rely on ret[bk] default constructing with value 0.
-        ret[block_key(v)] += gsl_ran_hypergeometric_pdf(b, n1, n2, nb);
+        ret[block_key(v)] += hyp.pdf(b, n1, n2, nb);
     }
     DEBUG1 << "key: " << key.transpose() << " ret:" << ret;
     return ret;
@@ -55,18 +56,21 @@ template <typename Derived1, typename Derived2, typename Derived3>
 std::map<block_key, double> marginalize_key<P>::run(
         const Eigen::MatrixBase<Derived1> &key,
         const Eigen::MatrixBase<Derived2> &n,
-        const Eigen::MatrixBase<Derived3> &na)
+        const Eigen::MatrixBase<Derived3> &na,
+        const hypergeometric_table &hyp)
 {
     std::map<block_key, double> ret;
     assert(a(0) >= 0);
     std::map<block_key, double> sub_left = marginalize_key<1>::run(
             key.head(3),
             n.head(1),
-            na.head(1));
+            na.head(1),
+            hyp);
     std::map<block_key, double> sub_right = marginalize_key<P - 1>::run(
             key.tail(3 * (P - 1)),
             n.tail(P - 1), 
-            na.tail(P - 1));
+            na.tail(P - 1),
+            hyp);
     for (const auto &p_left : sub_left)
         for (const auto &p_right : sub_right)
         {
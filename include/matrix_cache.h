@@ -1,19 +1,50 @@
 #ifndef MATRIX_CACHE_H
 #define MATRIX_CACHE_H
 
+#include <memory>
+#include <set>
+
 #include "common.h"
+#include "block_key.h"
+
+typedef Eigen::Map<const Matrix<double> > ConstMatrixMap;
 
+// Read-only views of the matrices needed to compute the SFS for a
+// sample of size n. The underlying storage is usually a memory mapped
+// file in the cache directory, which is shared by every process using
+// the same cache, and is kept alive as long as the MatrixCache is.
 struct MatrixCache
-{ 
-    template <class Archive>
-    void serialize(Archive & ar)
-    {
-        ar(X0, X2, M0, M1);
-    }
-    Matrix<double> X0, X2, M0, M1; 
+{
+    MatrixCache(std::shared_ptr<const char>);
+    std::shared_ptr<const char> storage;
+    int n;
+    // False if the matrices were constructed using the fast path.
+    bool exact;
+    ConstMatrixMap X0, X2, M0, M1, Uinv_mp0, Uinv_mp2;
 };
 
-MatrixCache& cached_matrices(int);
+// Thread safe. Matrices are loaded lazily from the cache directory,
+// or computed and stored there if they are not present.
+std::shared_ptr<const MatrixCache> cached_matrices(int);
+// Set the directory which holds the cache files. Each sample size is
+// stored in its own file, which is written atomically, so the
+// directory can be shared between concurrent processes.
 void init_cache(const std::string);
+// Construct the matrices in multiprecision floating point (using prec
+// bits, or a precision which grows with n if prec = 0) instead of exact
+// rational arithmetic. Matrices which were previously computed
+// exactly are still used.
+void set_fast_matrices(const bool, const int);
+// Maximum normwise relative difference between the exact and fast
+// constructions for a sample of size n. Used for testing.
+double fast_matrices_error(const int, const int);
+// The bins of each observed key, as computed by
+// NPopInferenceManager::construct_bins, are also stored in the cache
+// directory. load_bins() returns false if the cache is not initialized
+// or holds no bins for this sample configuration and set of keys.
+bool load_bins(const Vector<int>&, const Vector<int>&, const double,
+        const std::set<block_key>&, std::map<block_key, block_key_prob_map>&);
+void store_bins(const Vector<int>&, const Vector<int>&, const double,
+        const std::map<block_key, block_key_prob_map>&);
 
 #endif
@@ -2,23 +2,29 @@
 #define MORAN_EIGENSYSTEM_H
 
 #include <Eigen/Sparse>
+#include <unsupported/Eigen/MPRealSupport>
 
 #include "mpq_support.h"
 
-struct MoranEigensystem
+template <typename T>
+struct MoranEigensystemT
 {
-    MoranEigensystem(const int n) : U(n + 1, n + 1), Uinv(n + 1, n + 1), D(n + 1) 
+    MoranEigensystemT(const int n) : U(n + 1, n + 1), Uinv(n + 1, n + 1), D(n + 1) 
     {
         U.setZero();
         Uinv.setZero();
         D.setZero();
     }
-    MatrixXq U, Uinv;
-    VectorXq D;
+    Matrix<T> U, Uinv;
+    Vector<T> D;
 };
+typedef MoranEigensystemT<mpq_class> MoranEigensystem;
 
 Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> moran_rate_matrix(int);
 Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> modified_moran_rate_matrix(int, int, int);
 MoranEigensystem& compute_moran_eigensystem(int);
+// Same as above, but computed in multiprecision floating point using
+// prec bits. The result is not memoized.
+MoranEigensystemT<mpfr::mpreal> compute_moran_eigensystem(int, mpfr_prec_t);
 
 #endif
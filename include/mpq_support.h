@@ -42,6 +42,14 @@ namespace Eigen {
                     return adouble(mpq_get_d(x.get_mpq_t()));
                 }
             };
+        template <>
+            struct cast_impl<mpq_class, mpfr::mpreal>
+            {
+                static inline mpfr::mpreal run(const mpq_class &x)
+                {
+                    return mpfr::mpreal(x.get_mpq_t());
+                }
+            };
         template <>
             struct cast_impl<mpq_class, double>
             {
@@ -56,4 +64,15 @@ namespace Eigen {
 typedef Eigen::Matrix<mpq_class, Eigen::Dynamic, Eigen::Dynamic> MatrixXq;
 typedef Eigen::Matrix<mpq_class, Eigen::Dynamic, 1> VectorXq;
 
+// Sets the (thread-local) working precision when T is a multiprecision
+// float; a no-op for exact types.
+template <typename T>
+inline void set_precision(const mpfr_prec_t) {}
+
+template <>
+inline void set_precision<mpfr::mpreal>(const mpfr_prec_t prec) 
+{
+    mpfr::mpreal::set_default_prec(prec);
+}
+
 #endif
@@ -0,0 +1,41 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <vector>
+
+// NUMA nodes of the CPUs this process was allowed to run on when the
+// topology was first queried. Without NUMA information (or off Linux)
+// all of them are placed on a single node.
+struct numa_topology
+{
+    // cpus[s] lists the CPUs of node s. Nodes without any allowed CPU
+    // are omitted.
+    std::vector<std::vector<int> > cpus;
+    int nodes() const { return cpus.size(); }
+    // Threads 0, ..., nthreads - 1 are divided into contiguous blocks,
+    // one per node, so that thread t runs on node t * nodes() / nthreads.
+    int node_of_thread(const int t, const int nthreads) const { return (long)t * nodes() / nthreads; }
+};
+
+const numa_topology& get_numa_topology();
+
+// Restrict the calling thread to the CPUs of node s, or to every CPU in
+// the topology if s < 0. Returns false if this is not supported.
+bool pin_thread(const int s);
+
+// Saves the CPUs the calling thread may run on, and restores them when
+// it goes out of scope. Used to keep the thread which calls into the
+// library, and whatever it starts later, from being left pinned.
+class affinity_guard
+{
+    public:
+    affinity_guard();
+    ~affinity_guard();
+
+    private:
+    affinity_guard(affinity_guard const&) = delete;
+    affinity_guard& operator=(affinity_guard const&) = delete;
+    std::vector<int> cpus;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef OBSERVATION_FILE_H
+#define OBSERVATION_FILE_H
+
+#include <memory>
+#include <string>
+
+#include "common.h"
+
+// Binary SMC++ data files. A file consists of
+//
+//   - a 64 byte header (see observation_file.cpp) giving the number of
+//     rows and columns of the observations, how they are split into
+//     blocks and how the blocks are encoded;
+//   - the JSON header of the text format, without its "# SMC++ " prefix;
+//   - an index giving the offset and length of each block;
+//   - the blocks, each holding up to block_rows rows of (span, a, b,
+//     nb, ...) as native int32 in row-major order, either verbatim or
+//     deflated with zlib.
+//
+// When the blocks are stored verbatim, the observations are used in
+// place from a private memory mapping of the file. Otherwise the blocks
+// are inflated in parallel into a single buffer.
+struct ObservationFile
+{
+    std::string header;
+    int rows, cols;
+    // Row-major observations, kept alive as long as this is.
+    std::shared_ptr<int> storage;
+
+    Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > map() const
+    {
+        return Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >(
+                storage.get(), rows, cols);
+    }
+};
+
+// Throws std::runtime_error if the file cannot be read or is not a
+// valid binary SMC++ file.
+ObservationFile read_observations(const std::string &path);
+// Write rows x cols row-major observations and their JSON header. The
+// file is written atomically.
+void write_observations(const std::string &path, const std::string &header,
+        const int* data, const int rows, const int cols, const bool compress);
+// Write observations in the text format ("# SMC++ <header>" followed
+// by one line per row), gzipped if the path ends in ".gz".
+void write_text_observations(const std::string &path, const std::string &header,
+        const int* data, const int rows, const int cols);
+// True if the file starts with the magic number of the binary format.
+bool is_observation_file(const std::string &path);
+
+#endif
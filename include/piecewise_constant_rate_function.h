@@ -11,6 +11,9 @@ class PiecewiseConstantRateFunction
     PiecewiseConstantRateFunction(const std::vector<std::vector<adouble>>, const std::vector<double>);
     PiecewiseConstantRateFunction(const PiecewiseConstantRateFunction &other) : 
         PiecewiseConstantRateFunction(other.params, other.hidden_states) {}
+    // The same rate function, discretized by different hidden states.
+    PiecewiseConstantRateFunction(const PiecewiseConstantRateFunction &other, const std::vector<double> hidden_states) : 
+        PiecewiseConstantRateFunction(other.params, hidden_states) {}
     T zero() const;
     T R(const T) const;
     T Rinv(const T) const;
@@ -19,6 +22,10 @@ class PiecewiseConstantRateFunction
     T random_time(const double, const double, const long long) const;
     T random_time(const double, const double, const double, std::mt19937 &) const;
     int getNder() const { return nder; }
+    // Index of the first piece whose rate differs from that of other, or
+    // the number of pieces if there is none. Returns 0 if the two are not
+    // defined on the same pieces and hidden states.
+    int first_changed_piece(const PiecewiseConstantRateFunction &other) const;
     void print_debug() const;
     
     void tjj_double_integral_above(const int, long, std::vector<Matrix<T> > &) const;
@@ -0,0 +1,123 @@
+#ifndef POSTERIOR_WRITER_H
+#define POSTERIOR_WRITER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Posterior decodings of the TMRCA, written while the backward
+// algorithm runs instead of being kept in HMM::gamma. A file consists of
+//
+//   - a 64 byte header (see posterior_writer.cpp) giving the number of
+//     hidden states, the number of values stored per observation and
+//     the number of chunks;
+//   - a JSON header supplied by the caller;
+//   - the chunks, each holding the int32 spans of up to chunk_rows
+//     consecutive observations of one observation set ("contig")
+//     followed by their float32 values in row-major order;
+//   - an index giving the contig, number of rows, genomic interval,
+//     offset and length of each chunk, sorted by contig and position.
+//
+// The values of an observation are either its posterior distribution
+// over the M hidden states, or a summary of it: the posterior mean
+// TMRCA, the most probable hidden state and the requested quantiles.
+// The file is written to a temporary path and renamed by close().
+
+struct posterior_options
+{
+    std::string path, header;
+    // Time of each hidden state used for the posterior mean. Only
+    // needed for summaries.
+    std::vector<double> times;
+    // Quantiles of the posterior TMRCA to store, in (0, 1). If empty,
+    // the full distribution is stored.
+    std::vector<double> quantiles;
+    // Genomic position of the first base of each observation set.
+    std::vector<long> origins;
+    int chunk_rows;
+};
+
+// Entry of the index of a posterior file.
+struct posterior_chunk
+{
+    int32_t contig;
+    int32_t rows;
+    int64_t start;
+    int64_t end;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+class posterior_writer
+{
+    public:
+    posterior_writer(const posterior_options&, const std::vector<double> &hidden_states);
+    ~posterior_writer();
+    // Number of values stored per observation.
+    int width() const { return nvalues; }
+    // Store the values of consecutive observations of contig c, with the
+    // given spans, which cover [start, end).
+    void write_chunk(const int c, const long start, const long end,
+            const std::vector<int> &spans, const std::vector<float> &values);
+    // Store the values of an unnormalized posterior distribution p over
+    // the hidden states in out.
+    void encode(const double* p, float* out) const;
+    // Write the index and header. Throws std::runtime_error if anything
+    // could not be written.
+    void close();
+
+    const posterior_options opts;
+
+    private:
+    posterior_writer(posterior_writer const&) = delete;
+    posterior_writer& operator=(posterior_writer const&) = delete;
+
+    const std::vector<double> hidden_states;
+    const int M, nvalues;
+    const std::string tmp;
+    int fd;
+    std::mutex mtx;
+    uint64_t next;
+    std::vector<posterior_chunk> index;
+    bool failed;
+};
+
+// Buffers the values of one contig, which the backward algorithm
+// produces last observation first, and passes them to the writer a
+// chunk at a time in genomic order.
+class posterior_stream
+{
+    public:
+    // end is the position just past the last base of the contig.
+    posterior_stream(posterior_writer &writer, const int contig, const long end);
+    // Add the posterior of the observation preceding the last one added.
+    void add(const int span, const double* p);
+    void flush();
+
+    private:
+    posterior_writer &writer;
+    const int contig;
+    long start, end;
+    std::vector<int> spans;
+    std::vector<float> values;
+};
+
+struct posterior_block
+{
+    std::string header;
+    int M, width;
+    // Position, span and values of each observation which overlaps the
+    // requested interval.
+    std::vector<long> starts;
+    std::vector<int> spans;
+    std::vector<float> values;
+};
+
+// Read the observations of contig c which overlap [start, end), reading
+// only the chunks which contain them. Throws std::runtime_error if the
+// file cannot be read or is not a posterior file.
+posterior_block read_posterior(const std::string &path, const int c, const long start, const long end);
+
+#endif
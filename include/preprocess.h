@@ -0,0 +1,65 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <vector>
+
+// Fused implementations of the filters which smcpp/data_filter.py
+// applies to the observations before inference. Each contig is
+// transformed in a single streaming pass, without intermediate arrays,
+// and contigs are processed in parallel.
+
+struct contig_data
+{
+    // Row-major (span, a, b, nb, ...) observations.
+    const int* data;
+    int rows, cols;
+    // Number of distinguished and undistinguished lineages of each
+    // population.
+    std::vector<int> a, n;
+};
+
+// RecodeNonseg, Compress, BreakLongSpans and DropSmallContigs.
+struct normalize_options
+{
+    // Runs of homozygosity longer than this are reported, and converted
+    // to missing data if recode_nonseg is set.
+    long nonseg_cutoff;
+    bool recode_nonseg;
+    // Missing spans at least this long split the contig.
+    long span_cutoff;
+    // Pieces no longer than this are dropped.
+    long min_length;
+};
+
+struct normalize_result
+{
+    // Row-major observations of the pieces of the contig which were kept.
+    std::vector<std::vector<int> > pieces;
+    // Spans of the long runs of homozygosity, and of the missing spans
+    // at which the contig was split.
+    std::vector<int> long_runs, long_missing;
+};
+
+// Thin, BinObservations, RecodeMonomorphic, Compress, Validate and
+// DropUninformativeContigs.
+struct prepare_result
+{
+    // Row-major observations.
+    std::vector<int> data;
+    // Rows which failed validation.
+    std::vector<int> invalid;
+    // Number of rows where every undistinguished lineage carries the
+    // derived allele, which were recoded as non-segregating.
+    int recoded;
+    // False if the contig has no variable sites.
+    bool informative;
+};
+
+std::vector<normalize_result> normalize_contigs(const std::vector<contig_data>&,
+        const normalize_options&);
+// thinning[i] is the thinning interval of contig i (no thinning if
+// <= 1); w is the bin width.
+std::vector<prepare_result> prepare_contigs(const std::vector<contig_data>&,
+        const std::vector<int> &thinning, const int w);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef QUANTIZED_MATRIX_H
+#define QUANTIZED_MATRIX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+// Column-major matrix of nonnegative values, stored as 16-bit fixed
+// point logarithms relative to the largest entry of each column. Entries
+// smaller than floor times the column maximum (including zeros) are
+// stored as zero. The relative error of every other entry is at most
+// -log(floor) / 131068, e.g. 2e-4 for floor = 1e-11.
+class quantized_matrix
+{
+    public:
+    quantized_matrix(const double floor) : log_floor(std::log(floor)), nrows(0) {}
+
+    void resize(const int rows, const int cols)
+    {
+        nrows = rows;
+        codes.assign((size_t)rows * cols, 0);
+        log_max.assign(cols, 0.f);
+    }
+
+    void clear() { resize(0, 0); }
+
+    template <typename Derived>
+    void set_col(const int j, const Eigen::MatrixBase<Derived> &x)
+    {
+        const double mx = x.maxCoeff();
+        uint16_t* c = &codes[(size_t)j * nrows];
+        if (not (mx > 0.))
+        {
+            std::fill(c, c + nrows, 0);
+            log_max[j] = 0.f;
+            return;
+        }
+        log_max[j] = std::log(mx);
+        for (int i = 0; i < nrows; ++i)
+        {
+            const double r = std::log(x(i)) - log_max[j];
+            c[i] = (r < log_floor) ? 0 : 1 + (uint16_t)std::lround(r / log_floor * -65534. + 65534.);
+        }
+    }
+
+    Vector<double> col(const int j) const
+    {
+        Vector<double> ret(nrows);
+        const uint16_t* c = &codes[(size_t)j * nrows];
+        for (int i = 0; i < nrows; ++i)
+            ret(i) = (c[i] == 0) ? 0. : 
+                std::exp(log_max[j] + log_floor * (1. - (c[i] - 1) / 65534.));
+        return ret;
+    }
+
+    Matrix<double> expand() const
+    {
+        Matrix<double> ret(nrows, log_max.size());
+        for (unsigned int j = 0; j < log_max.size(); ++j)
+            ret.col(j) = col(j);
+        return ret;
+    }
+
+    // Move the storage into memory allocated (and first touched) by the
+    // calling thread.
+    void relocate()
+    {
+        std::vector<uint16_t>(codes).swap(codes);
+        std::vector<float>(log_max).swap(log_max);
+    }
+
+    size_t bytes() const { return codes.size() * sizeof(uint16_t) + log_max.size() * sizeof(float); }
+
+    private:
+    const double log_floor;
+    int nrows;
+    std::vector<uint16_t> codes;
+    std::vector<float> log_max;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef TRANSITION_H
 #define TRANSITION_H
 
+#include <memory>
+
 #include "common.h"
 #include "piecewise_constant_rate_function.h"
 
@@ -25,14 +27,35 @@ class HJTransition : public Transition<T>
 {
     public:
     HJTransition(const PiecewiseConstantRateFunction<T> &eta, const double rho);
+    // Matrix exponentials of the pieces of eta which are unchanged from
+    // previous->eta are taken from previous instead of being recomputed.
+    // If force_mpfr is set, the multiprecision reference implementation
+    // is used.
+    HJTransition(const PiecewiseConstantRateFunction<T> &eta, const double rho, 
+            const HJTransition<T> *previous, const bool force_mpfr);
 
     private:
-    void compute_expms();
+    void compute_expms(const HJTransition<T> *, const bool);
+    bool compute_expms_double(const int);
+    void compute_expms_mpfr();
     std::vector<Matrix<T> > expms;
     std::vector<Matrix<T> > expm_prods;
+    // absorb[i] = expm_prods[i](0, 2) - expm_prods[i - 1](0, 2)
+    std::vector<T> absorb;
 };
 
 template <typename T>
 Matrix<T> compute_transition(const PiecewiseConstantRateFunction<T> &, const double);
+// As above, reusing work from previous, which is replaced by the new
+// transition on return.
+template <typename T>
+Matrix<T> compute_transition(const PiecewiseConstantRateFunction<T> &, const double,
+        std::unique_ptr<HJTransition<T> > &);
+
+// Times compute_transition() using double and mpfr arithmetic. Returns
+// seconds per call for each, and the maximum absolute difference
+// between the two in values and in derivatives. Used for testing.
+std::vector<double> benchmark_transition(const ParameterVector &, const std::vector<double> &, 
+        const double, const int);
 
 #endif
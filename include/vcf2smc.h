@@ -0,0 +1,46 @@
+#ifndef VCF2SMC_H
+#define VCF2SMC_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Native implementation of "smc++ vcf2smc". Requires htslib; the
+// functions below throw std::runtime_error if smcpp was built without
+// it (see vcf2smc_available()).
+
+// The (sample id, haplotype) pairs of some lineages of each population.
+typedef std::vector<std::vector<std::pair<std::string, int> > > lineage_list;
+
+struct vcf2smc_options
+{
+    std::string vcf, mask, contig;
+    // One conversion is done for each element of dist and undist, which
+    // give the distinguished and undistinguished lineages. Conversions
+    // share the decoding of every record, so converting a contig for
+    // several distinguished individuals costs little more than for one.
+    std::vector<lineage_list> dist, undist;
+    long contig_length;
+    // Runs of homozygosity longer than this are treated as missing;
+    // negative for no cutoff.
+    long missing_cutoff;
+    bool drop_first_last;
+    // Number of regions of the contig which are decoded in parallel.
+    int regions;
+};
+
+struct vcf2smc_result
+{
+    // Row-major observations with 1 + 3 * npop columns, identical to the
+    // rows written by the Python implementation.
+    std::vector<int> rows;
+    // Positions with more than one SNP record, of which only the first
+    // was used.
+    int multiples;
+};
+
+bool vcf2smc_available();
+// One result per conversion.
+std::vector<vcf2smc_result> vcf2smc(const vcf2smc_options&);
+
+#endif
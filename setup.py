@@ -35,7 +35,29 @@ else:
     ]
 
 extra_link_args = ["-fopenmp"]
-libraries = ["mpfr", "gmp", "gmpxx", "gsl", "gslcblas"]
+libraries = ["mpfr", "gmp", "gmpxx", "gsl", "gslcblas", "z"]
+include_dirs = [np.get_include(), "include", "include/eigen3"]
+library_dirs = []
+
+
+def find_htslib():
+    "Prefix of an htslib installation, which enables the native vcf2smc."
+    prefixes = [os.environ.get("HTSLIB_DIR"), os.environ.get("CONDA_PREFIX"), "/usr/local", "/usr"]
+    for prefix in prefixes:
+        if prefix and os.path.exists(os.path.join(prefix, "include", "htslib", "vcf.h")):
+            return prefix
+    return None
+
+
+htslib = find_htslib()
+if htslib is not None:
+    extra_compile_args.append("-DHAVE_HTSLIB")
+    libraries.append("hts")
+    include_dirs.append(os.path.join(htslib, "include"))
+    library_dirs.append(os.path.join(htslib, "lib"))
+else:
+    warnings.warn("htslib not found; the native vcf2smc will not be available. "
+                  "Set HTSLIB_DIR to the prefix of an htslib installation to enable it.")
 cpps = [
     f
     for f in glob.glob("src/*.cpp")
@@ -48,7 +70,8 @@ extensions = [
         "smcpp._smcpp",
         sources=["smcpp/_smcpp.pyx"] + cpps,
         language="c++",
-        include_dirs=[np.get_include(), "include", "include/eigen3"],
+        include_dirs=include_dirs,
+        library_dirs=library_dirs,
         libraries=libraries,
         extra_compile_args=extra_compile_args,
         extra_link_args=extra_link_args,
@@ -2,7 +2,7 @@ from libcpp.vector cimport vector
 from libcpp.pair cimport pair
 from libcpp.map cimport map
 from libcpp cimport bool
-from libcpp.memory cimport unique_ptr
+from libcpp.memory cimport unique_ptr, shared_ptr
 from libcpp.string cimport string
 
 cdef extern from "common.h":
@@ -38,7 +38,24 @@ ctypedef Matrix[double]* pMatrixD
 ctypedef Matrix[adouble]* pMatrixAd
 ctypedef map[block_key, Vector[double]]* pBlockMap
 
+cdef extern from "posterior_writer.h":
+    cdef cppclass posterior_options:
+        string path, header
+        vector[double] times, quantiles
+        vector[long] origins
+        int chunk_rows
+    cdef cppclass posterior_block:
+        string header
+        int M, width
+        vector[long] starts
+        vector[int] spans
+        vector[float] values
+    posterior_block read_posterior_ "read_posterior"(const string&, const int, const long, const long) nogil except +
+
 cdef extern from "inference_manager.h":
+    cdef cppclass viterbi_path:
+        vector[int] states
+        double logp
     cdef cppclass InferenceManager nogil:
         InferenceManager(const int, const vector[int],
                 const vector[int*], const vector[double],
@@ -52,6 +69,8 @@ cdef extern from "inference_manager.h":
         vector[adouble] Q() except +
         bool debug
         bool saveGamma
+        bool quantizeForward
+        bool numaAware
         vector[double] hidden_states
         vector[pMatrixD] getGammas()
         vector[pMatrixD] getXisums()
@@ -60,6 +79,15 @@ cdef extern from "inference_manager.h":
         Matrix[adouble]& getTransition()
         Matrix[adouble]& getEmission()
         map[block_key, Vector[adouble]]& getEmissionProbs()
+        void addObservations(const vector[int], const vector[int*]) except +
+        void removeObservations(vector[int]) except +
+        void setHiddenStates(const vector[double]) except +
+        vector[double] benchmarkEstep(const int) except +
+        vector[double] validateQuantization() except +
+        void writePosterior(const posterior_options&) except +
+        vector[viterbi_path] viterbi() except +
+        vector[double] forwardLoglik() except +
+        void setWeights(const vector[double]) except +
     cdef cppclass OnePopInferenceManager(InferenceManager) nogil:
         OnePopInferenceManager(const int, const vector[int],
                 const vector[int*], const vector[double], const double) except +
@@ -84,5 +112,56 @@ cdef extern from "jcsfs.h":
         void pre_compute(const ParameterVector&, const ParameterVector&, const double)
         vector[Matrix[T]] compute(const PiecewiseConstantRateFunction[T]&) const
 
+cdef extern from "transition.h":
+    vector[double] benchmark_transition(const ParameterVector&, const vector[double]&,
+            const double, const int) nogil except +
+
+cdef extern from "observation_file.h":
+    cdef cppclass ObservationFile:
+        string header
+        int rows, cols
+        shared_ptr[int] storage
+    ObservationFile read_observations(const string) nogil except +
+    void write_observations(const string, const string, const int*, const int, const int, const bool) nogil except +
+    void write_text_observations(const string, const string, const int*, const int, const int) nogil except +
+    bool is_observation_file(const string)
+
+cdef extern from "vcf2smc.h":
+    cdef cppclass vcf2smc_options:
+        string vcf, mask, contig
+        vector[vector[vector[pair[string, int]]]] dist, undist
+        long contig_length
+        long missing_cutoff
+        bool drop_first_last
+        int regions
+    cdef cppclass vcf2smc_result:
+        vector[int] rows
+        int multiples
+    bool vcf2smc_available_ "vcf2smc_available"()
+    vector[vcf2smc_result] vcf2smc(const vcf2smc_options&) nogil except +
+
 cdef extern from "matrix_cache.h":
     void init_cache(const string)
+    void set_fast_matrices(const bool, const int)
+    double fast_matrices_error(const int, const int) nogil except +
+
+cdef extern from "preprocess.h":
+    cdef cppclass contig_data:
+        const int* data
+        int rows, cols
+        vector[int] a, n
+    cdef cppclass normalize_options:
+        long nonseg_cutoff
+        bool recode_nonseg
+        long span_cutoff
+        long min_length
+    cdef cppclass normalize_result:
+        vector[vector[int]] pieces
+        vector[int] long_runs, long_missing
+    cdef cppclass prepare_result:
+        vector[int] data
+        vector[int] invalid
+        int recoded
+        bool informative
+    vector[normalize_result] normalize_contigs_ "normalize_contigs"(const vector[contig_data]&, const normalize_options&) nogil except +
+    vector[prepare_result] prepare_contigs_ "prepare_contigs"(const vector[contig_data]&, const vector[int]&, const int) nogil except +
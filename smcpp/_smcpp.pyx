@@ -1,6 +1,7 @@
 cimport openmp
 cimport numpy as np
 from libc.math cimport exp, log
+from libc.string cimport memcpy
 from cython.operator cimport dereference as deref, preincrement as inc
 
 import random
@@ -19,14 +20,17 @@ from .observe import targets
 logger = logging.getLogger(__name__)
 
 init_eigen()
+np.import_array()
 
 def _init_cache():
     dirs = AppDirs("smcpp", "popgenmethods", version=version.version)
+    cache_dir = os.path.join(dirs.user_cache_dir, "matrices")
     try:
-        os.makedirs(dirs.user_cache_dir)
+        os.makedirs(cache_dir)
     except OSError:
         pass
-    init_cache(os.path.join(dirs.user_cache_dir, "matrices.dat").encode("UTF-8"))
+    set_fast_matrices(defaults.fast_matrices, 0)
+    init_cache(cache_dir.encode("UTF-8"))
 
 abort = False
 _lvl = {s: getattr(logging, s) for s in "info debug critical warning error".upper().split()}
@@ -153,6 +157,41 @@ cdef class _PyInferenceManager:
     def __dealloc__(self):
         del self._im
 
+    def add_observations(self, observations):
+        """Append observation sets, reusing everything already computed for
+        the existing ones."""
+        cdef int[:, ::1] vob
+        cdef vector[int*] ptrs
+        cdef vector[int] Ls
+        for ob in observations:
+            vob = ob
+            ptrs.push_back(&vob[0, 0])
+            Ls.push_back(ob.shape[0])
+        with nogil:
+            self._im.addObservations(Ls, ptrs)
+        # Keep the arrays alive for as long as the manager refers to them.
+        self._observations = list(self._observations) + list(observations)
+        for i in range(ptrs.size()):
+            self._obs_ptrs.push_back(ptrs[i])
+            self._Ls.push_back(Ls[i])
+        self._num_hmms = len(self._observations)
+
+    def remove_observations(self, indices):
+        """Remove the observation sets at the given positions."""
+        cdef vector[int] inds = sorted(set(indices))
+        cdef vector[int*] ptrs
+        cdef vector[int] Ls
+        with nogil:
+            self._im.removeObservations(inds)
+        keep = [i for i in range(self._num_hmms) if i not in set(indices)]
+        for i in keep:
+            ptrs.push_back(self._obs_ptrs[i])
+            Ls.push_back(self._Ls[i])
+        self._observations = [self._observations[i] for i in keep]
+        self._obs_ptrs = ptrs
+        self._Ls = Ls
+        self._num_hmms = len(keep)
+
     property observations:
         def __get__(self):
             return self._observations
@@ -189,6 +228,17 @@ cdef class _PyInferenceManager:
             self._im.Estep(fbOnly)
         _check_abort()
 
+    def benchmark_E_step(self, int reps=1):
+        """Per-site throughput of the E step with the fixed-size HMM kernel
+        selected for the current number of hidden states and with the
+        dynamically sized one."""
+        cdef vector[double] ret
+        with nogil:
+            ret = self._im.benchmarkEstep(reps)
+        _check_abort()
+        return dict(zip(["M", "sites_per_second_fixed", "sites_per_second_dynamic",
+                         "max_loglik_deviation"], ret))
+
     property model:
         def __get__(self):
             return self._model
@@ -203,13 +253,73 @@ cdef class _PyInferenceManager:
         def __set__(self, bint sg):
             self._im.saveGamma = sg
 
+    property quantize_forward:
+        def __get__(self):
+            return self._im.quantizeForward
+        def __set__(self, bint q):
+            self._im.quantizeForward = q
+
+    property numa_aware:
+        def __get__(self):
+            return self._im.numaAware
+        def __set__(self, bint na):
+            self._im.numaAware = na
+
+    def validate_quantization(self):
+        """Compare the log likelihood, Q and storage used by the E step with
+        and without quantized forward variables."""
+        cdef vector[double] ret
+        with nogil:
+            ret = self._im.validateQuantization()
+        _check_abort()
+        return {"loglik": (ret[0], ret[1]), "Q": (ret[2], ret[3]),
+                "bytes": (ret[4], ret[5])}
+
+    def write_posterior(self, fn, header, origins=None, times=None, quantiles=None,
+                        int chunk_rows=4096):
+        """Run the E step, writing the posterior decoding of each
+        observation set to fn (see read_posterior) instead of storing the
+        gammas. origins gives the position of the first base of each set.
+        If quantiles are given, each observation is summarized by its
+        posterior mean TMRCA, using the given time for each hidden state,
+        its most probable hidden state and these quantiles of its TMRCA;
+        otherwise its posterior distribution is stored."""
+        if None in (self.theta, self.rho, self.alpha):
+            raise RuntimeError("theta / rho / alpha must be set")
+        cdef posterior_options opts
+        opts.path = fn.encode("UTF-8")
+        opts.header = header.encode("UTF-8")
+        opts.origins = [0] * self._num_hmms if origins is None else list(origins)
+        if quantiles:
+            opts.quantiles = list(quantiles)
+            opts.times = list(times)
+        opts.chunk_rows = chunk_rows
+        with nogil:
+            self._im.writePosterior(opts)
+        _check_abort()
+
+    def viterbi(self):
+        """Viterbi decoding of each observation set. Returns, for each
+        set, the most probable hidden state of each observation (that of
+        its last base) and the log probability of the path."""
+        if None in (self.theta, self.rho, self.alpha):
+            raise RuntimeError("theta / rho / alpha must be set")
+        cdef vector[viterbi_path] paths
+        with nogil:
+            paths = self._im.viterbi()
+        _check_abort()
+        return [(np.array(paths[i].states, dtype=np.int32), paths[i].logp)
+                for i in range(paths.size())]
+
     property hidden_states:
         def __get__(self):
             return self._im.hidden_states
         def __set__(self, hs):
-            if len(hs) != len(self._im.hidden_states):
-                raise RuntimeError("hidden states must be same size")
-            self._im.hidden_states = hs
+            if not np.all(np.sort(hs) == hs):
+                raise RuntimeError("Hidden states must be in ascending order")
+            self._hs = hs
+            with nogil:
+                self._im.setHiddenStates(self._hs)
 
     property emission_probs:
         def __get__(self):
@@ -306,6 +416,27 @@ cdef class _PyInferenceManager:
         _check_abort()
         return sum(llret)
 
+    def forward_loglik(self):
+        """Log likelihood of the observations under the current
+        parameters, by the forward algorithm alone. Unlike loglik, does
+        not need (or change) an E step."""
+        if None in (self.theta, self.rho, self.alpha):
+            raise RuntimeError("theta / rho / alpha must be set")
+        cdef vector[double] llret
+        with nogil:
+            llret = self._im.forwardLoglik()
+        _check_abort()
+        return sum(llret)
+
+    def set_weights(self, weights):
+        """Weight the contribution of each observation set to Q and loglik,
+        for example by the number of times it was drawn in a bootstrap
+        replicate. Sets of weight zero are skipped by the E step, which
+        must be rerun after changing the weights."""
+        cdef vector[double] w = [float(x) for x in weights]
+        with nogil:
+            self._im.setWeights(w)
+
 cdef class PyOnePopInferenceManager(_PyInferenceManager):
 
     def __cinit__(self, int n, observations, hidden_states, im_id, double polarization_error):
@@ -411,6 +542,26 @@ def raw_sfs(model, int n, double t1, double t2, below_only=False):
     return _store_admatrix_helper(dsfs, model.dlist)
 
 
+# Used for testing purposes only
+def check_fast_matrices(int n, int prec=0):
+    "Maximum relative error of fast matrix construction for sample size n."
+    cdef double ret
+    with nogil:
+        ret = fast_matrices_error(n, prec)
+    return ret
+
+# Used for testing purposes only
+def check_transition(model, hidden_states, double rho, int reps=1):
+    """Compare the double and mpfr implementations of the transition
+    matrix. Returns seconds per call for each, and the maximum absolute
+    deviation between them in values and derivatives."""
+    cdef ParameterVector pv = make_params_from_model(model)
+    cdef vector[double] hs = hidden_states
+    cdef vector[double] ret
+    with nogil:
+        ret = benchmark_transition(pv, hs, rho, reps)
+    return dict(zip(["time_double", "time_mpfr", "max_deviation", "max_deriv_deviation"], ret))
+
 # Used for testing purposes only
 def joint_csfs(int n1, int n2, int a1, int a2, model, hidden_states, int K=10):
     assert (a1 == 2 and a2 == 0) or (a1 == a2 == 1)
@@ -436,6 +587,175 @@ def joint_csfs(int n1, int n2, int a1, int a2, model, hidden_states, int K=10):
     return ret
 
 
+cdef class _ObservationStorage:
+    "Keeps the observations of a binary data file alive while an array refers to them."
+    cdef ObservationFile f
+
+def vcf2smc_available():
+    "True if smcpp was built with htslib, which the native vcf2smc requires."
+    return vcf2smc_available_()
+
+def is_binary_data(fn):
+    "True if fn is a binary SMC++ data file."
+    return is_observation_file(fn.encode("UTF-8"))
+
+def read_binary_data(fn):
+    """Read a binary SMC++ data file. Returns its JSON header and the
+    observations, which refer to a mapping of the file where possible."""
+    cdef _ObservationStorage s = _ObservationStorage()
+    cdef string path = fn.encode("UTF-8")
+    with nogil:
+        s.f = read_observations(path)
+    cdef np.npy_intp dims[2]
+    dims[0] = s.f.rows
+    dims[1] = s.f.cols
+    cdef np.ndarray ret = np.PyArray_SimpleNewFromData(2, dims, np.NPY_INT32, s.f.storage.get())
+    np.set_array_base(ret, s)
+    return s.f.header.decode("UTF-8"), ret
+
+def write_binary_data(fn, header, data, bint compress=True):
+    "Write observations and their JSON header to a binary SMC++ data file."
+    cdef int[:, ::1] d = np.ascontiguousarray(data, dtype=np.int32)
+    cdef string path = fn.encode("UTF-8")
+    cdef string hdr = header.encode("UTF-8")
+    cdef const int* p = NULL
+    if d.shape[0] > 0:
+        p = &d[0, 0]
+    with nogil:
+        write_observations(path, hdr, p, d.shape[0], d.shape[1], compress)
+
+def write_text_data(fn, header, data):
+    "Write observations and their JSON header to a text SMC++ data file."
+    cdef int[:, ::1] d = np.ascontiguousarray(data, dtype=np.int32)
+    cdef string path = fn.encode("UTF-8")
+    cdef string hdr = header.encode("UTF-8")
+    cdef const int* p = NULL
+    if d.shape[0] > 0:
+        p = &d[0, 0]
+    with nogil:
+        write_text_observations(path, hdr, p, d.shape[0], d.shape[1])
+
+def native_vcf2smc(vcf, contig, dist, undist, long contig_length, mask=None,
+                   missing_cutoff=None, bint drop_first_last=False, int regions=1):
+    """Convert a contig of an indexed VCF to SMC++ observations using
+    htslib, decoding regions of the contig in parallel. dist[j] and
+    undist[j] list the (sample id, haplotype) lineages of each population
+    for the j-th conversion; every record is decoded once for all of
+    them. Returns a list with, for each conversion, the observations and
+    the number of positions with more than one SNP."""
+    cdef vcf2smc_options opts
+    opts.vcf = vcf.encode("UTF-8")
+    opts.contig = contig.encode("UTF-8")
+    opts.mask = (mask or "").encode("UTF-8")
+    opts.dist = [[[(s.encode("UTF-8"), i) for s, i in pop] for pop in d] for d in dist]
+    opts.undist = [[[(s.encode("UTF-8"), i) for s, i in pop] for pop in u] for u in undist]
+    opts.contig_length = contig_length
+    opts.missing_cutoff = -1 if missing_cutoff is None or np.isinf(missing_cutoff) else missing_cutoff
+    opts.drop_first_last = drop_first_last
+    opts.regions = regions
+    cdef vector[vcf2smc_result] res
+    with nogil:
+        res = vcf2smc(opts)
+    return [(_rows_to_array(res[j].rows, 1 + 3 * len(dist[j])), res[j].multiples)
+            for j in range(res.size())]
+
+
+def read_posterior(fn, int contig=0, start=None, end=None):
+    """Read the observations of one observation set which overlap
+    [start, end) from a file written by write_posterior. Returns the
+    file's JSON header, and the position, span and stored values of
+    each observation."""
+    cdef string path = fn.encode("UTF-8")
+    cdef long s = np.iinfo(np.int64).min if start is None else start
+    cdef long e = np.iinfo(np.int64).max if end is None else end
+    cdef posterior_block b
+    with nogil:
+        b = read_posterior_(path, contig, s, e)
+    cdef size_t rows = b.starts.size()
+    starts = np.empty(rows, dtype=np.int64)
+    spans = np.empty(rows, dtype=np.int32)
+    values = np.empty([rows, b.width], dtype=np.float32)
+    cdef long[::1] vstarts = starts
+    cdef int[::1] vspans = spans
+    cdef float[:, ::1] vvalues = values
+    if rows > 0:
+        memcpy(&vstarts[0], b.starts.data(), rows * sizeof(long))
+        memcpy(&vspans[0], b.spans.data(), rows * sizeof(int))
+        memcpy(&vvalues[0, 0], b.values.data(), b.values.size() * sizeof(float))
+    return b.header.decode("UTF-8"), starts, spans, values
+
+
+cdef _rows_to_array(const vector[int] &rows, int cols):
+    ret = np.empty([rows.size() // cols, cols], dtype=np.int32)
+    cdef int[:, ::1] vret = ret
+    if rows.size() > 0:
+        memcpy(&vret[0, 0], rows.data(), rows.size() * sizeof(int))
+    return ret
+
+
+cdef vector[contig_data] _contig_data(contigs, arrays) except *:
+    # arrays keeps the observations alive while they are in use.
+    cdef vector[contig_data] ret
+    cdef contig_data cd
+    cdef int[:, ::1] v
+    for c in contigs:
+        A = np.ascontiguousarray(c.data, dtype=np.int32)
+        arrays.append(A)
+        v = A
+        cd.data = &v[0, 0] if v.shape[0] > 0 else NULL
+        cd.rows = v.shape[0]
+        cd.cols = v.shape[1]
+        cd.a = [int(x) for x in c.a]
+        cd.n = [int(x) for x in c.n]
+        ret.push_back(cd)
+    return ret
+
+
+def normalize_contigs(contigs, long nonseg_cutoff, bint recode_nonseg, long span_cutoff, long min_length):
+    """RecodeNonseg, Compress, BreakLongSpans and DropSmallContigs in one
+    pass over each contig, in parallel (see data_filter.Normalize).
+    Returns, for each contig, the observations of the pieces which were
+    kept, the spans of the long runs of homozygosity and the spans of
+    the missing stretches at which the contig was split."""
+    arrays = []
+    cdef vector[contig_data] cds = _contig_data(contigs, arrays)
+    cdef normalize_options opts
+    opts.nonseg_cutoff = nonseg_cutoff
+    opts.recode_nonseg = recode_nonseg
+    opts.span_cutoff = span_cutoff
+    opts.min_length = min_length
+    cdef vector[normalize_result] res
+    with nogil:
+        res = normalize_contigs_(cds, opts)
+    cdef size_t i, j
+    ret = []
+    for i in range(res.size()):
+        pieces = [_rows_to_array(res[i].pieces[j], cds[i].cols) for j in range(res[i].pieces.size())]
+        ret.append((pieces, list(res[i].long_runs), list(res[i].long_missing)))
+    return ret
+
+
+def prepare_contigs(contigs, thinning, int w):
+    """Thin, BinObservations, RecodeMonomorphic, Compress, Validate and
+    DropUninformativeContigs in one pass over each contig, in parallel
+    (see data_filter.PrepareObservations). thinning gives the thinning
+    interval of each contig. Returns, for each contig, the observations,
+    the rows which failed validation, the number of rows recoded as
+    non-segregating and whether the contig has any variable sites."""
+    arrays = []
+    cdef vector[contig_data] cds = _contig_data(contigs, arrays)
+    cdef vector[int] th = thinning
+    cdef vector[prepare_result] res
+    with nogil:
+        res = prepare_contigs_(cds, th, w)
+    cdef size_t i
+    ret = []
+    for i in range(res.size()):
+        ret.append((_rows_to_array(res[i].data, cds[i].cols), list(res[i].invalid),
+                    res[i].recoded, res[i].informative))
+    return ret
+
+
 # @cython.boundscheck(False)
 def realign(contig, int w):
     'Realign contig data to have a split every w bps'
@@ -17,8 +17,11 @@ logger = logging.getLogger(__name__)
 class Analysis(base.BaseAnalysis):
     """A dataset, model and inference manager to be used for estimation."""
 
-    def __init__(self, files, args):
-        super().__init__(files, args)
+    def __init__(self, files, args, source=None, random_state=None):
+        super().__init__(files, args, source)
+        # Random draws use random_state, if given, instead of the global
+        # numpy state (cv fits several folds at once, in threads).
+        self._random_state = random_state
 
         if self.npop != 1:
             logger.error("Please use 'smc++ split' to estimate two-population models")
@@ -42,7 +45,7 @@ class Analysis(base.BaseAnalysis):
         self._init_inference_manager(args.polarization_error, self.hidden_states)
         self.alpha = 1
         self._model[:] = np.log(NeN0)
-        self._model.randomize()
+        self._model.randomize(self._random_state)
         self._init_optimizer(
             args.outdir,
             args.base,
@@ -56,12 +59,7 @@ class Analysis(base.BaseAnalysis):
         self.run(1)
 
         pipe = self._pipeline
-        pipe.add_filter(data_filter.Thin(thinning=args.thinning))
-        pipe.add_filter(data_filter.BinObservations(w=args.w))
-        pipe.add_filter(data_filter.RecodeMonomorphic())
-        pipe.add_filter(data_filter.Compress())
-        pipe.add_filter(data_filter.Validate())
-        pipe.add_filter(data_filter.DropUninformativeContigs())
+        pipe.add_filter(self._prepare_filter(args))
         pipe.add_filter(data_filter.Summarize())
         try:
             self._empirical_tmrca(2 * args.knots)
@@ -87,6 +85,23 @@ class Analysis(base.BaseAnalysis):
         )
         self._init_regularization(args)
 
+    @staticmethod
+    def _prepare_filter(args):
+        return data_filter.PrepareObservations(thinning=args.thinning, w=args.w)
+
+    @classmethod
+    def shared_pipeline(cls, files, args):
+        """
+        Pipeline applying the per-contig filters of an analysis to all of
+        files. Analyses of subsets of them which are given it as their
+        source take their contigs from it instead of loading and
+        preprocessing the files again.
+        """
+        pipe = cls._load_pipeline(files, args)
+        pipe.keep_stages = True
+        pipe.add_filter(cls._prepare_filter(args))
+        return pipe
+
     def _init_model(self, spline_class):
         ## Initialize model
         logger.debug("knots in coalescent scaling:\n%s", str(self._knots))
@@ -141,7 +156,8 @@ class Analysis(base.BaseAnalysis):
         logger.debug("Unresampled quantiles (0/10/25/50/75/100): %s",
                      scipy.stats.mstats.mquantiles(X, [0, .1, .25, .5, .75, 1.]))
         # fit a k-poisson mixture model
-        gmm = sklearn.mixture.GaussianMixture(n_components=k).fit(X[:, None])
+        gmm = sklearn.mixture.GaussianMixture(
+            n_components=k, random_state=self._random_state).fit(X[:, None])
         Y = gmm.sample(n_samples=100000)[0]
         p = np.logspace(np.log10(.01), np.log10(.99), k)
         q = scipy.stats.mstats.mquantiles(Y[Y>0], p) / (2 * self._theta * w)
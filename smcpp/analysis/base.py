@@ -17,7 +17,7 @@ _model_cls_d = {cls.__name__: cls for cls in (SMCModel, SMCTwoPopulationModel)}
 class BaseAnalysis:
     "Base class for analysis of population genetic data."
 
-    def __init__(self, files, args):
+    def __init__(self, files, args, source=None):
         # Misc. parameter initialiations
         self._args = args
         if args.cores is not None:
@@ -43,13 +43,9 @@ class BaseAnalysis:
         if args.polarization_error > 0.:
             logger.debug("Polarization error p=%f", args.polarization_error)
 
-        # Load data and apply transformations to normalize
-        pipe = self._pipeline = data_filter.DataPipeline(files)
-        pipe.add_filter(load_data=data_filter.LoadData())
-        pipe.add_filter(data_filter.RecodeNonseg(cutoff=args.nonseg_cutoff))
-        pipe.add_filter(data_filter.Compress())
-        pipe.add_filter(data_filter.BreakLongSpans(cutoff=100000))
-        pipe.add_filter(data_filter.DropSmallContigs(100000))
+        # Load data and apply transformations to normalize. If source is
+        # given, the contigs are taken from it (see DataPipeline.source).
+        pipe = self._pipeline = self._load_pipeline(files, args, source)
         pipe.add_filter(watterson=data_filter.Watterson())
         pipe.add_filter(
             mutation_counts=data_filter.CountMutations(
@@ -57,6 +53,19 @@ class BaseAnalysis:
             )
         )
 
+    @staticmethod
+    def _load_pipeline(files, args, source=None):
+        "Pipeline which loads and normalizes the data."
+        cache_dir = data_filter.default_cache_dir() if smcpp.defaults.cache_data else None
+        pipe = data_filter.DataPipeline(files, cache_dir, source)
+        pipe.add_filter(load_data=data_filter.LoadData())
+        pipe.add_filter(
+            data_filter.Normalize(
+                nonseg_cutoff=args.nonseg_cutoff, span_cutoff=100000, min_length=100000
+            )
+        )
+        return pipe
+
     @property
     def hidden_states(self):
         return self._hs
@@ -72,8 +81,10 @@ class BaseAnalysis:
 
     def _init_optimizer(self, outdir, base, algorithm, xtol, ftol, single):
         self._optimizer = self._OPTIMIZER_CLS(self, algorithm, xtol, ftol, single)
+        self._saver = None
         if outdir:
-            self._optimizer.register_plugin(analysis_saver.AnalysisSaver(outdir, base))
+            self._saver = analysis_saver.AnalysisSaver(outdir, base)
+            self._optimizer.register_plugin(self._saver)
 
     def rescale(self, x):
         return x / (2. * self._N0)
@@ -83,12 +94,16 @@ class BaseAnalysis:
 
     def _init_inference_manager(self, polarization_error, hs):
         ## Create inference object which will be used for all further calculations.
+        self._alpha = 1
+        self._ims = self._make_inference_managers(self.contigs, polarization_error, hs)
+
+    def _make_inference_managers(self, contigs, polarization_error, hs):
         logger.debug("Creating inference manager...")
         d = {}
         max_n = {}
         a = {}
-        self._ims = {}
-        for c in self.contigs:
+        ims = {}
+        for c in contigs:
             d.setdefault(c.pid, []).append(c)
             max_n.setdefault(c.pid, -1)
             max_n[c.pid] = np.maximum(max_n[c.pid], c.n)
@@ -105,11 +120,13 @@ class BaseAnalysis:
                 im = _smcpp.PyTwoPopInferenceManager(
                     *(max_n[pid]), *s.pop(), data, hs[pid[0]], pid, polarization_error
                 )
+            im.numa_aware = smcpp.defaults.numa
             im.model = self._model
             im.theta = self._theta
             im.rho = self._rho
-            im.alpha = self._alpha = 1
-            self._ims[pid] = im
+            im.alpha = self._alpha
+            ims[pid] = im
+        return ims
 
     # @property
     # def _data(self):
@@ -143,6 +160,73 @@ class BaseAnalysis:
             ll -= self._penalty * float(self.model.regularizer())
         return ll
 
+    def held_out_loglik(self, contigs):
+        """Log-likelihood of other (e.g. held-out) contigs under the current
+        model and parameters, computed by the forward algorithm alone."""
+        ims = self._make_inference_managers(
+            contigs, self._args.polarization_error, self.hidden_states
+        )
+        return sum(im.forward_loglik() for im in ims.values())
+
+    def set_weights(self, weights=None, contigs=None):
+        """Weight the contribution of each contig to Q and the
+        log-likelihood. None gives every contig weight one. The contigs
+        are those the inference managers were made from (by default, the
+        analysis's)."""
+        if contigs is None:
+            contigs = self.contigs
+        if weights is None:
+            weights = np.ones(len(contigs))
+        assert len(weights) == len(contigs)
+        # The observations of each inference manager are the contigs of its
+        # populations, in order (see _make_inference_managers).
+        d = {}
+        for c, w in zip(contigs, weights):
+            d.setdefault(c.pid, []).append(w)
+        for pid, w in d.items():
+            self._ims[pid].set_weights(w)
+
+    def bootstrap(self, replicates, size, seed=None):
+        """
+        Fit the model to block bootstrap replicates of the data, where the
+        blocks are the contigs split into pieces of (about) size bins (see
+        data_filter.SplitBlocks). A replicate draws as many blocks as there
+        are, with replacement, and weights the E-step statistics of each by
+        the number of times it was drawn, so the blocks are split and held
+        in memory once for all of them. The current fit, and the inference
+        managers, are left as they were. Each fit starts from the current
+        estimates, and is saved as {base}.bootstrap<i>.final.json. Returns
+        the fitted models.
+        """
+        rs = np.random.RandomState(seed)
+        blocks = data_filter.SplitBlocks(size)(self.contigs)
+        K = len(blocks)
+        ims = self._ims
+        self._ims = self._make_inference_managers(
+            blocks, self._args.polarization_error, self.hidden_states
+        )
+        x0 = self.model[:].astype("float")
+        rho0 = self.rho
+        base = self._saver.base if self._saver is not None else None
+        models = []
+        try:
+            for i in range(replicates):
+                logger.info("Bootstrap replicate %d/%d", i + 1, replicates)
+                self.set_weights(rs.multinomial(K, np.full(K, 1. / K)), blocks)
+                self.model[:] = x0
+                self.rho = rho0
+                if base is not None:
+                    self._saver.base = "{}.bootstrap{}".format(base, i)
+                self.run()
+                models.append(self.model.copy())
+        finally:
+            self._ims = ims
+            self.model[:] = x0
+            self.rho = rho0
+            if base is not None:
+                self._saver.base = base
+        return models
+
     @property
     def model(self):
         return self._model
@@ -1,2 +1,2 @@
 from . import vcf2smc, estimate, split, chunk, cite, plot, \
-    posterior, version, cv, simulate
+    posterior, version, cv, simulate, convert
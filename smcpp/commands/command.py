@@ -5,7 +5,7 @@ import os
 import os.path
 import sys
 
-from .. import logging, _smcpp
+from .. import logging, _smcpp, data_filter
 import smcpp.defaults
 
 logger = logging.getLogger(__name__)
@@ -29,11 +29,21 @@ class Command:
         parser.add_argument('--cores', type=int, default=None, 
                 help="Number of worker processes / threads "
                      "to use in parallel calculations")
+        parser.add_argument('--fast-matrices', action='store_true', default=False,
+                help="construct the matrices used to compute the SFS using "
+                     "multiprecision floating point instead of exact rational "
+                     "arithmetic. much faster for large sample sizes")
+        parser.add_argument('--numa', action='store_true', default=False,
+                help="pin worker threads to NUMA nodes and keep the data "
+                     "used by each thread in the memory of its node. may "
+                     "improve scaling on multi-socket machines")
 
     def main(self, args):
         np.random.seed(args.seed)
         logging.setup_logging(args.verbose)
         smcpp.defaults.cores = args.cores
+        smcpp.defaults.fast_matrices = args.fast_matrices
+        smcpp.defaults.numa = args.numa
 
 class EstimationCommand(Command):
     def __init__(self, parser):
@@ -48,6 +58,9 @@ class EstimationCommand(Command):
         # any debugging output generated there gets logged
         logging.add_debug_log(os.path.join(args.outdir, ".debug.txt"))
         super().main(args)
+        if args.clear_cache:
+            data_filter.clear_cache()
+        smcpp.defaults.cache_data = args.cache
         logger.debug(sys.argv)
         logger.debug(args)
 
@@ -64,6 +77,12 @@ def add_common_estimation_args(parser):
                       help="recode nonsegregating spans > cutoff as missing. "
                       "default: do not recode.",
                       type=int)
+    data.add_argument('--cache', action='store_true', default=False,
+                      help="cache the preprocessed data on disk. later runs on the same "
+                      "data files with the same preprocessing parameters start from the "
+                      "cached data. cached data are kept until removed with --clear-cache")
+    data.add_argument('--clear-cache', action='store_true', default=False,
+                      help="remove all cached preprocessed data before starting")
     data.add_argument('--thinning', help="only emit full SFS every <k>th site. (k > 0)",
                       default=None, type=check_positive, metavar="k")
     data.add_argument('-w', default=100, help="window size. sites are grouped into blocks of size <w>. "
@@ -0,0 +1,30 @@
+from . import command
+from ..logging import getLogger
+from .. import estimation_tools, _smcpp
+
+logger = getLogger(__name__)
+
+
+class Convert(command.Command, command.ConsoleCommand):
+    "Convert SMC++ data files between the text and binary formats"
+
+    def __init__(self, parser):
+        command.Command.__init__(self, parser)
+        parser.add_argument("--no-compress", action="store_true", default=False,
+                            help="store the observations of a binary file uncompressed, "
+                            "so that they are used directly from the file without "
+                            "being read into memory")
+        parser.add_argument("input", help="data file in SMC++ format")
+        parser.add_argument("output", help="converted data file. A binary input is "
+                            "converted to text (gzipped if output ends in .gz), and "
+                            "vice versa.")
+
+    def main(self, args):
+        command.Command.main(self, args)
+        if _smcpp.is_binary_data(args.input):
+            header, A = _smcpp.read_binary_data(args.input)
+            _smcpp.write_text_data(args.output, header, A)
+        else:
+            header, A = estimation_tools.read_text_data(args.input)
+            _smcpp.write_binary_data(args.output, header, A, not args.no_compress)
+        logger.info("Wrote %d observations to %s", len(A), args.output)
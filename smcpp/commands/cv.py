@@ -1,5 +1,7 @@
 import argparse
+from concurrent.futures import ThreadPoolExecutor
 import contextlib
+import copy
 import json
 import numpy as np
 import os
@@ -37,6 +39,11 @@ class Cv(command.EstimationCommand, command.ConsoleCommand):
         parser.add_argument(
             "--fold", type=int, help="run a specific fold only, useful for parallelizing"
         )
+        parser.add_argument(
+            "--fold-jobs", type=int, default=None,
+            help="number of folds to run at once, sharing --cores between them. "
+            "default: all of them"
+        )
         parser.add_argument("data", nargs="+", help="data file(s) in SMC++ format")
 
     def main(self, args):
@@ -58,44 +65,37 @@ class Cv(command.EstimationCommand, command.ConsoleCommand):
         best_models = [None] * len(folds)
         def fold_path(i):
             return os.path.join(basedir, "fold{}".format(i))
-        for i, fold in enumerate(folds):
+        todo = []
+        for i in range(len(folds)):
             if args.fold is not None and args.fold != i:
                 logger.debug("Skipping fold %d since '--fold %d' was specified", i, args.fold)
                 continue
-            fp = fold_path(i)
-            with mark_completed(fp) as p:
-                if p.exists():
-                    logger.debug("Skipping fold %d (encountered %s)", i, p)
-                    with open(os.path.join(fp, "model.best.json"), "rt") as f:
-                        d = json.load(f)
-                        best_models[i] = model.SMCModel.from_dict(d['model'])
-                    continue
-                args.outdir = fp
-                os.makedirs(args.outdir, exist_ok=True)
-                test = Analysis([args.data[j] for j in range(L) if j in fold], args)
-                best = float("-Inf")
-                for j in range(2, 10):
-                    args.regularization_penalty = j
-                    train = Analysis(
-                        [args.data[k] for k in range(L) if k not in fold], args
-                    )
-                    train.run()
-                    test.model = train.model
-                    test.E_step()
-                    logger.debug(
-                        "STEP 1a: rp=%d train=%f test=%f",
-                        j,
-                        float(train.loglik(True)),
-                        float(test.loglik(False)),
+            p = Path(fold_path(i), ".done")
+            if p.exists():
+                logger.debug("Skipping fold %d (encountered %s)", i, p)
+                with open(os.path.join(fold_path(i), "model.best.json"), "rt") as f:
+                    best_models[i] = model.SMCModel.from_dict(json.load(f)['model'])
+                continue
+            todo.append(i)
+        if todo:
+            # The data are loaded and preprocessed once, and every fold
+            # selects its contigs from them. The folds run concurrently,
+            # each with its share of the cores.
+            source = Analysis.shared_pipeline(args.data, args)
+            source.run()
+            jobs = min(args.fold_jobs or len(todo), len(todo))
+            cores = max(1, (args.cores or os.cpu_count()) // jobs)
+            logger.info("Running %d folds, %d at a time with %d cores each",
+                        len(todo), jobs, cores)
+            with ThreadPoolExecutor(jobs) as pool:
+                futures = {
+                    i: pool.submit(
+                        self._run_fold, i, folds[i], fold_path(i), source, args, cores
                     )
-                    if test.loglik(False) > best:
-                        best_models[i] = train.model
-                        f = os.path.join(args.outdir, "model.best.json")
-                        shutil.copyfile(
-                            os.path.join(args.outdir, "model.final.json"),
-                            f
-                        )
-                        d = json.load(open(f, "rt"))
+                    for i in todo
+                }
+                for i, fut in futures.items():
+                    best_models[i] = fut.result()
 
         if args.fold is not None:
             sys.exit(0)
@@ -106,6 +106,8 @@ class Cv(command.EstimationCommand, command.ConsoleCommand):
             sys.exit(0)
         logger.info("Averaging over folds")
         # STEP 2
+        with open(os.path.join(fold_path(0), "model.best.json"), "rt") as f:
+            d = json.load(f)
         mavg = model.aggregate(*best_models)
         d.update({"model": mavg.to_dict()})
         json.dump(
@@ -114,3 +116,39 @@ class Cv(command.EstimationCommand, command.ConsoleCommand):
             sort_keys=True,
             indent=4,
         )
+
+    def _run_fold(self, i, fold, fp, source, args, cores):
+        # Runs in a thread of its own; the number of threads used by the
+        # native code is set per thread. The fold draws its random numbers
+        # from a state of its own, so they do not depend on the other
+        # threads.
+        rs = np.random.RandomState([args.seed, i])
+        args = copy.copy(args)
+        args.outdir = fp
+        args.cores = cores
+        os.makedirs(fp, exist_ok=True)
+        L = len(args.data)
+        train_files = [args.data[k] for k in range(L) if k not in fold]
+        test = source.select([args.data[k] for k in fold])
+        best = float("-Inf")
+        best_model = None
+        with mark_completed(fp):
+            for j in range(2, 10):
+                args.regularization_penalty = j
+                train = Analysis(train_files, args, source, random_state=rs)
+                train.run()
+                # The held-out contigs are scored by the forward algorithm
+                # alone, under the trained model and hidden states.
+                ll = train.held_out_loglik(test)
+                logger.debug(
+                    "STEP 1a: %s rp=%d train=%f test=%f",
+                    fp, j, float(train.loglik(True)), ll,
+                )
+                if ll > best:
+                    best = ll
+                    best_model = train.model
+                    shutil.copyfile(
+                        os.path.join(fp, "model.final.json"),
+                        os.path.join(fp, "model.best.json"),
+                    )
+        return best_model
@@ -28,6 +28,12 @@ class Estimate(command.EstimationCommand, command.ConsoleCommand):
         '''Configure parser and parse args.'''
         command.add_pop_parameters(parser)
         model = command.add_model_parameters(parser)
+        parser.add_argument('--bootstrap', type=int, default=0, metavar="B",
+                            help="also fit B block bootstrap replicates of the data, "
+                            "and write pointwise 95%% intervals of the population "
+                            "size to {base}.bootstrap.csv")
+        parser.add_argument('--bootstrap-block-size', type=int, default=int(5e6),
+                            help="length of the blocks resampled by --bootstrap (bp)")
         parser.add_argument('data', nargs="+",
                             help="data file(s) in SMC++ format")
 
@@ -37,6 +43,10 @@ class Estimate(command.EstimationCommand, command.ConsoleCommand):
         if not (1e-11 <= args.mu <= 1e-5):
             logger.warn(
                 "The per-generation mutation rate is %g. Is this correct?" % args.mu)
+        if args.bootstrap < 0 or args.bootstrap_block_size < args.w:
+            logger.error("--bootstrap must be non-negative and "
+                         "--bootstrap-block-size at least -w")
+            sys.exit(1)
 
 
     def main(self, args):
@@ -46,3 +56,23 @@ class Estimate(command.EstimationCommand, command.ConsoleCommand):
         # Construct analysis
         analysis = Analysis(args.data, args)
         analysis.run()
+        if args.bootstrap:
+            # The prepared data are in bins of w bases.
+            models = analysis.bootstrap(
+                args.bootstrap, max(1, args.bootstrap_block_size // args.w), args.seed)
+            self._write_intervals(
+                analysis.model, models,
+                os.path.join(args.outdir, args.base + ".bootstrap.csv"))
+
+    def _write_intervals(self, m, models, fn):
+        # Population sizes of each replicate on the pieces of the fitted
+        # model, scaled as in `smc++ plot`.
+        t = 2 * m.N0 * np.r_[0., np.cumsum(m.s)[:-1]]
+        y = m.N0 * np.array([mm.stepwise_values().astype("float") for mm in models])
+        lower, median, upper = np.percentile(y, [2.5, 50, 97.5], axis=0)
+        ne = m.N0 * m.stepwise_values().astype("float")
+        with open(fn, "wt") as f:
+            f.write("t,Ne,lower,median,upper\n")
+            for row in zip(t, ne, lower, median, upper):
+                f.write(",".join("%g" % x for x in row) + "\n")
+        logger.info("Wrote bootstrap intervals to %s", fn)
@@ -15,6 +15,7 @@ import json
 import os
 
 from .. import _smcpp, util, model, estimation_tools
+from ..version import version
 from . import command
 from smcpp.logging import getLogger
 logger = getLogger(__name__)
@@ -35,10 +36,25 @@ class Posterior(command.Command, command.ConsoleCommand):
                             metavar="heatmap.(pdf|png|gif|jpeg)",
                             help="Also draw a heatmap of the posterior TMRCA.")
         parser.add_argument("--colorbar", action="store_true", help="If plotting, add a colorbar")
+        parser.add_argument("--quantiles", type=lambda s: [float(x) for x in s.split(",")],
+                            metavar="q1,q2,...",
+                            help="Instead of the full posterior, store the posterior mean "
+                            "TMRCA, most probable hidden state and these quantiles of the "
+                            "TMRCA at each site. Not supported for .npz output.")
+        parser.add_argument("--viterbi", metavar="segments.tsv",
+                            help="Also write the most probable TMRCA path, as segments "
+                            "of constant hidden state (data set, start, end, state, and "
+                            "the bounds of its TMRCA interval). The decoded state of "
+                            "an observation spanning several bases is that of its last "
+                            "base, so a segment starts at the last base of its first "
+                            "observation, and the other bases of that observation are "
+                            "in no segment")
         parser.add_argument("model", type=str, metavar="model.final.json",
                             help="SMC++ model to use in forward-backward algorithm")
-        parser.add_argument("output", metavar="arrays.npz", 
-                            help="location to save posterior decoding arrays")
+        parser.add_argument("output", metavar="arrays.npz|posterior.smcp",
+                            help="location to save posterior decoding arrays. Unless "
+                            "it ends in .npz, the decoding is streamed to an indexed "
+                            "file as it is computed (see _smcpp.read_posterior)")
         parser.add_argument("data", type=str, nargs="+", 
                 metavar="data.smc[.gz]", help="SMC++ data set(s) to decode")
         hmm = parser.add_argument_group("HMM parameters")
@@ -51,6 +67,10 @@ class Posterior(command.Command, command.ConsoleCommand):
         if args.colorbar and not args.heatmap:
             logger.error("Can't specify --colorbar without --heatmap")
             sys.exit(1)
+        stream = not args.output.endswith(".npz")
+        if args.quantiles and (not stream or args.heatmap):
+            logger.error("--quantiles requires streamed output and no --heatmap")
+            sys.exit(1)
         j = json.load(open(args.model, "rt"))
         klass = getattr(model, j['model']['class'])
         m = klass.from_dict(j['model'])
@@ -63,6 +83,7 @@ class Posterior(command.Command, command.ConsoleCommand):
             m.distinguished_model, args.M + 1) / (2. * m.distinguished_model.N0)
         logger.debug("hidden states (balanced w/r/t model): %s", np.array(hidden_states).round(3))
         all_obs = []
+        origins = []
         n = a = None
         for contig in contigs:
             obs = contig.data
@@ -80,7 +101,12 @@ class Posterior(command.Command, command.ConsoleCommand):
             ## FIXME? Due to the compressed input format the endpoints are only
             ## approximately picked out.
             pos = np.cumsum(obs[:, 0])
-            obs = obs[(pos >= lb) & (pos <= ub)]
+            keep = (pos >= lb) & (pos <= ub)
+            # Position of the first base, counting the missing base
+            # inserted below.
+            first = (pos - obs[:, 0])[keep]
+            origins.append((first[0] if len(first) else lb) - 1)
+            obs = obs[keep]
             obs = np.insert(obs, 0, [[1] + [-1, 0, 0] * npop], 0)
             all_obs.append(obs)
         # Perform thinning, if requested
@@ -96,27 +122,46 @@ class Posterior(command.Command, command.ConsoleCommand):
         im.theta = j['theta']
         im.rho = j['rho']
         im.alpha = j['alpha']
-        im.save_gamma = True
         im.model = m
-        im.E_step()
-        gammas = im.gammas
-        for g in gammas:
-            Lr = g.sum(axis=0)
-            g /= Lr
-            L = Lr.sum()
-        if os.environ.get("SMCPP_DEBUG"):
-            import ipdb
-            ipdb.set_trace()
-        kwargs = {path: g for path, g in zip(args.data, gammas)}
-        kwargs.update({path + "_sites": obs[:, 0] for path, obs in zip(args.data, all_obs)})
-        np.savez_compressed(args.output, hidden_states=hidden_states, **kwargs)
+        if stream:
+            # Each HMM writes its decoding as the backward pass produces
+            # it, so the M x L matrix of gammas is never stored.
+            header = {"version": version, "model": j['model'],
+                      "hidden_states": list(hidden_states), "data": args.data,
+                      "quantiles": args.quantiles or []}
+            times = None
+            if args.quantiles:
+                eta = _smcpp.PyRateFunction(m.distinguished_model, hidden_states)
+                times = [float(t) for t in eta.average_coal_times()]
+            im.write_posterior(args.output, json.dumps(header), origins, times, args.quantiles)
+        else:
+            im.save_gamma = True
+            im.E_step()
+            gammas = im.gammas
+            for g in gammas:
+                g /= g.sum(axis=0)
+            if os.environ.get("SMCPP_DEBUG"):
+                import ipdb
+                ipdb.set_trace()
+            kwargs = {path: g for path, g in zip(args.data, gammas)}
+            kwargs.update({path + "_sites": obs[:, 0] for path, obs in zip(args.data, all_obs)})
+            np.savez_compressed(args.output, hidden_states=hidden_states, **kwargs)
+        if args.viterbi:
+            self._write_viterbi(args.viterbi, im.viterbi(), args.data, all_obs, origins,
+                                hidden_states)
         if args.heatmap:
             obs = all_obs[0]
             if len(args.data) > 1:
                 logger.error("--heatmap is only supported for one data set")
                 sys.exit(1)
             # Plotting code
-            gamma = g
+            if stream:
+                # The initial distribution is not stored.
+                _, _, _, values = _smcpp.read_posterior(args.output)
+                gamma = np.insert(values.T, 0, values[0], axis=1)
+            else:
+                gamma = gammas[0]
+            L = obs[:, 0].sum() + 1
             fig, ax = plt.subplots()
             x = np.insert(np.cumsum(obs[:, 0]), 0, 0)
             y = hidden_states[:-1]
@@ -142,3 +187,18 @@ class Posterior(command.Command, command.ConsoleCommand):
                 plt.colorbar(img)
             plt.savefig(args.heatmap)
             plt.close()
+
+    def _write_viterbi(self, fn, paths, names, all_obs, origins, hidden_states):
+        with open(fn, "wt") as f:
+            f.write("data\tstart\tend\tstate\tt_lower\tt_upper\n")
+            for name, (states, _), obs, origin in zip(names, paths, all_obs, origins):
+                ends = origin + np.cumsum(obs[:, 0])
+                # Observations at which the state changes. Only the last
+                # base of the first observation of a segment is known to
+                # be in its state (see HMM::viterbi).
+                breaks = np.flatnonzero(np.diff(states)) + 1
+                for i, j in zip(np.r_[0, breaks], np.r_[breaks, len(states)]):
+                    k = states[i]
+                    f.write("%s\t%d\t%d\t%d\t%g\t%g\n" % (
+                        name, ends[i] - 1, ends[j - 1], k,
+                        hidden_states[k], hidden_states[k + 1]))
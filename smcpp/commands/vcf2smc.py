@@ -1,4 +1,5 @@
 import argparse
+import os
 import warnings
 import itertools as it
 from logging import getLogger
@@ -7,12 +8,14 @@ import sys
 from pysam import VariantFile, TabixFile
 import json
 from collections import Counter, namedtuple
+from concurrent.futures import ThreadPoolExecutor
 import tqdm
 logger = getLogger(__name__)
 
 from ..logging import setup_logging
 from ..util import optional_gzip, RepeatingWriter
 from ..version import version
+from .. import _smcpp, defaults
 from . import command
 
 
@@ -37,6 +40,10 @@ class Vcf2Smc(command.Command, command.ConsoleCommand):
         parser.add_argument("-d", nargs=2, metavar="sample_id",
                             help="identity of distinguished lineages. First allele from sample_id 1 and "
                             "second allele from sample_id 2 will be used.")
+        parser.add_argument("-D", metavar="sample_id,...",
+                            help="comma-separated list (or @file) of distinguished individuals. "
+                            "One output is written for each, reading the VCF only once. "
+                            "The output name must contain {sample}.")
         # override length field of chromosome
         parser.add_argument("--length", "-l", type=int,
                             help="Length of contig. Default: length in VCF header")
@@ -48,11 +55,16 @@ class Vcf2Smc(command.Command, command.ConsoleCommand):
         parser.add_argument("--mask", "-m",
                             help="BED-formatted mask of missing regions")
         parser.add_argument("--drop-first-last", action="store_true")
+        parser.add_argument("--python", action="store_true", default=False,
+                            help="use the Python converter even if smcpp was built with htslib")
         parser.add_argument("vcf", metavar="vcf.gz",
                             help="indexed VCF file")
         parser.add_argument("out", metavar="out[.gz]",
-                            help="output SMC++ file")
-        parser.add_argument("contig", help="contig to parse")
+                            help="output SMC++ file. Written in the binary format if "
+                            "it ends in .bin")
+        parser.add_argument("contig", help="contig to parse. May be a comma-separated list, "
+                            "or 'all' for every contig in the VCF header, in which case "
+                            "the output name must contain {contig}.")
         parser.add_argument("pop1", type=sample_list,
                             help="List of sample ids from population 1. "
                             "Format: <pop_id>:<sample_id_1>,<sample_id_2>,...,<sample_id_N>")
@@ -87,13 +99,98 @@ class Vcf2Smc(command.Command, command.ConsoleCommand):
                     raise RuntimeError(
                         "Population %s has duplicated samples: %s" %
                         (pid, [item for item in c.items() if item[1] > 1]))
+        npop = 1
+        if args.pop2.pid is not None:
+            npop = 2
+            common = set(args.pop1.samples) & set(args.pop2.samples)
+            if common:
+                logger.error("Populations 1 and 2 should be disjoint, "
+                             "but both contain " + ", ".join(common))
+                sys.exit(1)
+
+        # Each distinguished individual (or pair of lineages given by -d)
+        # produces one output per contig.
+        if args.D:
+            if args.d:
+                raise RuntimeError("-d and -D are mutually exclusive")
+            ids = args.D.split(",")
+            if len(ids) == 1 and ids[0][0] == "@":
+                ids = open(ids[0][1:], "rt").read().strip().split("\n")
+            specs = [(sid, [sid + ":0", sid + ":1"]) for sid in ids]
+        else:
+            d = args.d or [args.pop1.samples[0]] * 2
+            specs = [(d[0], [d[0] + ":0", d[1] + ":1"])]
+        lineages = [self._lineages(args, d, npop) for _, d in specs]
+        for dist, undist in lineages:
+            for i in range(1, npop + 1):
+                logger.info("Population %d:" % i)
+                logger.info("Distinguished lineages: " +
+                            ", ".join("%s:%d" % t for t in dist[i - 1]))
+                logger.info("Undistinguished lineages: " +
+                            ", ".join("%s:%d" % t for t in undist[i - 1]))
+
+        # Start parsing
+        vcf = VariantFile(args.vcf)
+        samples = list(vcf.header.samples)
+        for dist, undist in lineages:
+            if not set([dd[0] for d in dist for dd in d]) <= set(samples):
+                raise RuntimeError("Distinguished lineages not found in data?")
+        missing = sorted({s for _, undist in lineages for u in undist for s, _ in u if s not in samples})
+        if missing:
+            msg = "The following samples were not found in the data: %s. " % ", ".join(
+                missing)
+            if args.ignore_missing:
+                logger.warn(msg)
+            else:
+                msg += "If you want to continue without these samples, use --ignore-missing."
+                raise RuntimeError(msg)
+        lineages = [(dist, [[t for t in u if t[0] not in missing] for u in undist])
+                    for dist, undist in lineages]
+        pids = [a.pid for a in (args.pop1, args.pop2)[:npop]]
+        headers = [json.dumps({"version": version, "pids": pids, "undist": undist, "dist": dist})
+                   for dist, undist in lineages]
+
+        if args.contig == "all":
+            contigs = list(vcf.header.contigs)
+            # A tabix index leaves out the contigs of the header which
+            # have no records, and they cannot be read.
+            index = getattr(vcf, "index", None)
+            if index is not None:
+                indexed = set(index)
+                empty = [c for c in contigs if c not in indexed]
+                if empty:
+                    logger.warn("Skipping contigs with no records in the index: %s",
+                                   ", ".join(empty))
+                contigs = [c for c in contigs if c in indexed]
+        else:
+            contigs = args.contig.split(",")
+        outputs = {(contig, sid): self._output_name(args, contig, sid, len(contigs), len(specs))
+                   for contig in contigs for sid, _ in specs}
+        if args.mask or args.missing_cutoff is None:
+            args.missing_cutoff = np.inf
+        native = _smcpp.vcf2smc_available() and not args.python
+        if not native and any(fn.endswith(".bin") for fn in outputs.values()):
+            raise RuntimeError("Binary output requires smcpp to be built with htslib.")
+
+        for contig in contigs:
+            contig_length = args.length
+            if contig_length is None and contig in vcf.header.contigs:
+                contig_length = vcf.header.contigs[contig].length
+            if contig_length is None:
+                logger.error("Failed to acquire contig length from VCF header. See the --length option.")
+                sys.exit(1)
+            fns = [outputs[contig, sid] for sid, _ in specs]
+            if native:
+                self._convert_native(args, contig, contig_length, lineages, headers, fns)
+            else:
+                for (dist, undist), header, fn in zip(lineages, headers, fns):
+                    self._convert_python(args, vcf, contig, contig_length, dist, undist, header, fn)
+
+    def _lineages(self, args, d, npop):
+        "Distinguished and undistinguished lineages of each population."
         dist = [[], []]
-        if not args.d:
-            first_sid = args.pop1.samples[0]
-            args.d = [first_sid] * 2
-        args.d = [args.d[0] + ":0", args.d[1] + ":1"]
         all_samples = set(args.pop1.samples) | set(args.pop2.samples)
-        for sid_i in args.d:
+        for sid_i in d:
             sid, i = sid_i.split(":")
             i = int(i)
             if sid not in all_samples:
@@ -106,48 +203,44 @@ class Vcf2Smc(command.Command, command.ConsoleCommand):
             d.append((sid, i))
         undist = [[(k, i) for k in p.samples for i in (0, 1) if (k, i) not in d]
                   for p, d in zip((args.pop1, args.pop2), dist)]
-        npop = 1
+        return dist[:npop], undist[:npop]
 
-        def print_pop(i):
-            logger.info("Population %d:" % i)
-            logger.info("Distinguished lineages: " +
-                        ", ".join("%s:%d" % t for t in dist[i - 1]))
-            logger.info("Undistinguished lineages: " +
-                        ", ".join("%s:%d" % t for t in undist[i - 1]))
-        print_pop(1)
-        if args.pop2.pid is not None:
-            npop = 2
-            common = set(args.pop1.samples) & set(args.pop2.samples)
-            if common:
-                logger.error("Populations 1 and 2 should be disjoint, "
-                             "but both contain " + ", ".join(common))
-                sys.exit(1)
-            print_pop(2)
+    def _output_name(self, args, contig, sid, ncontigs, nspecs):
+        if ncontigs == 1 and nspecs == 1:
+            return args.out
+        if (ncontigs > 1 and "{contig}" not in args.out) or \
+                (nspecs > 1 and "{sample}" not in args.out):
+            raise RuntimeError("When converting more than one contig or distinguished "
+                               "individual, the output name must contain {contig} and/or "
+                               "{sample}, e.g. out.{contig}.{sample}.smc.gz")
+        return args.out.format(contig=contig, sample=sid)
 
-        # Start parsing
-        vcf = VariantFile(args.vcf)
-        with optional_gzip(args.out, "wt") as out:
-            samples = list(vcf.header.samples)
-            dist = dist[:npop]
-            undist = undist[:npop]
-            if not set([dd[0] for d in dist for dd in d]) <= set(samples):
-                raise RuntimeError("Distinguished lineages not found in data?")
-            missing = [s for u in undist for s, _ in u if s not in samples]
-            if missing:
-                msg = "The following samples were not found in the data: %s. " % ", ".join(
-                    missing)
-                if args.ignore_missing:
-                    logger.warn(msg)
-                else:
-                    msg += "If you want to continue without these samples, use --ignore-missing."
-                    raise RuntimeError(msg)
-            undist = [[t for t in u if t[0] not in missing] for u in undist]
+    def _convert_native(self, args, contig, contig_length, lineages, headers, fns):
+        # Every record is decoded once for all of the outputs.
+        results = _smcpp.native_vcf2smc(
+            args.vcf, contig, [l[0] for l in lineages], [l[1] for l in lineages],
+            contig_length, args.mask, args.missing_cutoff, args.drop_first_last,
+            defaults.cores or os.cpu_count())
+
+        def write(fn, header, rows):
+            if fn.endswith(".bin"):
+                _smcpp.write_binary_data(fn, header, rows)
+            else:
+                _smcpp.write_text_data(fn, header, rows)
+            logger.info("Wrote %d observations to %s" % (len(rows), fn))
+
+        with ThreadPoolExecutor(defaults.cores) as pool:
+            list(pool.map(write, fns, headers, [r[0] for r in results]))
+        multiples = results[0][1]
+        if multiples:
+            logger.warn(
+                "Multiple entries found at %d positions; skipped all but the first", multiples)
 
+    def _convert_python(self, args, vcf, contig, contig_length, dist, undist, header, fn):
+        with optional_gzip(fn, "wt") as out:
             # Write header
-            pids = [a.pid for a in (args.pop1, args.pop2)[:npop]]
             out.write("# SMC++ ")
-            json.dump({"version": version, "pids": pids,
-                       "undist": undist, "dist": dist}, out)
+            out.write(header)
             out.write("\n")
             na = list(map(len, dist))
             nb = list(map(len, undist))
@@ -180,7 +273,7 @@ class Vcf2Smc(command.Command, command.ConsoleCommand):
                 return list(sum(zip(a, b, nb), tuple()))
 
             try:
-                region_iterator = vcf.fetch(contig=args.contig)
+                region_iterator = vcf.fetch(contig=contig)
             except ValueError as e:
                 logger.error("VCF reader threw an error: %s", e)
                 logger.error("Make sure the VCF is indexed:")
@@ -189,18 +282,11 @@ class Vcf2Smc(command.Command, command.ConsoleCommand):
                 logger.error("")
                 sys.exit(1)
 
-            contig_length = args.length or vcf.header.contigs[args.contig].length
-            if contig_length is None:
-                logger.error("Failed to acquire contig length from VCF header. See the --length option.")
-                sys.exit(1)
             if args.mask:
                 mask_iterator = TabixFile(
-                    args.mask).fetch(reference=args.contig)
-                args.missing_cutoff = np.inf
+                    args.mask).fetch(reference=contig)
             else:
                 mask_iterator = iter([])
-                if args.missing_cutoff is None:
-                    args.missing_cutoff = np.inf
             mask_iterator = (x.split("\t") for x in mask_iterator)
             mask_iterator = ((x[0], int(x[1]), int(x[2]))
                              for x in mask_iterator)
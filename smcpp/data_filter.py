@@ -1,33 +1,102 @@
 from dataclasses import dataclass, field
+import dataclasses
 from typing import Sequence, List
 import functools
+import hashlib
+import json
 import numpy as np
+import os
+import pickle
+import shutil
 import sys
+import tempfile
 from concurrent.futures import ThreadPoolExecutor
 from collections import OrderedDict
 import contextlib
 import multiprocessing
 
+from appdirs import AppDirs
 
-from . import logging, estimation_tools, defaults
+from . import logging, estimation_tools, defaults, shared_data, _smcpp, version
+from .contig import Contig
 
 logger = logging.getLogger(__name__)
 mp_ctx = multiprocessing.get_context("forkserver")
 
 @dataclass
 class Filter:
+    # Filters which modify the observations of their input contigs in
+    # place are given copies of them by DataPipeline.
+    modifies_data = False
+    # Filters whose results for each contig depend on that contig alone,
+    # and filters which return their input unchanged (but may learn
+    # something from the data as a whole). A pipeline over some of the
+    # files of another can take the results of the former from it (see
+    # DataPipeline.source).
+    per_contig = False
+    passthrough = False
 
     def __call__(self, contigs):
         logger.debug(self)
         return self.run(contigs)
 
 
+def default_cache_dir():
+    dirs = AppDirs("smcpp", "popgenmethods", version=version.version)
+    ret = os.path.join(dirs.user_cache_dir, "data")
+    os.makedirs(ret, exist_ok=True)
+    return ret
+
+
+def clear_cache(cache_dir=None):
+    """
+    Remove every entry of the cache of preprocessed data. Entries are
+    never evicted otherwise.
+    """
+    cache_dir = cache_dir or default_cache_dir()
+    n = 0
+    for name in os.listdir(cache_dir):
+        path = os.path.join(cache_dir, name)
+        if os.path.isdir(path):
+            shutil.rmtree(path, ignore_errors=True)
+            n += 1
+    logger.info("Removed %d cached data sets from %s", n, cache_dir)
+
+
+def _file_digest(fn):
+    h = hashlib.sha256()
+    with open(fn, "rb") as f:
+        for block in iter(lambda: f.read(1 << 20), b""):
+            h.update(block)
+    return h.digest()
+
 
 @dataclass
 class DataPipeline:
     files: Sequence[str]
+    # If set, the results of the pipeline are saved in this directory,
+    # keyed by the contents of the data files and the filters, and later
+    # pipelines over the same data start from them. Entries are kept
+    # until removed by clear_cache().
+    cache_dir: str = None
+    # If set, a pipeline over a superset of these files. The results of
+    # per-contig filters are selected from its results instead of being
+    # computed again, as long as both pipelines apply the same per-contig
+    # filters in the same order; only passthrough filters are run here.
+    source: "DataPipeline" = None
+    # Keep the results of every filter, rather than only those of the
+    # last two, which are enough to run filters added (or the last one
+    # replaced) later. Set on pipelines which are the source of others.
+    keep_stages: bool = False
     _filters: OrderedDict = field(init=None, default_factory=OrderedDict)
-    _results: List = None
+    # Results after each filter. None for stages which were skipped
+    # because a later one was read from the cache, or dropped.
+    _stages: List = field(init=None, default_factory=list)
+    _digest: bytes = field(init=None, default=None)
+
+    def __post_init__(self):
+        if self.source is not None:
+            self.source.keep_stages = True
 
     def __getitem__(self, key):
         self.run()
@@ -35,27 +104,164 @@ class DataPipeline:
 
     def add_filter(self, *args, **kwargs):
         """
-        Add filter to pipeline. Filters are executed "inside out" (i.e. in
-        reverse order.
+        Add filter to pipeline. Filters are executed in the order in which
+        they were added. The results of the filters before it are kept, so
+        only new (or replaced) filters are executed by the next run.
         """
         assert (len(args) == 0) != (len(kwargs) == 0)
         if kwargs:
-            self._filters.update(kwargs)
+            for k, f in kwargs.items():
+                if k in self._filters:
+                    del self._stages[list(self._filters).index(k):]
+                self._filters[k] = f
         else:
             self._filters["filter%d" % len(self._filters)] = args[0]
-        self._results = None
 
     def run(self):
-        if self._results is not None:
-            return self._results
-        self._results = self.files
-        for f in self._filters.values():
-            self._results = f(self._results)
-        return self._results
+        filters = list(self._filters.values())
+        # Resume after the last stage whose results are in memory.
+        while self._stages and self._stages[-1] is None:
+            self._stages.pop()
+        start = len(self._stages)
+        if start == len(filters):
+            return self._stages[-1] if filters else self.files
+        results = self._stages[-1] if self._stages else self.files
+        keys = self._cache_keys() if self.cache_dir else None
+        if keys is not None:
+            for i in range(len(filters) - 1, start - 1, -1):
+                cached = self._load(keys[i], filters[: i + 1])
+                if cached is not None:
+                    self._stages += [None] * (i - start) + [cached]
+                    results = cached
+                    break
+        for f in filters[len(self._stages):]:
+            shared = self._from_source(len(self._stages))
+            results = f(self._inputs(f, results)) if shared is None else shared
+            self._stages.append(results)
+        if keys is not None and len(self._stages) > start:
+            self._save(keys[-1], filters, results)
+        if not self.keep_stages:
+            for i in range(len(self._stages) - 2):
+                self._stages[i] = None
+        return results
 
     def results(self):
         yield from iter(self.run())
 
+    def select(self, files):
+        "The contigs which the pipeline derived from some of its files."
+        files = set(estimation_tools.files_from_command_line_args(files))
+        return [c for c in self.run() if c.fn in files]
+
+    def _from_source(self, i):
+        # Results of filter i selected from the source pipeline, or None.
+        filters = list(self._filters.values())
+        if self.source is None or not filters[i].per_contig:
+            return None
+        ours = [f for f in filters[: i + 1] if not f.passthrough]
+        theirs = [
+            (j, f) for j, f in enumerate(self.source._filters.values())
+            if not f.passthrough
+        ][: len(ours)]
+        if len(theirs) < len(ours) or not all(
+            f.per_contig and repr(f) == repr(g) for f, (_, g) in zip(ours, theirs)
+        ):
+            return None
+        self.source.run()
+        j, g = theirs[-1]
+        stage = self.source._stages[j]
+        if stage is None or not all(isinstance(c, Contig) for c in stage):
+            return None
+        files = set(estimation_tools.files_from_command_line_args(self.files))
+        vars(filters[i]).update(_filter_state(g))
+        logger.debug("Selected the results of %s from the source pipeline", filters[i])
+        return [c for c in stage if c.fn in files]
+
+    def _inputs(self, f, results):
+        # Copies of the contigs, so that the filter cannot alter a stage
+        # which has been kept.
+        if not isinstance(results, list):
+            return results
+        return [
+            dataclasses.replace(c, data=c.data.copy() if f.modifies_data else c.data)
+            if isinstance(c, Contig) else c
+            for c in results
+        ]
+
+    def _cache_keys(self):
+        "Key of each stage: a hash of the data files and the filters up to it."
+        if self._digest is None:
+            h = hashlib.sha256(version.version.encode())
+            for fn in sorted(estimation_tools.files_from_command_line_args(self.files)):
+                h.update(fn.encode())
+                h.update(_file_digest(fn))
+            self._digest = h.digest()
+        h = hashlib.sha256(self._digest)
+        keys = []
+        for f in self._filters.values():
+            h.update(repr(f).encode())
+            keys.append(h.hexdigest())
+        return keys
+
+    def _save(self, key, filters, contigs):
+        # Only lists of contigs (not, e.g., chunks) are cached.
+        if not all(isinstance(c, Contig) for c in contigs):
+            return
+        path = os.path.join(self.cache_dir, key)
+        if os.path.isdir(path):
+            return
+        tmp = None
+        try:
+            tmp = tempfile.mkdtemp(dir=self.cache_dir, prefix=".tmp")
+            for i, c in enumerate(contigs):
+                header = json.dumps(
+                    {"pid": c.pid, "n": c.n.tolist(), "a": c.a.tolist(), "fn": c.fn}
+                )
+                _smcpp.write_binary_data(
+                    os.path.join(tmp, "%d.smc.bin" % i), header, c.data, False
+                )
+            state = {
+                "contigs": len(contigs),
+                "filters": [_filter_state(f) for f in filters],
+            }
+            with open(os.path.join(tmp, "state.pickle"), "wb") as f:
+                pickle.dump(state, f)
+            os.rename(tmp, path)
+            logger.debug("Cached preprocessed data in %s", path)
+        except (OSError, RuntimeError) as e:
+            logger.warning("Could not cache preprocessed data: %s", e)
+            if tmp is not None:
+                shutil.rmtree(tmp, ignore_errors=True)
+
+    def _load(self, key, filters):
+        path = os.path.join(self.cache_dir, key)
+        if not os.path.isdir(path):
+            return None
+        try:
+            with open(os.path.join(path, "state.pickle"), "rb") as f:
+                state = pickle.load(f)
+            contigs = []
+            for i in range(state["contigs"]):
+                header, A = _smcpp.read_binary_data(os.path.join(path, "%d.smc.bin" % i))
+                h = json.loads(header)
+                contigs.append(
+                    Contig(pid=tuple(h["pid"]), data=A, n=h["n"], a=h["a"], fn=h["fn"])
+                )
+        except Exception as e:
+            logger.warning("Ignoring unreadable cache entry %s: %s", path, e)
+            return None
+        for f, s in zip(filters, state["filters"]):
+            vars(f).update(s)
+        logger.info("Read preprocessed data from %s", path)
+        return contigs
+
+
+def _filter_state(f):
+    # Filters keep what they learn about the data (e.g.
+    # Watterson.theta_hat) in attributes which are not fields.
+    fields = {fl.name for fl in dataclasses.fields(f)}
+    return {k: v for k, v in vars(f).items() if k not in fields}
+
 
 @contextlib.contextmanager
 def DummyPool(*args):
@@ -70,6 +276,9 @@ def DummyPool(*args):
 @dataclass
 class ParallelFilter:
     Pool = DummyPool
+    modifies_data = False
+    per_contig = True
+    passthrough = False
 
     def __call__(self, contigs):
         logger.debug(self)
@@ -81,6 +290,21 @@ class ParallelFilter:
 class ProcessParallelFilter(ParallelFilter):
     Pool = mp_ctx.Pool
 
+    def __call__(self, contigs):
+        # The observations are passed to and from the workers in shared
+        # memory; only handles to them are pickled.
+        logger.debug(self)
+        # arrays keeps the shared copies of the inputs alive until the
+        # workers are done with them.
+        handles, arrays = shared_data.share_contigs(contigs)
+        with self.Pool() as p:
+            ret = p.map(self._run_shared, handles)
+        return [shared_data.attach_contig(c) for c in ret]
+
+    def _run_shared(self, c):
+        c = self.run(shared_data.attach_contig(c, owner=False))
+        return shared_data.share_contigs([c], owner=False)[0][0]
+
 
 @dataclass
 class ThreadParallelFilter(ParallelFilter):
@@ -89,6 +313,7 @@ class ThreadParallelFilter(ParallelFilter):
 
 @dataclass
 class LoadData(Filter):
+    per_contig = True
 
     def run(self, files):
         ## Parse each data set into an array of observations
@@ -122,6 +347,7 @@ class LoadData(Filter):
 
 @dataclass
 class Validate(ProcessParallelFilter):
+    modifies_data = True
 
     def run(self, c):
         assert c.data.flags.c_contiguous
@@ -142,10 +368,11 @@ class Validate(ProcessParallelFilter):
             a = c.data[nonseg, 1::3]
             a[a >= 0] = 0
             c.data[nonseg, 2::3] = 0
-        bad = c.data[:, 0] <= 0 | np.any(
-            c.data[:, 1::3] > c.a[None, :], axis=1
-        ) | np.any(c.data[:, 2::3] > c.data[:, 3::3], axis=1) | np.any(
-            c.data[:, 3::3] > c.n[None, :], axis=1
+        bad = (
+            (c.data[:, 0] <= 0)
+            | np.any(c.data[:, 1::3] > c.a[None, :], axis=1)
+            | np.any(c.data[:, 2::3] > c.data[:, 3::3], axis=1)
+            | np.any(c.data[:, 3::3] > c.n[None, :], axis=1)
         )
         if np.any(bad):
             logger.error(
@@ -176,6 +403,7 @@ class Thin(ThreadParallelFilter):
 @dataclass
 class BinObservations(ThreadParallelFilter):
     w: int
+    modifies_data = True
 
     def run(self, c):
         new_data = estimation_tools.bin_observations(c, self.w)
@@ -206,6 +434,7 @@ class Chunk(ThreadParallelFilter):
 @dataclass
 class CountMutations(Filter):
     w: int
+    passthrough = True
 
     def run(self, contigs):
         import scipy.stats.mstats
@@ -235,6 +464,8 @@ class CountMutations(Filter):
 @dataclass
 class RecodeNonseg(Filter):
     cutoff: int
+    modifies_data = True
+    per_contig = True
 
     def run(self, contigs):
         return [estimation_tools.recode_nonseg(c, self.cutoff) for c in contigs]
@@ -251,6 +482,7 @@ class Compress(ProcessParallelFilter):
 @dataclass
 class BreakLongSpans(Filter):
     cutoff: int
+    per_contig = True
 
     def run(self, contigs):
         return [
@@ -260,8 +492,21 @@ class BreakLongSpans(Filter):
         ]
 
 
+@dataclass
+class SplitBlocks(Filter):
+    "Splits each contig into blocks of (about) size positions."
+    size: int
+    per_contig = True
+
+    def run(self, contigs):
+        ret = [b for c in contigs for b in estimation_tools.split_blocks(c, self.size)]
+        logger.debug("Split %d contigs into %d blocks", len(contigs), len(ret))
+        return ret
+
+
 @dataclass
 class DropUninformativeContigs(Filter):
+    per_contig = True
 
     def _n_variable_sites(self, c):
         d = c.data
@@ -285,6 +530,7 @@ class DropUninformativeContigs(Filter):
 @dataclass
 class DropSmallContigs(Filter):
     cutoff: int
+    per_contig = True
 
     def run(self, contigs):
         ret = [c for c in contigs if len(c) > self.cutoff]
@@ -298,6 +544,7 @@ class DropSmallContigs(Filter):
 
 @dataclass
 class Watterson(Filter):
+    passthrough = True
 
     def run(self, contigs):
         num = denom = 0
@@ -323,6 +570,8 @@ class Watterson(Filter):
 
 @dataclass
 class RecodeMonomorphic(Filter):
+    modifies_data = True
+    per_contig = True
 
     def run(self, contigs):
         return [self._recode(c) for c in contigs]
@@ -337,8 +586,97 @@ class RecodeMonomorphic(Filter):
 
 @dataclass
 class Summarize(Filter):
+    passthrough = True
 
     def run(self, contigs):
         for c in contigs:
             logger.debug(c.data[:10])
         return contigs
+
+
+@dataclass
+class Normalize(Filter):
+    """
+    RecodeNonseg, Compress, BreakLongSpans and DropSmallContigs, fused
+    into a single native pass over each contig. Contigs are processed in
+    parallel, in process.
+    """
+    nonseg_cutoff: int
+    span_cutoff: int
+    min_length: int
+    per_contig = True
+
+    def run(self, contigs):
+        warn_only = self.nonseg_cutoff is None
+        cutoff = 50000 if warn_only else self.nonseg_cutoff
+        res = _smcpp.normalize_contigs(
+            contigs, cutoff, not warn_only, self.span_cutoff, self.min_length
+        )
+        ret = []
+        for c, (pieces, long_runs, long_missing) in zip(contigs, res):
+            if long_runs:
+                if warn_only:
+                    f = logger.warning
+                    txt = ""
+                else:
+                    f = logger.debug
+                    txt = " (converted to missing)"
+                f(
+                    "Long runs of homozygosity%s in contig %s: \n%s (base pairs)",
+                    txt,
+                    c.fn,
+                    np.array(long_runs),
+                )
+            if long_missing:
+                logger.debug("Long missing spans:\n%s (base pairs)", np.array(long_missing))
+            ret += [Contig(data=d, pid=c.pid, fn=c.fn, n=c.n, a=c.a) for d in pieces]
+        if len(ret) == 0:
+            logger.error(
+                "All contigs are <.01cM (estimated). " "Please double check your data."
+            )
+            raise RuntimeError()
+        return ret
+
+
+@dataclass
+class PrepareObservations(Filter):
+    """
+    Thin, BinObservations, RecodeMonomorphic, Compress, Validate and
+    DropUninformativeContigs, fused into a single native pass over each
+    contig. Contigs are processed in parallel, in process.
+    """
+    thinning: int
+    w: int
+    per_contig = True
+
+    def run(self, contigs):
+        thinning = [
+            int(500 * np.log(2 + c.n[0])) if self.thinning is None else self.thinning
+            for c in contigs
+        ]
+        res = _smcpp.prepare_contigs(contigs, thinning, self.w)
+        ret = []
+        for c, (data, invalid, recoded, informative) in zip(contigs, res):
+            if recoded:
+                logger.debug(
+                    "In file %s, %d observations where every individual is "
+                    "homozygous for the derived allele.", c.fn, recoded
+                )
+            if invalid:
+                logger.error(
+                    "File %s has invalid observations "
+                    "(span <= 0 | a > 2 | b > n | n > sample size): %s",
+                    c.fn,
+                    np.array(invalid),
+                )
+                raise RuntimeError("data validation failed")
+            if informative:
+                ret.append(Contig(data=data, pid=c.pid, fn=c.fn, n=c.n, a=c.a))
+            else:
+                logger.debug(
+                    "Dropping a contig derived from %s which has no mutations.", c.fn
+                )
+        if len(ret) == 0:
+            logger.error("No contigs have mutation data. Inference is impossible.")
+            raise RuntimeError()
+        return ret
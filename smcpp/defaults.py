@@ -8,6 +8,9 @@ minimum = 1e-4
 maximum = 1e4
 spline = "piecewise"
 cores = None
+fast_matrices = False
+numa = False
+cache_data = False
 perplexity_threshold = .5
 minimum_population_size = 1e-3
 maximum_population_size = 1e3
@@ -9,7 +9,7 @@ import scipy.interpolate
 import scipy.optimize
 import sys
 
-from . import util, logging, model, defaults
+from . import util, logging, model, defaults, shared_data
 from .contig import Contig
 from ._estimation_tools import (
     realign,
@@ -166,6 +166,21 @@ def break_long_spans(contig, span_cutoff):
     return contig_list
 
 
+def split_blocks(contig, size):
+    """
+    Split contig into consecutive blocks of size positions, at the
+    observations which end them. Observations are not divided, so a
+    block may run over by part of one.
+    """
+    obs = contig.data
+    block = (np.cumsum(obs[:, 0]) - 1) // size
+    cuts = np.flatnonzero(np.diff(block)) + 1
+    return [
+        Contig(data=d, pid=contig.pid, fn=contig.fn, n=contig.n, a=contig.a)
+        for d in np.split(obs, cuts)
+    ]
+
+
 def balance_hidden_states(model, M):
     """
     Return break points [0, b_1, ..., b_M, oo) such that
@@ -232,7 +247,8 @@ def calculate_t1(model, n, q):
     return scipy.optimize.brentq(f, 0., model.knots[-1])
 
 
-def _load_data_helper(fn):
+def read_text_data(fn):
+    "Read a text SMC++ data file. Returns its JSON header and observations."
     try:
         # This parser is way faster than np.loadtxt
         A = pd.read_csv(fn, sep=" ", comment="#", header=None).values
@@ -242,19 +258,28 @@ def _load_data_helper(fn):
     except:
         logger.error("In file %s", fn)
         raise
-    if len(A) == 0:
-        raise RuntimeError("empty dataset: %s" % fn)
     with util.optional_gzip(fn, "rt") as f:
         first_line = next(f).strip()
-        if first_line.startswith("# SMC++"):
-            attrs = json.loads(first_line[7:])
-            a = [len(a) for a in attrs["dist"]]
-            n = [len(u) for u in attrs["undist"]]
-            if "pids" not in attrs:
-                raise RuntimeError("Data format is too old. Re-run VCF2SMC.")
-        else:
+        if not first_line.startswith("# SMC++"):
             logger.error("Data file is not in SMC++ format: ", fn)
             sys.exit(1)
+    return first_line[7:].strip(), A
+
+
+def _load_data_helper(fn):
+    from . import _smcpp
+
+    if _smcpp.is_binary_data(fn):
+        header, A = _smcpp.read_binary_data(fn)
+    else:
+        header, A = read_text_data(fn)
+    if len(A) == 0:
+        raise RuntimeError("empty dataset: %s" % fn)
+    attrs = json.loads(header)
+    a = [len(a) for a in attrs["dist"]]
+    n = [len(u) for u in attrs["undist"]]
+    if "pids" not in attrs:
+        raise RuntimeError("Data format is too old. Re-run VCF2SMC.")
     pid = tuple(attrs["pids"])
     # Internally we always put the population with the distinguished lineage first.
     if len(a) == 2 and a[0] == 0 and a[1] == 2:
@@ -267,16 +292,36 @@ def _load_data_helper(fn):
 
 
 def files_from_command_line_args(args):
+    "The files named by args, in order and without repetitions."
     ret = []
     for f in args:
         if f[0] == "@":
             ret += [line.strip() for line in open(f[1:], "rt") if line.strip()]
         else:
             ret.append(f)
-    return set(ret)
+    return list(dict.fromkeys(ret))
 
 
 def load_data(files):
-    with ProcessPoolExecutor(defaults.cores) as p:
-        obs = list(p.map(_load_data_helper, files))
-    return obs
+    from . import _smcpp
+
+    # Binary files are read natively (and usually mapped rather than
+    # copied), so there is nothing to gain from reading them in worker
+    # processes and pickling the results back.
+    binary = {f for f in files if _smcpp.is_binary_data(f)}
+    text = [f for f in files if f not in binary]
+    obs = {f: _load_data_helper(f) for f in files if f in binary}
+    if text:
+        with ProcessPoolExecutor(defaults.cores) as p:
+            obs.update(
+                (f, shared_data.attach_contig(c))
+                for f, c in zip(text, p.map(_load_shared, text))
+            )
+    # In the order given, which determines e.g. the folds of cv.
+    return [obs[f] for f in files]
+
+
+def _load_shared(fn):
+    # Return the observations in shared memory rather than pickling them.
+    c = _load_data_helper(fn)
+    return shared_data.share_contigs([c], owner=False)[0][0]
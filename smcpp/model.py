@@ -147,9 +147,11 @@ class SMCModel(BaseModel):
     def K(self):
         return len(self.knots)
 
-    def randomize(self):
+    def randomize(self, random_state=None):
+        if random_state is None:
+            random_state = np.random
         logger.debug("model before randomization: %s", self[:].astype("float"))
-        self[:] += np.random.normal(0., .0001, size=len(self[:]))
+        self[:] += random_state.normal(0., .0001, size=len(self[:]))
         logger.debug("model after randomization: %s", self[:].astype("float"))
 
     @property
@@ -355,9 +357,9 @@ class SMCTwoPopulationModel(Observable, Observer):
     def dlist(self):
         return tag_sort(self._models[0].dlist + self._models[1].dlist)
 
-    def randomize(self):
+    def randomize(self, random_state=None):
         for m in self._models:
-            m.randomize()
+            m.randomize(random_state)
 
     def reset(self):
         for m in self._models:
@@ -9,13 +9,13 @@ logger = getLogger(__name__)
 class AnalysisSaver(OptimizerPlugin):
 
     def __init__(self, outdir, base):
-        self._outdir = outdir
-        self._base = base
+        self.outdir = outdir
+        self.base = base
 
     def update(self, message, *args, **kwargs):
         dump = kwargs["analysis"].dump
         if message == "post E-step":
             i = kwargs["i"]
-            dump(os.path.join(self._outdir, ".{}.iter{}".format(self._base, i)))
+            dump(os.path.join(self.outdir, ".{}.iter{}".format(self.base, i)))
         elif message == "optimization finished":
-            dump(os.path.join(self._outdir, "{}.final".format(self._base)))
+            dump(os.path.join(self.outdir, "{}.final".format(self.base)))
@@ -50,5 +50,6 @@ class HiddenStateOccupancyPrinter(OptimizerPlugin):
         )
         hs = np.sort(np.r_[hs, m.knots])
         logger.debug("rebalanced hidden states: %s", np.array_str(hs, precision=2))
+        analysis.hidden_states = hs
         for im in analysis._ims.values():
             im.hidden_states = hs
@@ -10,8 +10,13 @@ class LoglikelihoodMonitor(OptimizerPlugin):
     def __init__(self):
         self._old_loglik = None
 
-    @targets("post E-step")
+    @targets(["begin", "post E-step"])
     def update(self, message, *args, **kwargs):
+        if message == "begin":
+            # Each run is a separate fit (e.g. a bootstrap replicate), whose
+            # log-likelihood is not comparable with that of the last one.
+            self._old_loglik = None
+            return
         ll = kwargs["analysis"].loglik()
         if self._old_loglik is None:
             logger.info("Loglik: %f", ll)
@@ -0,0 +1,122 @@
+"""
+Observation arrays shared with worker processes.
+
+Arrays are kept in memory-mapped files (in /dev/shm where available),
+and only a SharedArray handle giving the file's path and the array's
+shape is pickled. Workers map the file and operate on it in place.
+The file is removed when the last array in the parent process which
+maps it is garbage collected.
+"""
+from dataclasses import dataclass
+from typing import Tuple
+import dataclasses
+import os
+import tempfile
+import uuid
+import weakref
+
+import numpy as np
+
+from .contig import Contig
+
+_dir = "/dev/shm" if os.access("/dev/shm", os.W_OK) else tempfile.gettempdir()
+
+# Files owned by this process, by path, and the arrays mapping them.
+_owned = weakref.WeakValueDictionary()
+
+
+@dataclass(frozen=True)
+class SharedArray:
+    path: str
+    shape: Tuple[int, int]
+
+    def attach(self):
+        "Map the array, in place."
+        return np.memmap(self.path, dtype=np.int32, mode="r+", shape=self.shape)
+
+
+def _handle(A):
+    # The handle of A if it is the whole of a shared array.
+    fn = getattr(A, "filename", None)
+    if fn is None or not A.flags.c_contiguous or A.dtype != np.int32:
+        return None
+    if os.path.dirname(fn) != _dir or np.prod(A.shape) * 4 != os.path.getsize(fn):
+        return None
+    return SharedArray(fn, A.shape)
+
+
+def share(A, owner=True):
+    """
+    Share A with other processes. Returns a handle to it and the array
+    which maps it: A itself if it is already shared, and otherwise a
+    copy. If owner is set, the file is removed when that array is
+    garbage collected; only the parent process should own files. Empty
+    arrays are returned as they are.
+    """
+    if A.size == 0:
+        return A, A
+    h = _handle(A)
+    if h is not None:
+        return A, h
+    path = os.path.join(_dir, "smcpp-%d-%s.i32" % (os.getpid(), uuid.uuid4().hex))
+    h = SharedArray(path, A.shape)
+    B = np.memmap(path, dtype=np.int32, mode="w+", shape=A.shape)
+    B[:] = A
+    if owner:
+        _own(h.path, B)
+    else:
+        B.flush()
+    return B, h
+
+
+def attach(h):
+    """
+    Map a shared array in the parent process, which takes ownership of
+    its file.
+    """
+    if not isinstance(h, SharedArray):
+        return h
+    A = _owned.get(h.path)
+    if A is None or A.shape != h.shape:
+        A = h.attach()
+        _own(h.path, A)
+    return A
+
+
+def _own(path, A):
+    _owned[path] = A
+    weakref.finalize(A, _unlink, path)
+
+
+def _unlink(path):
+    try:
+        os.unlink(path)
+    except OSError:
+        pass
+
+
+def share_contigs(contigs, owner=True):
+    """
+    Handles to the contigs, with their data replaced by SharedArrays,
+    and the arrays mapping their data, which must be kept alive until
+    the handles have been used.
+    """
+    handles = []
+    arrays = []
+    for c in contigs:
+        if isinstance(c, Contig):
+            B, h = share(c.data, owner)
+            arrays.append(B)
+            c = dataclasses.replace(c, data=h)
+        handles.append(c)
+    return handles, arrays
+
+
+def attach_contig(c, owner=True):
+    """
+    Map the data of a contig received from another process. Only the
+    parent process, which removes the files, should be the owner.
+    """
+    if not isinstance(c, Contig) or not isinstance(c.data, SharedArray):
+        return c
+    return dataclasses.replace(c, data=attach(c.data) if owner else c.data.attach())
@@ -1,10 +1,66 @@
+#include <atomic>
 #include <numeric>
 #include <execinfo.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
 
 #include "common.h"
 
+Matrix<double> dense_product(const Matrix<double> &A, const Matrix<double> &B)
+{
+    return A * B;
+}
+
+static int num_derivatives(const Matrix<adouble> &M)
+{
+    int nd = 0;
+    for (int j = 0; j < M.cols(); ++j)
+        for (int i = 0; i < M.rows(); ++i)
+            nd = std::max(nd, (int)M(i, j).derivatives().size());
+    return nd;
+}
+
+Matrix<adouble> dense_product(const Matrix<adouble> &A, const Matrix<adouble> &B)
+{
+    assert(A.cols() == B.rows());
+    const int r = A.rows(), p = A.cols(), c = B.cols();
+    const int nd = std::max(num_derivatives(A), num_derivatives(B));
+    const Matrix<double> Av = A.cast<double>(), Bv = B.cast<double>();
+    // Derivative planes of A are stacked vertically and those of B
+    // horizontally, so that d(AB) = dA * B + A * dB is two products.
+    Matrix<double> Ad = Matrix<double>::Zero(nd * r, p);
+    Matrix<double> Bd = Matrix<double>::Zero(p, nd * c);
+    for (int j = 0; j < p; ++j)
+        for (int i = 0; i < r; ++i)
+        {
+            const adouble_t &d = A(i, j).derivatives();
+            for (int k = 0; k < d.size(); ++k)
+                Ad(k * r + i, j) = d(k);
+        }
+    for (int j = 0; j < c; ++j)
+        for (int i = 0; i < p; ++i)
+        {
+            const adouble_t &d = B(i, j).derivatives();
+            for (int k = 0; k < d.size(); ++k)
+                Bd(i, k * c + j) = d(k);
+        }
+    const Matrix<double> Cv = Av * Bv;
+    const Matrix<double> C1 = Ad * Bv;
+    const Matrix<double> C2 = Av * Bd;
+    Matrix<adouble> ret(r, c);
+    adouble_t d(nd);
+    for (int j = 0; j < c; ++j)
+        for (int i = 0; i < r; ++i)
+        {
+            for (int k = 0; k < nd; ++k)
+                d(k) = C1(k * r + i, j) + C2(i, k * c + j);
+            ret(i, j) = adouble(Cv(i, j), d);
+        }
+    return ret;
+}
+
 void store_matrix(const Matrix<double> &M, double* out)
 {
     Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>::Map(out, M.rows(), M.cols()) = M;
@@ -141,3 +197,36 @@ void check_negative(const double x, const char* file, const int line)
     }
     throw std::runtime_error(s);
 }
+
+std::string atomic_tmp_path(const std::string &path)
+{
+    static std::atomic<unsigned long> serial(0);
+    return path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(serial++);
+}
+
+bool write_file_atomic(const std::string &path, const char* data, const size_t len, const int mode)
+{
+    const std::string tmp = atomic_tmp_path(path);
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (fd == -1)
+    {
+        ERROR << "could not open " << tmp << " for writing";
+        return false;
+    }
+    bool ok = true;
+    for (size_t off = 0; ok and off < len;)
+    {
+        ssize_t w = write(fd, data + off, len - off);
+        if (w <= 0)
+            ok = false;
+        else
+            off += w;
+    }
+    ok = (fsync(fd) == 0) and ok;
+    ok = (close(fd) == 0) and ok;
+    if (ok and rename(tmp.c_str(), path.c_str()) == 0)
+        return true;
+    ERROR << "could not store " << path;
+    unlink(tmp.c_str());
+    return false;
+}
@@ -3,29 +3,34 @@
 template <typename T>
 OnePopConditionedSFS<T>::OnePopConditionedSFS(int n) : 
     n(n),
-    mei(compute_moran_eigensystem(n)), 
-    mcache(cached_matrices(n)),
-    Uinv_mp0(mei.Uinv.rightCols(n).template cast<double>()), 
-    Uinv_mp2(mei.Uinv.reverse().leftCols(n).template cast<double>())
+    mcache(cached_matrices(n))
 {}
 
 template <typename T>
 std::vector<Matrix<T> > OnePopConditionedSFS<T>::compute_below(const PiecewiseConstantRateFunction<T> &eta) const
+{
+    const int M = eta.getHiddenStates().size() - 1;
+    Matrix<T> tjj_below(M, n + 1);
+    return compute_below(eta, tjj_below, 0);
+}
+
+template <typename T>
+std::vector<Matrix<T> > OnePopConditionedSFS<T>::compute_below(
+        const PiecewiseConstantRateFunction<T> &eta, Matrix<T> &tjj_below, const int first_state) const
 {
     DEBUG1 << "compute below";
     const int M = eta.getHiddenStates().size() - 1;
     std::vector<Matrix<T> > csfs_below(M, Matrix<T>::Zero(3, n + 1));
-    Matrix<T> tjj_below(M, n + 1);
-    tjj_below.fill(eta.zero());
-    DEBUG1 << "tjj_double_integral below starts";
+    tjj_below.bottomRows(M - first_state).fill(eta.zero());
+    DEBUG1 << "tjj_double_integral below starts (" << first_state << " states reused)";
 #pragma omp parallel for
-    for (int m = 0; m < M; ++m)
+    for (int m = first_state; m < M; ++m)
             eta.tjj_double_integral_below(this->n, m, tjj_below);
     DEBUG1 << "tjj_double_integral below finished";
     DEBUG1 << "matrix products below (M0)";
-    Matrix<T> M0_below = tjj_below * mcache.M0.template cast<T>();
+    Matrix<T> M0_below = tjj_below * mcache->M0.template cast<T>();
     DEBUG1 << "matrix products below (M1)";
-    Matrix<T> M1_below = tjj_below * mcache.M1.template cast<T>();
+    Matrix<T> M1_below = tjj_below * mcache->M1.template cast<T>();
     DEBUG1 << "filling csfs_below";
     for (int m = 0; m < M; ++m) 
     {
@@ -56,27 +61,27 @@ std::vector<Matrix<T> > OnePopConditionedSFS<T>::compute_above(const PiecewiseCo
         csfs_above[m].fill(eta.zero());
         const Matrix<T> C0 = C_above[m].transpose();
         const Matrix<T> C2 = C_above[m].colwise().reverse().transpose();
-        Vector<T> tmp0(this->mcache.X0.cols()), tmp2(this->mcache.X2.cols());
+        Vector<T> tmp0(this->mcache->X0.cols()), tmp2(this->mcache->X2.cols());
         tmp0.fill(eta.zero());
-        for (int j = 0; j < this->mcache.X0.cols(); ++j)
+        for (int j = 0; j < this->mcache->X0.cols(); ++j)
         {
             std::vector<T> v;
-            for (int i = 0; i < this->mcache.X0.rows(); ++i)
-                v.push_back(this->mcache.X0(i, j) * C0(i, j));
+            for (int i = 0; i < this->mcache->X0.rows(); ++i)
+                v.push_back(this->mcache->X0(i, j) * C0(i, j));
             std::sort(v.begin(), v.end(), [] (T x, T y) { return std::abs(toDouble(x)) > std::abs(toDouble(y)); });
             tmp0(j) = doubly_compensated_summation(v);
         }
-        csfs_above[m].block(0, 1, 1, n) = tmp0.transpose().lazyProduct(Uinv_mp0);
+        csfs_above[m].block(0, 1, 1, n) = tmp0.transpose().lazyProduct(mcache->Uinv_mp0);
         tmp2.fill(eta.zero());
-        for (int j = 0; j < this->mcache.X2.cols(); ++j)
+        for (int j = 0; j < this->mcache->X2.cols(); ++j)
         {
             std::vector<T> v;
-            for (int i = 0; i < this->mcache.X2.rows(); ++i)
-                v.push_back(this->mcache.X2(i, j) * C2(i, j));
+            for (int i = 0; i < this->mcache->X2.rows(); ++i)
+                v.push_back(this->mcache->X2(i, j) * C2(i, j));
             std::sort(v.begin(), v.end(), [] (T x, T y) { return std::abs(toDouble(x)) > std::abs(toDouble(y)); });
             tmp2(j) = doubly_compensated_summation(v);
         }
-        csfs_above[m].block(2, 0, 1, n) = tmp2.transpose().lazyProduct(Uinv_mp2);
+        csfs_above[m].block(2, 0, 1, n) = tmp2.transpose().lazyProduct(mcache->Uinv_mp2);
         CHECK_NAN(csfs_above[m]);
     }
     return csfs_above;
@@ -87,8 +92,21 @@ std::vector<Matrix<T> > OnePopConditionedSFS<T>::compute(const PiecewiseConstant
 {
     DEBUG1 << "compute called";
     const int M = eta.getHiddenStates().size() - 1;
+    int first_state = 0;
+    if (last_eta and last_tjj_below.rows() == M)
+    {
+        const int p = eta.first_changed_piece(*last_eta);
+        const std::vector<int> &hs_indices = eta.getHsIndices();
+        while (first_state < M and hs_indices[first_state + 1] <= p)
+            first_state++;
+    }
+    else
+        last_tjj_below.resize(M, n + 1);
+    // Invalidated until the computation below succeeds.
+    last_eta.reset();
     std::vector<Matrix<T> > csfs_above = compute_above(eta);
-    std::vector<Matrix<T> > csfs_below = compute_below(eta);
+    std::vector<Matrix<T> > csfs_below = compute_below(eta, last_tjj_below, first_state);
+    last_eta.reset(new PiecewiseConstantRateFunction<T>(eta));
     std::vector<Matrix<T> > csfs(M, Matrix<T>::Zero(3, n + 1));
     for (int m = 0; m < M; ++m)
         csfs[m] = csfs_above[m] + csfs_below[m];
@@ -97,47 +115,48 @@ std::vector<Matrix<T> > OnePopConditionedSFS<T>::compute(const PiecewiseConstant
 }
 
 template <typename T>
-std::vector<Matrix<T> > incorporate_theta(const std::vector<Matrix<T> > &csfs, double theta)
+incorporated_sfs<T>::incorporated_sfs(const Matrix<T> &csfs, const double theta) :
+    tauh(csfs.sum()), csfs(csfs)
 {
     if (theta <= 0)
         throw std::runtime_error("mutation rate theta <= 0");
+    CHECK_NAN(tauh);
+    scale = -expm1(-theta * tauh) / tauh;
+    tiny = tauh - tauh + 1e-10;
+}
+
+template <typename T>
+T incorporated_sfs<T>::operator()(const int i, const int j) const
+{
+    // Entry (0, 0) holds the probability of no mutation, 1 - sum of the
+    // others.
+    const T x = (i == 0 and j == 0) ? T(1. - scale * tauh) : T(csfs(i, j) * scale);
+    if (x < 1e-10)
+        return tiny;
+    return x;
+}
+
+template <typename T>
+std::vector<Matrix<T> > incorporate_theta(const std::vector<Matrix<T> > &csfs, double theta)
+{
     std::vector<Matrix<T> > ret(csfs.size());
     for (unsigned int i = 0; i < csfs.size(); ++i)
     {
         assert(csfs[i](0, 0) == 0.);
         assert(csfs[i](2, n) == 0.);
-        T tauh = csfs[i].sum();
-        // if (toDouble(tauh) > 1.0 / theta)
-        // {
-        //     DEBUG1 << "i:" << i << " csfs:\n" << csfs[i].template cast<double>();
-        //     DEBUG1 << "tauh: " << toDouble(tauh);
-        //     DEBUG1 << "theta: " << theta;
-        //     throw improper_sfs_exception();
-        // }
-        try
-        {
-            CHECK_NAN(tauh);
-            ret[i] = csfs[i] * -expm1(-theta * tauh) / tauh;
-            CHECK_NAN(ret[i]);
-        }
+        const incorporated_sfs<T> isfs(csfs[i], theta);
+        ret[i].resize(csfs[i].rows(), csfs[i].cols());
+        for (int r = 0; r < ret[i].rows(); ++r)
+            for (int c = 0; c < ret[i].cols(); ++c)
+                ret[i](r, c) = isfs(r, c);
+        try { CHECK_NAN(ret[i]); }
         catch (std::runtime_error)
         {
             std::cout << i << std::endl << csfs[i].template cast<double>() << std::endl;
-            std::cout << tauh << std::endl;
+            std::cout << isfs.tauh << std::endl;
             std::cout << theta << std::endl;
             throw;
         }
-        T tiny = tauh - tauh + 1e-10;
-        CHECK_NAN(ret[i]);
-        tauh = ret[i].sum();
-        ret[i](0, 0) = 1. - tauh;
-        ret[i] = ret[i].unaryExpr([=](const T x) { if (x < 1e-10) return tiny; if (x < -1e-8) throw std::domain_error("very negative sfs"); return x; });
-        try { CHECK_NAN(ret[i]); }
-        catch (std::runtime_error)
-        {
-            std::cout << i << "\n" << ret[i].template cast<double>() << std::endl;
-            throw;
-        }
         if (ret[i].template cast<double>().minCoeff() < 0 or ret[i].template cast<double>().maxCoeff() > 1)
         {
             std::cout << i << std::endl << ret[i].template cast<double>() << std::endl;
@@ -147,6 +166,8 @@ std::vector<Matrix<T> > incorporate_theta(const std::vector<Matrix<T> > &csfs, d
     return ret;
 }
 
+template class incorporated_sfs<double>;
+template class incorporated_sfs<adouble>;
 template std::vector<Matrix<double> > incorporate_theta(const std::vector<Matrix<double> > &csfs, double theta);
 template std::vector<Matrix<adouble> > incorporate_theta(const std::vector<Matrix<adouble> > &csfs, double theta);
 
@@ -1,19 +1,34 @@
+#include <limits>
+#include <new>
+
 #include <unsupported/Eigen/MatrixFunctions>
 
 #include "common.h"
 #include "inference_manager.h"
 #include "inference_bundle.h"
 #include "hmm.h"
+#include "posterior_writer.h"
 
 HMM::HMM(const int hmm_num,
          const Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > &obs,
          const InferenceBundle* ib) :
-    hmm_num(hmm_num), obs(obs), ib(ib), M(ib->pi->rows()), L(obs.rows()), ll(0.),
-    alpha_hat(M, L + 1), xisum(M, M), gamma(M, 1), log_c(L + 1)
+    hmm_num(hmm_num), obs(obs), ib(ib), L(obs.rows()), weight(1.), alpha_q(1e-11), gamma_q(1e-30), 
+    quantized(false), log_c(L + 1), posterior(nullptr)
+{
+    reset();
+}
+
+void HMM::reset()
+{
+    M = ib->pi->rows();
+    ll = 0.;
+    alpha_hat.resize(0, 0);
+    alpha_q.clear();
+    gamma_q.clear();
+    xisum.resize(M, M);
     // Gamma has one column because gamma.col(0) will be set to calculate
     // the initial distribution term
-{
-    gamma.setZero();
+    gamma = Matrix<double>::Zero(M, 1);
     gamma_sums.clear();
     Vector<double> uniform = ib->pi->template cast<double>();
     for (int ell = 0; ell < L; ++ell)
@@ -44,19 +59,127 @@ void HMM::domain_error(double ret)
 
 void HMM::Estep(bool fbOnly)
 {
+    // Fixed-size kernels let Eigen unroll and vectorize the M-sized
+    // operations for the hidden state counts we use most.
+    switch (M)
+    {
+        case 16: Estep_impl<16>(fbOnly); break;
+        case 32: Estep_impl<32>(fbOnly); break;
+        case 64: Estep_impl<64>(fbOnly); break;
+        default: Estep_impl<Eigen::Dynamic>(fbOnly);
+    }
+}
+
+void HMM::Estep_dynamic(bool fbOnly)
+{
+    Estep_impl<Eigen::Dynamic>(fbOnly);
+}
+
+template <int N>
+double HMM::forward_step(const int ell, const Eigen::Matrix<double, N, N> &T,
+        const Eigen::Matrix<double, N, 1> &a_prev, Eigen::Matrix<double, N, 1> &a)
+{
+    typedef Eigen::Matrix<double, N, N> MatrixN;
+    typedef Eigen::Matrix<double, N, 1> VectorN;
+    typedef Eigen::Map<const MatrixN> MapN;
+    typedef Eigen::Map<const VectorN> VMapN;
+    const TransitionBundle *tb = ib->tb;
+    const block_key key = ob_key(ell - 1);
+    const int span = obs(ell - 1, 0);
+    double log_c;
+    auto es_it = tb->eigensystems.find(key);
+    if (span > 1 and es_it != tb->eigensystems.end())
+    {
+        const eigensystem &es = es_it->second;
+        const MapN P_r(es.P_r.data(), M, M), Pinv_r(es.Pinv_r.data(), M, M);
+        const VMapN d_r_scaled(es.d_r_scaled.data(), M);
+        a = (P_r * (d_r_scaled.array().pow(span).matrix().asDiagonal() *
+                    (Pinv_r * a_prev)));
+        double s = a.sum();
+        a /= s;
+        log_c = std::log(s) + span * std::log(es.scale);
+    }
+    else
+    {
+        const VectorN Bd = ib->emission_probs->at(key).template cast<double>();
+        MatrixN BT = Bd.asDiagonal() * T.transpose();
+        if (span > 1)
+            BT = Matrix<double>(BT).pow(span);
+        a = BT * a_prev;
+        double s = a.sum();
+        log_c = std::log(s);
+        a /= s;
+    }
+    CHECK_NAN(a);
+    a = a.unaryExpr([] (const double &x) { if (x < 1e-10) return 1e-10; return x; });
+    return log_c;
+}
+
+double HMM::forward_loglik()
+{
+    switch (M)
+    {
+        case 16: return forward_loglik_impl<16>();
+        case 32: return forward_loglik_impl<32>();
+        case 64: return forward_loglik_impl<64>();
+        default: return forward_loglik_impl<Eigen::Dynamic>();
+    }
+}
+
+template <int N>
+double HMM::forward_loglik_impl()
+{
+    const Eigen::Matrix<double, N, N> T = ib->tb->Td;
+    Eigen::Matrix<double, N, 1> a_prev = ib->pi->template cast<double>(), a(M);
+    double ret = 0.;
+    for (int ell = 1; ell < L + 1; ++ell)
+    {
+        ret += forward_step<N>(ell, T, a_prev, a);
+        a_prev.swap(a);
+    }
+    return ret;
+}
+
+template <int N>
+void HMM::Estep_impl(bool fbOnly)
+{
+    typedef Eigen::Matrix<double, N, N> MatrixN;
+    typedef Eigen::Matrix<double, N, 1> VectorN;
+    typedef Eigen::Map<const MatrixN> MapN;
+    typedef Eigen::Map<const VectorN> VMapN;
     TransitionBundle *tb = ib->tb;
-    if (*(ib->saveGamma))
-        gamma = Matrix<double>::Zero(M, L + 1);
-    Matrix<double> T = tb->Td;
+    const bool save_gamma = *(ib->saveGamma);
+    quantized = *(ib->quantizeForward);
+    if (quantized)
+    {
+        alpha_hat.resize(0, 0);
+        alpha_q.resize(M, L + 1);
+    }
+    else
+    {
+        alpha_q.clear();
+        alpha_hat.resize(M, L + 1);
+    }
+    gamma = Matrix<double>::Zero(M, (save_gamma and not quantized) ? L + 1 : 1);
+    if (save_gamma and quantized)
+        gamma_q.resize(M, L + 1);
+    else
+        gamma_q.clear();
+    const MatrixN T = tb->Td;
     gamma_sums.clear();
     const Vector<double> z = Vector<double>::Zero(M);
     gamma_sums.emplace(ob_key(0), z);
-    Eigen::DiagonalMatrix<double, Eigen::Dynamic, Eigen::Dynamic> B;
+    VectorN Bd(M);
     DEBUG1 << "forward algorithm (HMM #" << hmm_num << ")";
-    Vector<double> a;
+    VectorN a(M);
     int prog = (int)((double)L * 0.1);
     ll = 0.;
-    alpha_hat.col(0) = ib->pi->template cast<double>().template cast<float>();
+    // Input to each step of the recursion. Without quantization this is
+    // the forward variable as stored, in single precision.
+    VectorN a_prev = ib->pi->template cast<double>();
+    store_alpha(0, a_prev);
+    if (not quantized)
+        a_prev = load_alpha(0);
     log_c(0) = 0.;
     for (int ell = 1; ell < L + 1; ++ell)
     {
@@ -65,38 +188,15 @@ void HMM::Estep(bool fbOnly)
             DEBUG1 << "hmm " << hmm_num << ": " << (int)(100. * (double)ell / (double)L) << "%";
             prog += (int)((double)L * 0.1);
         }
-        block_key key = ob_key(ell - 1);
-        gamma_sums.emplace(key, z);
-        B = ib->emission_probs->at(key).template cast<double>().asDiagonal();
-        int span = obs(ell - 1, 0);
-        if (span > 1 and tb->eigensystems.count(key) > 0)
-        {
-            const eigensystem es = tb->eigensystems.at(key);
-            a = (es.P_r * (es.d_r_scaled.array().pow(span).matrix().asDiagonal() *
-                        (es.Pinv_r * alpha_hat.col(ell - 1).template cast<double>())));
-            double s = a.sum();
-            a /= s;
-            log_c(ell) = std::log(s) + span * std::log(es.scale);
-            alpha_hat.col(ell) = a.template cast<float>();
-        }
-        else
-        {
-            // if (span != 1) throw std::runtime_error("span != 1");
-            Matrix<double> M = (B * T.transpose()).pow(span);
-            alpha_hat.col(ell) = M.template cast<float>() * alpha_hat.col(ell - 1);
-            double s = alpha_hat.col(ell).sum();
-            log_c(ell) = std::log(s);
-            alpha_hat.col(ell) /= s;
-        }
-        CHECK_NAN(alpha_hat.col(ell));
-        alpha_hat.col(ell) = alpha_hat.col(ell).unaryExpr(
-                [] (const float &x) { if (x < 1e-10f) return 1e-10f; return x; }
-            );
+        gamma_sums.emplace(ob_key(ell - 1), z);
+        log_c(ell) = forward_step<N>(ell, T, a_prev, a);
+        store_alpha(ell, a);
+        a_prev = quantized ? a : VectorN(load_alpha(ell));
         ll += log_c(ell);
     }
-    Vector<double> beta = Vector<double>::Ones(M), v(M), alpha(M), log_beta;
-    xisum.setZero();
-    Matrix<double> Q_r(M, M), sq(M, M), xis(M, M), xis1(M, M), tmp;
+    VectorN beta = VectorN::Ones(M), v(M), log_beta(M);
+    MatrixN xisum_n = MatrixN::Zero(M, M);
+    MatrixN Q_r(M, M), xis(M, M);
     double p, vM, log_C, log_p;
     DEBUG1 << "backward algorithm (HMM #" << hmm_num << ")";
     for (int ell = L; ell > 0; --ell)
@@ -104,24 +204,27 @@ void HMM::Estep(bool fbOnly)
         v.setZero();
         int span = obs(ell - 1, 0);
         block_key key = ob_key(ell - 1);
-        B = ib->emission_probs->at(key).template cast<double>().asDiagonal();
-        if (span > 1 and tb->eigensystems.count(key) > 0)
+        Bd = ib->emission_probs->at(key).template cast<double>();
+        auto es_it = tb->eigensystems.find(key);
+        if (span > 1 and es_it != tb->eigensystems.end())
         {
-            const eigensystem es = tb->eigensystems.at(key);
+            const eigensystem &es = es_it->second;
+            const MapN P_r(es.P_r.data(), M, M), Pinv_r(es.Pinv_r.data(), M, M);
+            const VMapN d_r(es.d_r.data(), M), d_r_scaled(es.d_r_scaled.data(), M);
+            const Matrix<double> &sq = tb->span_Qs.at({span, key});
             log_p = std::log(es.scale) * (span - 1);
             {
-                Q_r = es.Pinv_r * (alpha_hat.col(ell - 1).template cast<double>() * beta.transpose()) * es.P_r;
-                sq = tb->span_Qs.at({span,key});
-                Q_r = Q_r.cwiseProduct(sq);
-                v = ((es.P_r * es.d_r.asDiagonal() * Q_r * es.Pinv_r).diagonal().array().abs().log() - 
+                Q_r = Pinv_r * (load_alpha(ell - 1) * beta.transpose()) * P_r;
+                Q_r = Q_r.cwiseProduct(MapN(sq.data(), M, M));
+                v = ((P_r * d_r.asDiagonal() * Q_r * Pinv_r).diagonal().array().abs().log() - 
                         log_c(ell) + std::log(es.scale) * (span - 1));
                 vM = v.maxCoeff();
                 v = v.array() - vM;
                 log_C = std::log(span) - vM - std::log(v.array().exp().sum());
                 v = (v.array() + vM + log_C).exp();
-                xis = ((es.P_r * Q_r * es.Pinv_r * B).array().abs().log() - log_c(ell) + log_p + log_C).exp();
-                log_beta = ((es.Pinv_r.transpose() * (es.d_r_scaled.array().pow(span).matrix().asDiagonal() *
-                            (es.P_r.transpose() * beta))).array().log() + log_p + log_C + std::log(es.scale));
+                xis = ((P_r * Q_r * Pinv_r * Bd.asDiagonal()).array().abs().log() - log_c(ell) + log_p + log_C).exp();
+                log_beta = ((Pinv_r.transpose() * (d_r_scaled.array().pow(span).matrix().asDiagonal() *
+                            (P_r.transpose() * beta))).array().log() + log_p + log_C + std::log(es.scale));
                 vM = log_beta.maxCoeff();
                 log_beta = log_beta.array() - vM;
                 beta = log_beta.array().exp();
@@ -131,27 +234,156 @@ void HMM::Estep(bool fbOnly)
         {
             if (span != 1)
                 throw std::runtime_error("span");
-            v = alpha_hat.col(ell).template cast<double>().cwiseProduct(beta);
+            v = load_alpha(ell).cwiseProduct(beta);
             p = v.sum();
             v /= p;
-            xis = alpha_hat.col(ell - 1).template cast<double>() * beta.transpose() * B / exp(log_c(ell));
+            xis = load_alpha(ell - 1) * beta.transpose() * Bd.asDiagonal() / exp(log_c(ell));
             xis /= p;
-            beta = T * (B * beta);
+            beta = T * (Bd.asDiagonal() * beta);
         }
-        xisum += xis;
+        xisum_n += xis;
         beta /= beta.sum();
-        CHECK_NAN(xisum);
+        CHECK_NAN(xisum_n);
         CHECK_NAN(v);
         CHECK_NAN(beta);
         gamma_sums.at(key) += v;
-        if (*(ib->saveGamma))
+        if (posterior)
+            posterior->add(span, v.data());
+        if (save_gamma and quantized)
+            gamma_q.set_col(ell, v);
+        else if (save_gamma)
             gamma.col(ell) = v;
     }
-    gamma.col(0) = alpha_hat.col(0).template cast<double>().cwiseProduct(beta);
-    xisum = xisum.cwiseProduct(T);
+    if (posterior)
+        posterior->flush();
+    gamma.col(0) = load_alpha(0).cwiseProduct(beta);
+    if (save_gamma and quantized)
+        gamma_q.set_col(0, gamma.col(0));
+    xisum = xisum_n.cwiseProduct(T);
     xisum = xisum.unaryExpr([] (const double &x) { if (x < 1e-20) return 1e-20; return x; });
 }
 
+template <typename Derived>
+void HMM::store_alpha(const int ell, const Eigen::MatrixBase<Derived> &a)
+{
+    if (quantized)
+        alpha_q.set_col(ell, a);
+    else
+        alpha_hat.col(ell) = a.template cast<float>();
+}
+
+Vector<double> HMM::load_alpha(const int ell) const
+{
+    if (quantized)
+        return alpha_q.col(ell);
+    return alpha_hat.col(ell).template cast<double>();
+}
+
+Matrix<double>& HMM::expanded_gamma()
+{
+    if (quantized and gamma_q.bytes() > 0)
+    {
+        const Vector<double> g0 = gamma.col(0);
+        gamma = gamma_q.expand();
+        gamma.col(0) = g0;
+    }
+    return gamma;
+}
+
+void HMM::localize()
+{
+    Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> tmp = obs;
+    local_obs.swap(tmp);
+    // Assigning to a Map would copy into the memory it refers to, so it
+    // is rebound in place instead.
+    new (&obs) Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >(
+            local_obs.data(), local_obs.rows(), local_obs.cols());
+    Matrix<double> xs = xisum, g = gamma;
+    xisum.swap(xs);
+    gamma.swap(g);
+    Matrix<float> a = alpha_hat;
+    alpha_hat.swap(a);
+    Vector<double> c = log_c;
+    log_c.swap(c);
+    alpha_q.relocate();
+    gamma_q.relocate();
+    std::map<block_key, Vector<double> > gs = gamma_sums;
+    gamma_sums.swap(gs);
+}
+
+Matrix<double> HMM::log_block_transition(const int span, const block_key &key) const
+{
+    const TransitionBundle *tb = ib->tb;
+    Matrix<double> A;
+    auto es_it = tb->eigensystems.find(key);
+    double log_scale = 0.;
+    if (span > 1 and es_it != tb->eigensystems.end())
+    {
+        const eigensystem &es = es_it->second;
+        A = es.P_r * es.d_r_scaled.array().pow(span).matrix().asDiagonal() * es.Pinv_r;
+        log_scale = span * std::log(es.scale);
+    }
+    else
+    {
+        Vector<double> Bd = ib->emission_probs->at(key).template cast<double>();
+        A = Bd.asDiagonal() * tb->Td.transpose();
+        if (span > 1)
+            A = Matrix<double>(A).pow(span);
+    }
+    // Entries which should be zero may be slightly negative after the
+    // eigendecomposition.
+    return (A.cwiseAbs().array().max(1e-300).log() + log_scale).matrix();
+}
+
+viterbi_path HMM::viterbi()
+{
+    if (M > std::numeric_limits<uint16_t>::max())
+        throw std::runtime_error("too many hidden states for Viterbi decoding");
+    DEBUG1 << "viterbi (HMM #" << hmm_num << ")";
+    // Most blocks share a few (span, key) pairs.
+    LRUCache<std::pair<int, block_key>, Matrix<double> > log_A(256);
+    std::vector<uint16_t> back((size_t)M * L);
+    Vector<double> delta = ib->pi->template cast<double>().array().max(1e-300).log(), next(M);
+    viterbi_path ret;
+    ret.logp = 0.;
+    for (int ell = 1; ell < L + 1; ++ell)
+    {
+        const std::pair<int, block_key> k(obs(ell - 1, 0), ob_key(ell - 1));
+        const Matrix<double>* A = log_A.find(k);
+        Matrix<double> fresh;
+        if (A == nullptr)
+        {
+            fresh = log_block_transition(k.first, k.second);
+            log_A.insert(k, fresh);
+            A = &fresh;
+        }
+        for (int j = 0; j < M; ++j)
+        {
+            int i;
+            next(j) = (A->row(j).transpose() + delta).maxCoeff(&i);
+            back[(size_t)(ell - 1) * M + j] = i;
+        }
+        // Keep delta near zero, accumulating the offset.
+        const double m = next.maxCoeff();
+        CHECK_NAN(m);
+        ret.logp += m;
+        delta = next.array() - m;
+    }
+    ret.states.resize(L);
+    if (L == 0)
+        return ret;
+    delta.maxCoeff(&ret.states[L - 1]);
+    for (int ell = L - 1; ell > 0; --ell)
+        ret.states[ell - 1] = back[(size_t)ell * M + ret.states[ell]];
+    return ret;
+}
+
+size_t HMM::forward_bytes() const
+{
+    return alpha_hat.size() * sizeof(float) + alpha_q.bytes() + 
+        gamma.size() * sizeof(double) + gamma_q.bytes();
+}
+
 Vector<adouble> HMM::Q(void)
 {
     DEBUG1 << "HMM::Q";
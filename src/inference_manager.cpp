@@ -1,13 +1,18 @@
 #include <vector>
 #include <utility>
 #include <map>
+#include <exception>
+#include <algorithm>
+#include <omp.h>
 
 #include "inference_manager.h"
 #include "transition.h"
 #include "bin_key.h"
 #include "marginalize_key.h"
-#include "tensorslice.h"
 #include "jcsfs.h"
+#include "matrix_cache.h"
+#include "timer.h"
+#include "numa_topology.h"
 
 PiecewiseConstantRateFunction<adouble>* defaultEta(const std::vector<double> &hidden_states)
 {
@@ -26,26 +31,39 @@ InferenceManager::InferenceManager(
         const std::vector<double> hidden_states,
         ConditionedSFS<adouble> *csfs) :
     saveGamma(false),
+    quantizeForward(false),
+    numaAware(false),
     hidden_states(hidden_states),
     npop(npop),
     sfs_dim(sfs_dim),
     M(hidden_states.size() - 1),
     obs(map_obs(observations, obs_lengths)),
     csfs(csfs),
-    hmms(obs.size()),
     pi(M),
-    targets(fill_targets()),
+    targets(fill_targets(0)),
     tb(targets, &emission_probs),
-    ib{&pi, &tb, &emission_probs, &saveGamma},
+    ib{&pi, &tb, &emission_probs, &saveGamma, &quantizeForward},
     dirty({true, true, true}),
-    eta(defaultEta(hidden_states))
+    eta(defaultEta(hidden_states)),
+    eta_memo(8),
+    transition_memo(8),
+    dirty_work_calls(0),
+    numa_threads(0),
+    placement_stale(false),
+    replicas_stale(true)
 {
     recompute_initial_distribution();
     transition = Matrix<adouble>::Zero(M, M);
     transition.setZero();
+    create_hmms(0);
+}
+
+void InferenceManager::create_hmms(const unsigned int first)
+{
+    hmms.resize(obs.size());
     InferenceBundle *ibp = &ib;
 #pragma omp parallel for
-    for (unsigned int i = 0; i < obs.size(); ++i)
+    for (unsigned int i = first; i < obs.size(); ++i)
     {
         DEBUG1 << "creating HMM i: " << i << " L:" <<
                   this->obs.at(i).rows() << " M:" << ibp->pi->rows();
@@ -53,6 +71,72 @@ InferenceManager::InferenceManager(
     }
 }
 
+void InferenceManager::setHiddenStates(const std::vector<double> hs)
+{
+    if (hs.size() < 2 or not std::is_sorted(hs.begin(), hs.end()))
+        throw std::runtime_error("hidden states must be sorted and contain at least two points");
+    hidden_states = hs;
+    M = hidden_states.size() - 1;
+    eta.reset(new PiecewiseConstantRateFunction<adouble>(*eta, hidden_states));
+    // Memoized results are keyed on the hidden states in effect when
+    // setParams was last called, which the key still refers to.
+    eta_memo.clear();
+    transition_memo.clear();
+    last_transition.reset();
+    pi.resize(M);
+    recompute_initial_distribution();
+    transition = Matrix<adouble>::Zero(M, M);
+    emission.resize(0, 0);
+    for (hmmptr &hmm : hmms)
+        hmm->reset();
+    placement_stale = true;
+    dirty = {true, true, true};
+}
+
+void InferenceManager::addObservations(const std::vector<int> obs_lengths, const std::vector<int*> observations)
+{
+    const unsigned int first = obs.size();
+    for (auto &ob : map_obs(observations, obs_lengths))
+        obs.push_back(ob);
+    const spp::sparse_hash_set<std::pair<int, block_key> > new_targets = fill_targets(first);
+    targets.insert(new_targets.begin(), new_targets.end());
+    register_observations(first);
+    create_hmms(first);
+    // Emission probabilities are needed for any new keys.
+    dirty.theta = true;
+    placement_stale = true;
+}
+
+void InferenceManager::removeObservations(std::vector<int> indices)
+{
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    if (not indices.empty() and (indices.front() < 0 or indices.back() >= (int)obs.size()))
+        throw std::out_of_range("observation index out of range");
+    // Rebuilt rather than erased from, since assigning to an Eigen::Map
+    // would copy the data it refers to instead of rebinding it.
+    std::vector<Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > > kept_obs;
+    std::vector<hmmptr> kept_hmms;
+    for (unsigned int i = 0, k = 0; i < obs.size(); ++i)
+    {
+        if (k < indices.size() and indices[k] == (int)i)
+        {
+            k++;
+            continue;
+        }
+        kept_obs.push_back(obs[i]);
+        kept_hmms.push_back(std::move(hmms[i]));
+    }
+    obs.swap(kept_obs);
+    hmms.swap(kept_hmms);
+    for (unsigned int i = 0; i < hmms.size(); ++i)
+        hmms[i]->hmm_num = i;
+    // Spans only occurring in the removed data would otherwise still be
+    // decomposed in every E step.
+    targets = fill_targets(0);
+    placement_stale = true;
+}
+
 void InferenceManager::recompute_initial_distribution()
 {
     for (int m = 0; m < M - 1; ++m)
@@ -88,7 +172,9 @@ void InferenceManager::setTheta(const double theta)
 
 void InferenceManager::parallel_do(std::function<void(hmmptr&)> lambda)
 {
-#pragma omp parallel for
+    // Static, so that each HMM is always run by the same thread (see
+    // update_placement()).
+#pragma omp parallel for schedule(static)
     for (auto it = hmms.begin(); it < hmms.end(); ++it)
         lambda(*it);
 }
@@ -97,27 +183,141 @@ template <typename T>
 std::vector<T> InferenceManager::parallel_select(std::function<T(hmmptr &)> lambda)
 {
     std::vector<T> ret(hmms.size());
-#pragma omp parallel for
+#pragma omp parallel for schedule(static)
     for (unsigned int i = 0; i < hmms.size(); ++i)
         ret[i] = lambda(hmms[i]);
     return ret;
 }
 template std::vector<double> InferenceManager::parallel_select(std::function<double(hmmptr &)>);
 template std::vector<adouble> InferenceManager::parallel_select(std::function<adouble(hmmptr &)>);
+template std::vector<viterbi_path> InferenceManager::parallel_select(std::function<viterbi_path(hmmptr &)>);
 
-void InferenceManager::Estep(bool fbonly)
+void InferenceManager::prepare_hmms()
 {
-    DEBUG1 << "E step";
     do_dirty_work();
     tb.update(transition, true);
-    parallel_do([fbonly] (hmmptr &hmm) { hmm->Estep(fbonly); });
+    replicas_stale = true;
+    update_placement();
+}
+
+void InferenceManager::Estep(bool fbonly)
+{
+    DEBUG1 << "E step";
+    prepare_hmms();
+    parallel_do([fbonly] (hmmptr &hmm) { if (hmm->weight > 0.) hmm->Estep(fbonly); });
+}
+
+void InferenceManager::setWeights(const std::vector<double> weights)
+{
+    if (weights.size() != hmms.size())
+        throw std::runtime_error("a weight is needed for each observation set");
+    for (unsigned int i = 0; i < hmms.size(); ++i)
+    {
+        if (not (weights[i] >= 0. and std::isfinite(weights[i])))
+            throw std::runtime_error("weights must be finite and non-negative");
+        hmms[i]->weight = weights[i];
+    }
+}
+
+void InferenceManager::writePosterior(const posterior_options &opts)
+{
+    if (opts.origins.size() != hmms.size())
+        throw std::runtime_error("an origin is needed for each observation set");
+    posterior_writer writer(opts, hidden_states);
+    std::vector<std::unique_ptr<posterior_stream> > streams;
+    for (unsigned int i = 0; i < hmms.size(); ++i)
+    {
+        const long length = obs[i].col(0).template cast<long>().sum();
+        streams.emplace_back(new posterior_stream(writer, i, opts.origins[i] + length));
+        hmms[i]->posterior = streams[i].get();
+    }
+    const bool save = saveGamma;
+    saveGamma = false;
+    try
+    {
+        Estep(false);
+    }
+    catch (...)
+    {
+        saveGamma = save;
+        for (auto &hmm : hmms)
+            hmm->posterior = nullptr;
+        throw;
+    }
+    saveGamma = save;
+    for (auto &hmm : hmms)
+        hmm->posterior = nullptr;
+    writer.close();
+}
+
+std::vector<viterbi_path> InferenceManager::viterbi()
+{
+    DEBUG1 << "Viterbi decoding";
+    prepare_hmms();
+    return parallel_select<viterbi_path>([] (hmmptr &hmm) { return hmm->viterbi(); });
+}
+
+std::vector<double> InferenceManager::forwardLoglik()
+{
+    DEBUG1 << "forward algorithm";
+    prepare_hmms();
+    return parallel_select<double>([] (hmmptr &hmm) { return hmm->forward_loglik(); });
+}
+
+std::vector<double> InferenceManager::benchmarkEstep(const int reps)
+{
+    prepare_hmms();
+    double sites = 0.;
+    for (auto &ob : obs)
+        sites += ob.col(0).template cast<double>().sum();
+    Timer timer;
+    for (int i = 0; i < reps; ++i)
+        parallel_do([] (hmmptr &hmm) { hmm->Estep(false); });
+    const double t_fixed = timer.elapsed() / reps;
+    const std::vector<double> ll_fixed = loglik();
+    timer.reset();
+    for (int i = 0; i < reps; ++i)
+        parallel_do([] (hmmptr &hmm) { hmm->Estep_dynamic(false); });
+    const double t_dynamic = timer.elapsed() / reps;
+    const std::vector<double> ll_dynamic = loglik();
+    double dev = 0.;
+    for (unsigned int i = 0; i < ll_fixed.size(); ++i)
+        dev = std::max(dev, std::abs(ll_fixed[i] - ll_dynamic[i]));
+    return {(double)M, sites / t_fixed, sites / t_dynamic, dev};
+}
+
+std::vector<double> InferenceManager::validateQuantization()
+{
+    const bool save = quantizeForward;
+    std::vector<double> ret(6);
+    for (int i = 0; i < 2; ++i)
+    {
+        quantizeForward = (i == 1);
+        Estep(false);
+        for (double ll : loglik())
+            ret[i] += ll;
+        for (adouble q : Q())
+            ret[2 + i] += q.value();
+        for (auto &hmm : hmms)
+            ret[4 + i] += hmm->forward_bytes();
+    }
+    quantizeForward = save;
+    return ret;
 }
 
 std::vector<adouble> InferenceManager::Q(void)
 {
     DEBUG1 << "InferenceManager::Q";
     do_dirty_work();
-    std::vector<Vector<adouble> > ps = parallel_select<Vector<adouble> >([] (hmmptr &hmm) { return hmm->Q(); });
+    update_placement();
+    std::vector<Vector<adouble> > ps = parallel_select<Vector<adouble> >([] (hmmptr &hmm)
+    {
+        if (hmm->weight > 0.)
+            return Vector<adouble>(hmm->weight * hmm->Q());
+        Vector<adouble> zero(4);
+        zero.setZero();
+        return zero;
+    });
     std::vector<adouble> q(4, 0);
     for (unsigned int j = 0; j < 4; ++j)
         for (unsigned int i = 0; i < ps.size(); ++i)
@@ -137,7 +337,7 @@ std::vector<Matrix<double>*> InferenceManager::getGammas()
 {
     std::vector<Matrix<double>*> ret;
     for (auto &hmm : hmms)
-        ret.push_back(&hmm->gamma);
+        ret.push_back(&hmm->expanded_gamma());
     return ret;
 }
 
@@ -163,6 +363,7 @@ Matrix<adouble>& InferenceManager::getTransition(void)
 
 Matrix<adouble>& InferenceManager::getEmission(void)
 {
+    materialize_emission();
     return emission;
 }
 
@@ -173,7 +374,8 @@ std::map<block_key, Vector<adouble> >& InferenceManager::getEmissionProbs()
 
 std::vector<double> InferenceManager::loglik(void)
 {
-    return parallel_select<double>([] (hmmptr &hmm) { return hmm->loglik(); });
+    return parallel_select<double>([] (hmmptr &hmm)
+            { return hmm->weight > 0. ? hmm->weight * hmm->loglik() : 0.; });
 }
 
 // Begin stuff for NPop inference manager
@@ -188,53 +390,195 @@ std::vector<Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen:
 }
 
 template <size_t P>
-void NPopInferenceManager<P>::populate_emission_probs()
+void NPopInferenceManager<P>::register_observations(const unsigned int first)
 {
-    std::vector<std::map<block_key, Vector<adouble> > > eps(obs.size());
-// #pragma omp parallel for
-    for (unsigned int j = 0; j < obs.size(); ++j)
+    std::set<block_key> new_keys;
+    for (const block_key &key : observed_keys(first))
+        if (bins.count(key) == 0)
+            new_keys.insert(key);
+    if (new_keys.empty())
+        return;
+    std::map<block_key, block_key_prob_map> new_bins = construct_bins(new_keys);
+    bins.insert(new_bins.begin(), new_bins.end());
+    for (const block_key &key : new_keys)
     {
-        const Vector<adouble> tmp;
-        const Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > ob = obs[j];
-        const int q = ob.cols() - 1;
-        for (int i = 0; i < ob.rows(); ++i)
-        {
-            block_key key(ob.row(i).tail(q).transpose());
-            if (eps.at(j).count(key) == 0)
-                eps.at(j).insert({key, tmp});
-        }
+        emission_probs.emplace(key, Vector<adouble>());
+        bpm_keys.push_back(key);
     }
-    for (const std::map<block_key, Vector<adouble> > &ep : eps)
-        emission_probs.insert(ep.begin(), ep.end());
-    for (const auto p : emission_probs)
-        bpm_keys.push_back(p.first);
+    bin_weights = compile_bins();
 }
 
-void InferenceManager::do_dirty_work()
+void InferenceManager::recompute_sfss()
 {
-    // Figure out what changed and recompute accordingly.
-    if (dirty.eta)
+    const eta_result* r = eta_memo.find(eta_key);
+    if (r)
+    {
+        pi = r->pi;
+        sfss = r->sfss;
+    }
+    else
     {
         recompute_initial_distribution();
+        prepare_csfs();
         sfss = csfs->compute(*eta);
+        eta_memo.insert(eta_key, {pi, sfss});
+    }
+}
+
+void InferenceManager::recompute_transition()
+{
+    param_key key = eta_key;
+    key.push_back(rho);
+    const Matrix<adouble>* t = transition_memo.find(key);
+    if (t)
+        transition = *t;
+    else
+    {
+        transition = compute_transition(*eta, rho, last_transition);
+        transition_memo.insert(key, transition);
+    }
+}
+
+void InferenceManager::do_dirty_work()
+{
+    // Figure out what changed and recompute accordingly. The transition
+    // matrix depends only on eta and rho, so it is computed concurrently
+    // with the CSFS and emission probabilities, which it does not share
+    // any state with. Both branches contain parallel loops of their own,
+    // so nested parallelism is enabled while they run.
+    const bool update_sfss = dirty.eta;
+    const bool update_emission = dirty.theta or dirty.eta;
+    const bool update_transition = dirty.eta or dirty.rho;
+    std::exception_ptr error;
+    const int levels = omp_get_max_active_levels();
+    if (update_transition and update_emission)
+        omp_set_max_active_levels(std::max(levels, 2));
+#pragma omp parallel sections num_threads(2) if(update_transition and update_emission)
+    {
+#pragma omp section
+        {
+            try
+            {
+                if (update_sfss)
+                    recompute_sfss();
+                if (update_emission)
+                    recompute_emission_probs();
+            }
+            catch (...)
+            {
+#pragma omp critical(do_dirty_work_error)
+                error = std::current_exception();
+            }
+        }
+#pragma omp section
+        {
+            try
+            {
+                if (update_transition)
+                    recompute_transition();
+            }
+            catch (...)
+            {
+#pragma omp critical(do_dirty_work_error)
+                error = std::current_exception();
+            }
+        }
     }
-    if (dirty.theta or dirty.eta)
-        recompute_emission_probs();
-    if (dirty.eta or dirty.rho)
-        transition = compute_transition(*eta, rho);
+    omp_set_max_active_levels(levels);
+    if (error)
+        std::rethrow_exception(error);
+    if (++dirty_work_calls % 100 == 0)
+        DEBUG1 << "memo hit rates: eta=" << eta_memo.hit_rate() 
+               << " transition=" << transition_memo.hit_rate();
     if (dirty.theta or dirty.eta or dirty.rho)
+    {
         tb.update(transition, false);
+        replicas_stale = true;
+    }
     // restore pristine status
     dirty = {false, false, false};
 }
 
+void InferenceManager::update_placement()
+{
+    const int nthreads = numaAware ? omp_get_max_threads() : 0;
+    if (nthreads != numa_threads or placement_stale)
+    {
+        // The calling thread is thread 0 of the teams below. Only the
+        // worker threads stay pinned.
+        affinity_guard guard;
+        if (nthreads == 0)
+        {
+            if (numa_threads > 0)
+            {
+#pragma omp parallel num_threads(numa_threads)
+                pin_thread(-1);
+            }
+            for (hmmptr &hmm : hmms)
+                hmm->ib = &ib;
+            replicas.clear();
+            hmm_nodes.clear();
+        }
+        else
+        {
+            // Each thread is pinned to its node, and then copies the HMMs
+            // it will run under parallel_do() into memory of that node.
+            const numa_topology &topology = get_numa_topology();
+            DEBUG1 << "placing " << hmms.size() << " HMMs on " << topology.nodes() << " NUMA nodes";
+            replicas.clear();
+            replicas.resize(topology.nodes());
+            hmm_nodes.assign(hmms.size(), 0);
+#pragma omp parallel num_threads(nthreads)
+            {
+                const int node = topology.node_of_thread(omp_get_thread_num(), omp_get_num_threads());
+                if (not pin_thread(node) and omp_get_thread_num() == 0)
+                    WARNING << "unable to pin threads to NUMA nodes";
+#pragma omp for schedule(static)
+                for (unsigned int i = 0; i < hmms.size(); ++i)
+                {
+                    hmms[i]->localize();
+                    hmm_nodes[i] = node;
+                }
+            }
+            replicas_stale = true;
+        }
+        numa_threads = nthreads;
+        placement_stale = false;
+    }
+    if (numa_threads > 0 and replicas_stale)
+        refresh_replicas();
+    replicas_stale = false;
+}
+
+void InferenceManager::refresh_replicas()
+{
+    // The first thread of each node makes (and so first touches) that
+    // node's copy. The initial distribution is small enough to share.
+    const numa_topology &topology = get_numa_topology();
+#pragma omp parallel num_threads(numa_threads)
+    {
+        const int t = omp_get_thread_num(), nt = omp_get_num_threads();
+        const int node = topology.node_of_thread(t, nt);
+        if (t == 0 or topology.node_of_thread(t - 1, nt) != node)
+        {
+            std::unique_ptr<numa_replica> &r = replicas[node];
+            if (not r)
+                r.reset(new numa_replica);
+            r->tb.reset(new TransitionBundle(tb));
+            r->emission_probs = emission_probs;
+            r->ib = {&pi, r->tb.get(), &r->emission_probs, &saveGamma, &quantizeForward};
+        }
+    }
+    for (unsigned int i = 0; i < hmms.size(); ++i)
+        hmms[i]->ib = replicas[hmm_nodes[i]] ? &replicas[hmm_nodes[i]]->ib : &ib;
+}
 
-spp::sparse_hash_set<std::pair<int, block_key> > InferenceManager::fill_targets()
+spp::sparse_hash_set<std::pair<int, block_key> > InferenceManager::fill_targets(const unsigned int first)
 {
     DEBUG1 << "parallel filling targets";
     std::vector<spp::sparse_hash_set<std::pair<int, block_key> > > v(obs.size());
 #pragma omp parallel for
-    for (unsigned int j = 0; j < obs.size(); ++j)
+    for (unsigned int j = first; j < obs.size(); ++j)
     {
         const Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > ob = obs.at(j);
         const int q = ob.cols() - 1;
@@ -253,9 +597,30 @@ spp::sparse_hash_set<std::pair<int, block_key> > InferenceManager::fill_targets(
     return ret;
 }
 
+// Append the values and derivatives of params to key. Lengths are
+// included so that different shapes cannot produce the same key.
+static void append_key(param_key &key, const ParameterVector &params)
+{
+    key.push_back(params.size());
+    for (const std::vector<adouble> &v : params)
+    {
+        key.push_back(v.size());
+        for (const adouble &x : v)
+        {
+            key.push_back(x.value());
+            key.push_back(x.derivatives().size());
+            for (int i = 0; i < x.derivatives().size(); ++i)
+                key.push_back(toDouble(x.derivatives()(i)));
+        }
+    }
+}
+
 void InferenceManager::setParams(const ParameterVector &params)
 {
     eta.reset(new PiecewiseConstantRateFunction<adouble>(params, hidden_states));
+    eta_key.clear();
+    append_key(eta_key, params);
+    eta_key.insert(eta_key.end(), hidden_states.begin(), hidden_states.end());
     dirty.eta = true;
 }
 
@@ -327,43 +692,68 @@ block_key NPopInferenceManager<P>::folded_key(const block_key &bk)
 }
 
 template <size_t P>
-std::map<block_key, block_key_prob_map>
-NPopInferenceManager<P>::construct_bins(const double polarization_error)
+std::set<block_key> NPopInferenceManager<P>::observed_keys(const unsigned int first)
 {
-    assert(polarization_error >= 0.);
-    assert(polarization_error <= 1.);
     std::vector<std::set<block_key> > bks(obs.size());
-    for (unsigned int j = 0; j < obs.size(); ++j)
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int j = first; j < obs.size(); ++j)
     {
-        const Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> ob = obs.at(j);
+        const Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > &ob = obs.at(j);
         const int q = ob.cols() - 1;
         for (int i = 0; i < ob.rows(); ++i)
             bks.at(j).emplace(ob.row(i).tail(q).transpose());
     }
-    std::set<block_key> bksc;
+    std::set<block_key> ret;
     for (const std::set<block_key> &sbk : bks)
-        bksc.insert(sbk.begin(), sbk.end());
-    const std::vector<block_key> vbk(bksc.begin(), bksc.end());
+        ret.insert(sbk.begin(), sbk.end());
+    return ret;
+}
+
+template <size_t P>
+std::map<block_key, block_key_prob_map>
+NPopInferenceManager<P>::construct_bins(const std::set<block_key> &bksc)
+{
+    assert(polarization_error >= 0.);
+    assert(polarization_error <= 1.);
     std::map<block_key, block_key_prob_map> ret;
-    for (auto it = vbk.begin(); it < vbk.end(); ++it)
+    if (load_bins(n, na, polarization_error, bksc, ret))
+        return ret;
+    const std::vector<block_key> vbk(bksc.begin(), bksc.end());
+
+    // Each observed key is binned into a set of complete keys, many of
+    // which are shared between observed keys (for example, all keys
+    // differing only in a missing first coordinate). Each distinct
+    // complete key is marginalized once.
+    std::vector<std::set<block_key> > key_bins(vbk.size());
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < vbk.size(); ++i)
+        key_bins[i] = bin_key<P>::run(vbk[i], na, 1.0);
+    std::map<block_key, block_key_prob_map> marginals;
+    for (const std::set<block_key> &kb : key_bins)
+        for (const block_key &k : kb)
+            marginals.emplace(k, block_key_prob_map());
+    std::vector<std::pair<const block_key, block_key_prob_map>*> mv;
+    for (auto &p : marginals)
+        mv.push_back(&p);
+    const hypergeometric_table hyp(n.maxCoeff());
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < mv.size(); ++i)
+        mv[i]->second = marginalize_key<P>::run(mv[i]->first.vals, n, na, hyp);
+
+    std::vector<block_key_prob_map> bkpms(vbk.size());
+    bool empty = false;
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < vbk.size(); ++i)
     {
-        block_key bk = *it;
         block_key_prob_map m, m2;
-        const std::set<block_key> bins = bin_key<P>::run(bk, na, 1.0);
-        DEBUG1 << "block_key: " << bk << " bins:" << bins;
-        for (const block_key &k : bins)
-        {
-            const std::map<block_key, double> probs =
-                marginalize_key<P>::run(k.vals, n, na);
-            for (const auto &p : probs)
+        for (const block_key &k : key_bins[i])
+            for (const auto &p : marginals.at(k))
             {
                 const block_key mbk = convert_monomorphic(p.first);
                 m[mbk] += (1. - polarization_error) * p.second;
                 m[folded_key(mbk)] += polarization_error * p.second;
             }
-        }
         double s = 0.0;
-        DEBUG1 << "polarization error: " << polarization_error;
         for (const auto &p : m)
         {
             if (p.second <= 0 or is_monomorphic(p.first))
@@ -371,32 +761,34 @@ NPopInferenceManager<P>::construct_bins(const double polarization_error)
             m2[p.first] = p.second;
             s += p.second;
         }
-        block_key_prob_map bkpm;
         if (s <= 0)
         {
-            DEBUG1 << bk;
-            throw std::runtime_error("s<=0");
+            DEBUG1 << vbk[i];
+#pragma omp critical(construct_bins_empty)
+            empty = true;
+            continue;
         }
         for (const auto &p : m2)
-            bkpm[bk_to_map_key(p.first)] += p.second / s;
-        ret.emplace(bk, bkpm);
+            bkpms[i][bk_to_map_key(p.first)] += p.second / s;
     }
+    if (empty)
+        throw std::runtime_error("s<=0");
+    for (unsigned int i = 0; i < vbk.size(); ++i)
+        ret.emplace(vbk[i], std::move(bkpms[i]));
     DEBUG1 << ret;
+    store_bins(n, na, polarization_error, ret);
     return ret;
 }
 
 
 template <size_t P>
-void NPopInferenceManager<P>::recompute_emission_probs()
+void NPopInferenceManager<P>::materialize_emission()
 {
-    // Initialize emission matrix
     // Due to lack of good support for tensors, we store the emission
     // tensor in "flattened" matrix form. Note that this is actually
     // 1 larger along each axis than the true number, because the SFS
     // ranges in {0, 1, ..., n_pop_k}.
     emission = Matrix<adouble>::Zero(M, (na(0) + 1) * sfs_dim);
-    emission.setZero();
-
     Eigen::Matrix<adouble, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> em_tmp(na(0) + 1, sfs_dim);
     std::vector<Matrix<adouble> > new_sfss = incorporate_theta(sfss, theta);
     for (int m = 0; m < M; ++m)
@@ -405,7 +797,11 @@ void NPopInferenceManager<P>::recompute_emission_probs()
         em_tmp = new_sfss.at(m);
         emission.row(m) = Matrix<adouble>::Map(em_tmp.data(), 1, (na(0) + 1) * sfs_dim);
     }
-    
+}
+
+template <size_t P>
+void NPopInferenceManager<P>::recompute_emission_probs()
+{
     DEBUG1 << "recompute B";
     Matrix<adouble> e2 = Matrix<adouble>::Zero(M, 2);
     std::vector<adouble> avg_ct = eta->average_coal_times();
@@ -431,14 +827,45 @@ void NPopInferenceManager<P>::recompute_emission_probs()
     }
     const adouble zero = eta->zero();
     const adouble one = zero + 1.;
+
+    // Sum the bins of every key at once. Only the columns of the
+    // flattened emission matrix which some bin refers to are computed;
+    // their values and derivatives are stacked as planes of a dense
+    // matrix, which is multiplied by the sparse bin weights.
+    const int C = bin_columns.size();
+    std::vector<incorporated_sfs<adouble> > isfs;
+    for (int m = 0; m < M; ++m)
+        isfs.emplace_back(sfss.at(m), theta);
+    Matrix<adouble> columns(M, C);
+#pragma omp parallel for
+    for (int j = 0; j < C; ++j)
+    {
+        const int c = bin_columns[j];
+        for (int m = 0; m < M; ++m)
+            columns(m, j) = isfs[m](c / sfs_dim, c % sfs_dim);
+    }
+    CHECK_NAN(columns);
+    int nd = 0;
+    for (int m = 0; m < M; ++m)
+        for (int j = 0; j < C; ++j)
+            nd = std::max(nd, (int)columns(m, j).derivatives().size());
+    Matrix<double> planes = Matrix<double>::Zero(C, M * (nd + 1));
+    for (int m = 0; m < M; ++m)
+        for (int j = 0; j < C; ++j)
+        {
+            const adouble &x = columns(m, j);
+            planes(j, m) = x.value();
+            for (int k = 0; k < x.derivatives().size(); ++k)
+                planes(j, (k + 1) * M + m) = x.derivatives()(k);
+        }
+    const Matrix<double> binned = bin_weights * planes;
+
     DEBUG1 << "bpm_keys";
 #pragma omp parallel for
-for (auto it = bpm_keys.begin(); it < bpm_keys.end(); ++it)
+    for (unsigned int i = 0; i < bpm_keys.size(); ++i)
     {
-        const block_key k = *it;
-        std::array<std::set<FixedVector<int, 3> >, P> s;
+        const block_key &k = bpm_keys[i];
         Vector<adouble> tmp(M);
-        tmp.fill(zero);
         bool reduced = true;
         bool miss = true;
         FixedVector<int, P> a, b, nb;
@@ -460,8 +887,13 @@ for (auto it = bpm_keys.begin(); it < bpm_keys.end(); ++it)
         }
         else
         {
-            for (const auto &p : bins.at(k))
-                tmp += p.second * tensorRef(p.first);
+            Eigen::VectorXd d(nd);
+            for (int m = 0; m < M; ++m)
+            {
+                for (int j = 0; j < nd; ++j)
+                    d(j) = binned(i, (j + 1) * M + m);
+                tmp(m) = adouble(binned(i, m), d);
+            }
         }
         if (tmp.maxCoeff() > 1.0 or tmp.minCoeff() <= 0.0)
         {
@@ -473,19 +905,41 @@ for (auto it = bpm_keys.begin(); it < bpm_keys.end(); ++it)
             throw std::runtime_error("probability vector not in [0, 1]");
         }
         CHECK_NAN(tmp);
-#pragma omp critical(assign_emission_probs)
-        {
-            this->emission_probs.at(k) = tmp;
-        }
+        // Each key is assigned by exactly one iteration, and the map
+        // itself is not modified, so no synchronization is needed.
+        this->emission_probs.at(k) = tmp;
     }
     DEBUG1 << "recompute done";
 }
 
-
 template <size_t P>
-Vector<adouble> NPopInferenceManager<P>::tensorRef(const block_key &key)
+Eigen::SparseMatrix<double, Eigen::RowMajor> NPopInferenceManager<P>::compile_bins()
 {
-    return tensorSlice<2 * P>::run(emission, key.vals, tensordims);
+    // Row-major position of each bin in a tensor of shape tensordims.
+    std::vector<std::vector<std::pair<int, double> > > pos(bpm_keys.size());
+    std::set<int> cols;
+    for (unsigned int i = 0; i < bpm_keys.size(); ++i)
+        for (const auto &p : bins.at(bpm_keys[i]))
+        {
+            int c = 0;
+            for (unsigned int d = 0; d < 2 * P; ++d)
+                c = c * tensordims(d) + p.first(d);
+            pos[i].emplace_back(c, p.second);
+            cols.insert(c);
+        }
+    bin_columns.assign(cols.begin(), cols.end());
+    std::vector<Eigen::Triplet<double> > triplets;
+    for (unsigned int i = 0; i < bpm_keys.size(); ++i)
+        for (const std::pair<int, double> &p : pos[i])
+        {
+            const int j = std::lower_bound(bin_columns.begin(), bin_columns.end(), p.first) - bin_columns.begin();
+            triplets.emplace_back(i, j, p.second);
+        }
+    DEBUG1 << "bins refer to " << bin_columns.size() << " of " 
+           << tensordims.prod() << " emission columns";
+    Eigen::SparseMatrix<double, Eigen::RowMajor> ret(bpm_keys.size(), bin_columns.size());
+    ret.setFromTriplets(triplets.begin(), triplets.end());
+    return ret;
 }
 
 
@@ -533,12 +987,22 @@ TwoPopInferenceManager::TwoPopInferenceManager(
                 (FixedVector<int, 2>() << n1, n2).finished(),
                 (FixedVector<int, 2>() << a1, a2).finished(),
                 obs_lengths, observations, hidden_states, polarization_error,
-                create_jcsfs(n1, n2, a1, a2, hidden_states)), a1(a1), a2(a2)
+                create_jcsfs(n1, n2, a1, a2, hidden_states)), a1(a1), a2(a2),
+        split(0.), jcsfs_stale(false)
 {
     if (a1 + a2 != 2)
         throw std::runtime_error("configuration not supported");
 }
 
+void TwoPopInferenceManager::setHiddenStates(const std::vector<double> hs)
+{
+    InferenceManager::setHiddenStates(hs);
+    // The joint CSFS is constructed for a fixed set of hidden states,
+    // and must be precomputed again for the last parameters.
+    csfs.reset(create_jcsfs(n(0), n(1), a1, a2, hs));
+    jcsfs_stale = not params1.empty();
+}
+
 void TwoPopInferenceManager::setParams(
         const ParameterVector &distinguished_params,
         const ParameterVector &params1,
@@ -546,7 +1010,22 @@ void TwoPopInferenceManager::setParams(
         const double split)
 {
     InferenceManager::setParams(distinguished_params);
+    // The joint CSFS also depends on the marginal models.
+    append_key(eta_key, params1);
+    append_key(eta_key, params2);
+    eta_key.push_back(split);
+    this->params1 = params1;
+    this->params2 = params2;
+    this->split = split;
+    jcsfs_stale = true;
+}
+
+void TwoPopInferenceManager::prepare_csfs()
+{
+    if (not jcsfs_stale)
+        return;
     dynamic_cast<JointCSFS<adouble>*>(csfs.get())->pre_compute(params1, params2, split);
+    jcsfs_stale = false;
 }
 
 template class NPopInferenceManager<1>;
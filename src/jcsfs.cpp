@@ -52,6 +52,36 @@ double JointCSFS<T>::scipy_stats_hypergeom_pmf(const int k, const int M, const i
         throw std::runtime_error("bad hyp");
 }
 
+// The sums over (nseg, np1) which occur below all have the form
+//
+//   sum_{np1 + np2 = nseg} h(np1, nseg) * c(nseg) * A(np1, b1) * B(np2, b2)
+//
+// Collecting the hypergeometric weights into X(np1, np2) = h(np1, nseg) *
+// c(nseg) turns this into the matrix product A^T * X * B.
+template <typename T>
+Matrix<T> JointCSFS<T>::hyp_weights(const Matrix<double> &hyp, 
+        const int offset, const Vector<T> &c) const
+{
+    Matrix<T> X(hyp.rows(), n2 + 1);
+    for (int np2 = 0; np2 <= n2; ++np2)
+        for (int np1 = 0; np1 < hyp.rows(); ++np1)
+        {
+            const int col = np1 + np2 - offset;
+            if (col < 0 or col >= hyp.cols())
+                X(np1, np2) = c(0) * 0.;
+            else
+                X(np1, np2) = hyp(np1, col) * c(col);
+        }
+    return X;
+}
+
+template <typename T>
+Matrix<T> JointCSFS<T>::moran_sandwich(const Matrix<T> &A, 
+        const Matrix<T> &X, const Matrix<T> &B) const
+{
+    return dense_product(Matrix<T>(A.transpose()), dense_product(X, B));
+}
+
 template <typename T>
 Vector<T> undistinguishedSFS(const Matrix<T> &csfs)
 {
@@ -134,33 +164,12 @@ void JointCSFS<T>::jcsfs_helper_tau_below_split(const int m,
     }
     eMn10_avg /= (double)K;
     eMn12_avg /= (double)K;
-    Matrix<T> const& c_eMn10_avg = eMn10_avg;
-    Matrix<T> const& c_eMn12_avg = eMn12_avg;
-    Matrix<T> const& c_eMn2 = eMn2;
     // Now moran down
-#pragma omp parallel for collapse(2)
-    for (int b1 = 0; b1 <= n1; ++b1)
-    {
-        for (int b2 = 0; b2 <= n2; ++b2)
-        {
-            for (int nseg = 1; nseg <= n1 + n2; ++nseg)
-            {
-                for (int np1 = std::max(nseg - n2, 0); np1 <= std::min(nseg, n1 + 1); ++np1)
-                {
-                    const int np2 = nseg - np1;
-                    const double h = scipy_stats_hypergeom_pmf(np1, n1 + n2 + 1, nseg, n1 + 1);
-                    T x = sfs_above_split(nseg - 1);
-                    x *= c_eMn2(np2, b2);
-                    x *= h;
-                    x *= weight;
-                    T x0 = x * c_eMn10_avg(np1, b1);
-                    T x2 = x * c_eMn12_avg(np1, b1);
-                    tensorRef(m, 0, b1, 0, b2) += x0;
-                    tensorRef(m, 2, b1, 0, b2) += x2;
-                }
-            }
-        }
-    }
+    Matrix<T> X = hyp_weights(hyp2, 1, sfs_above_split);
+    X *= weight;
+    const Matrix<T> XB = dense_product(X, eMn2);
+    addBlock(m, 0, 0, dense_product(Matrix<T>(eMn10_avg.transpose()), XB));
+    addBlock(m, 2, 0, dense_product(Matrix<T>(eMn12_avg.transpose()), XB));
 }
 
 template <typename T>
@@ -173,35 +182,11 @@ void JointCSFS<T>::jcsfs_helper_tau_above_split(const int m,
     // Shift eta1 back by split units in time 
     PiecewiseConstantRateFunction<T> shifted_eta1(shiftParams(params1, split), {t1 - split, t2 - split});
     const Matrix<T> rsfs = csfs.at(n1 + n2).compute(shifted_eta1)[0];
-    Matrix<T> const& c_eMn2 = eMn2;
-    std::array<Matrix<T>, 3> const& c_eMn1 = eMn1;
-
-#pragma omp parallel for collapse(2)
-    for (int b1 = 0; b1 < n1 + 1; ++b1)
+    for (int i = 0; i < 3; ++i)
     {
-        for (int b2 = 0; b2 < n2 + 1; ++b2)
-        {
-            const T myweight = weight;
-            for (int nseg = 0; nseg < n1 + n2 + 1; ++nseg)
-            {
-                for (int np1 = std::max(nseg - n2, 0); np1 < std::min(nseg, n1) + 1; ++np1)
-                {
-                    int np2 = nseg - np1;
-                    // scipy.stats.hypergeom.pmf(np1, n1 + n2, nseg, n1)  = choose(nseg, np1) * choose(n1 + n2 - nseg, n1 - np1)
-                    // gsl_ran_hypergeometric_pdf(unsigned int k, unsigned int n1, unsigned int n2, unsigned int t) 
-                    double h = scipy_stats_hypergeom_pmf(np1, n1 + n2, nseg, n1);
-                    for (int i = 0; i < 3; ++i)
-                    {
-                        T x = rsfs(i, nseg);
-                        x *= c_eMn1[i](np1, b1);
-                        x *= c_eMn2(np2, b2);
-                        x *= h;
-                        x *= myweight;
-                        tensorRef(m, i, b1, 0, b2) += x;
-                    }
-                }
-            }
-        }
+        Matrix<T> X = hyp_weights(hyp1, 0, rsfs.row(i).transpose());
+        X *= weight;
+        addBlock(m, i, 0, moran_sandwich(eMn1[i], X, eMn2));
     }
      
     // pop 1, below split
@@ -291,25 +276,14 @@ void JointCSFS<T>::pre_compute_apart()
         if (t2 <= split)
             continue;
         const Matrix<T> csfs_shift = csfs_at_split[i++];
-#pragma omp parallel for collapse(2)
-        for (int b1 = 0; b1 <= n1; ++b1)
-        {
-            for (int b2 = 0; b2 <= n2; ++b2)
-            {
-                for (int nseg = 0; nseg <= n1 + n2; ++nseg)
-                {
-                    for (int np1 = std::max(nseg - n2, 0); np1 <= std::min(nseg, n1); ++np1)
-                    {
-                        const int np2 = nseg - np1;
-                        const double h = scipy_stats_hypergeom_pmf(np1, n1 + n2, nseg, n1);
-                        tensorRef(m, 1, b1, 1, b2) += h * csfs_shift(2, nseg) * T11(np1, b1) * T21(np2, b2);
-                        tensorRef(m, 1, b1, 0, b2) += 0.5 * h * csfs_shift(1, nseg) * T11(np1, b1) * T20(np2, b2);
-                        tensorRef(m, 0, b1, 1, b2) += 0.5 * h * csfs_shift(1, nseg) * T10(np1, b1) * T21(np2, b2);
-                        tensorRef(m, 0, b1, 0, b2) += h * csfs_shift(0, nseg) * T10(np1, b1) * T20(np2, b2);
-                    }
-                }
-            }
-        }
+        const Matrix<T> X0 = hyp_weights(hyp1, 0, csfs_shift.row(0).transpose());
+        Matrix<T> X1 = hyp_weights(hyp1, 0, csfs_shift.row(1).transpose());
+        X1 *= 0.5;
+        const Matrix<T> X2 = hyp_weights(hyp1, 0, csfs_shift.row(2).transpose());
+        addBlock(m, 1, 1, moran_sandwich(T11, X2, T21));
+        addBlock(m, 1, 0, moran_sandwich(T11, X1, T20));
+        addBlock(m, 0, 1, moran_sandwich(T10, X1, T21));
+        addBlock(m, 0, 0, moran_sandwich(T10, X0, T20));
     }
     // Cover edge case
     if (split == 0.)
@@ -1,282 +1,599 @@
+#include <array>
+#include <cerrno>
+#include <map>
+#include <cstring>
 #include <fstream>
-#include <cereal/cereal.hpp>
-#include <cereal/archives/portable_binary.hpp>
-#include <cereal/types/map.hpp>
+#include <iterator>
+#include <sstream>
+#include <mutex>
+#include <type_traits>
 
 #include <unistd.h>
 #include <fcntl.h> // for open()
-#include <cerrno> // for errno
-#include <cstdio> // for perror()
+#include <sys/mman.h> // for mmap()
+#include <sys/stat.h>
 
 #include "matrix_cache.h"
 #include "moran_eigensystem.h"
 #include "mpq_support.h"
 
-namespace Eigen
+// On-disk layout of a cache file: this header, followed by the entries
+// of each matrix in column-major order.
+namespace
 {
-    template <class Archive, class _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols> inline
-    void
-    save(Archive & ar, Eigen::Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols> const & m)
+    const int num_matrices = 6;
+    const uint32_t cache_magic = 0x534d4331; // "SMC1"
+
+    struct cache_header
     {
-        int32_t rows = m.rows();
-        int32_t cols = m.cols();
-        ar(rows);
-        ar(cols);
-        ar(cereal::binary_data(m.data(), rows * cols * sizeof(_Scalar)));
-    }
+        uint32_t magic;
+        int32_t n;
+        int32_t exact;
+        int32_t pad;
+        int32_t rows[num_matrices], cols[num_matrices];
+    };
 
-    template <class Archive, class _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols> inline
-        void
-    load(Archive & ar, Eigen::Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols> & m)
+    struct matrix_set
     {
-        int32_t rows;
-        int32_t cols;
-        ar(rows);
-        ar(cols);
+        int n;
+        bool exact;
+        std::array<Matrix<double>, num_matrices> mats; // X0, X2, M0, M1, Uinv_mp0, Uinv_mp2
+    };
 
-        m.resize(rows, cols);
+    size_t storage_size(const cache_header &h)
+    {
+        size_t ret = sizeof(cache_header);
+        for (int i = 0; i < num_matrices; ++i)
+            ret += sizeof(double) * h.rows[i] * h.cols[i];
+        return ret;
+    }
 
-        ar(cereal::binary_data(m.data(), static_cast<std::size_t>(rows * cols * sizeof(_Scalar))));
+    ConstMatrixMap view(const char* storage, const int k)
+    {
+        const cache_header* h = reinterpret_cast<const cache_header*>(storage);
+        const char* p = storage + sizeof(cache_header);
+        for (int i = 0; i < k; ++i)
+            p += sizeof(double) * h->rows[i] * h->cols[i];
+        return ConstMatrixMap(reinterpret_cast<const double*>(p), h->rows[k], h->cols[k]);
     }
 }
 
-static std::map<int, MatrixCache> cache;
+MatrixCache::MatrixCache(std::shared_ptr<const char> storage) :
+    storage(storage),
+    n(reinterpret_cast<const cache_header*>(storage.get())->n),
+    exact(reinterpret_cast<const cache_header*>(storage.get())->exact),
+    X0(view(storage.get(), 0)), X2(view(storage.get(), 1)),
+    M0(view(storage.get(), 2)), M1(view(storage.get(), 3)),
+    Uinv_mp0(view(storage.get(), 4)), Uinv_mp2(view(storage.get(), 5))
+{}
+
 static std::string store_location;
+static std::mutex cache_mutex;
+// In-process index. The per-n mutexes ensure that each sample size is
+// loaded or computed at most once, without blocking other sample sizes.
+static std::map<int, std::shared_ptr<const MatrixCache> > cache;
+static std::map<int, std::unique_ptr<std::mutex> > cache_n_mutex;
 
 void init_cache(const std::string loc)
 {
+    std::lock_guard<std::mutex> lock(cache_mutex);
     store_location = loc;
-    int fd;
-    const std::string lockfile = store_location + ".lock";
-    fd = open(lockfile.c_str(), O_WRONLY | O_CREAT, 0600);
-    struct flock oflock;
-    oflock.l_type = F_WRLCK;/*Write lock*/
-    oflock.l_whence = SEEK_SET;
-    oflock.l_start = 0;
-    oflock.l_len = 0;/*Lock whole file*/
-    if (fd == -1 || fcntl(fd, F_SETLK, &oflock) == -1)
+    if (mkdir(store_location.c_str(), 0700) == -1 and errno != EEXIST)
+        WARNING << "Could not create cache directory " << store_location << ": " << strerror(errno);
+    DEBUG1 << "init_cache(" << store_location << ")";
+}
+
+static std::string cache_file(const std::string &dir, const int n, const bool exact)
+{
+    return dir + "/" + std::to_string(n) + (exact ? ".exact" : ".fast");
+}
+
+// Memory map a cache file read-only. Returns nullptr if the file is
+// missing or is not a valid cache file for sample size n.
+static std::shared_ptr<const MatrixCache> load_cache_file(const std::string &path, const int n)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 and (size_t)st.st_size >= sizeof(cache_header))
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
     {
-        DEBUG1 << "Couldn't acquire lock in init_cache()";
-        return;
+        WARNING << "Could not map cache file " << path;
+        return nullptr;
     }
-    DEBUG1 << "Acquired lock in init_cache()";
-    std::ifstream in(store_location, std::ios::binary);
-    if (in)
+    const size_t len = st.st_size;
+    std::shared_ptr<const char> storage(static_cast<const char*>(addr),
+            [len] (const char* p) { munmap(const_cast<char*>(p), len); });
+    const cache_header* h = reinterpret_cast<const cache_header*>(addr);
+    if (h->magic != cache_magic or h->n != n or storage_size(*h) != len)
     {
-        cereal::PortableBinaryInputArchive iarchive(in);
-        iarchive(cache);
+        WARNING << "Ignoring invalid cache file " << path;
+        return nullptr;
     }
-    oflock.l_type = F_UNLCK;
-    if (fcntl(fd, F_UNLCK, &oflock) == -1)
-        ERROR << "Couldn't release lock in store_cache()";
-    close(fd);
-    remove(lockfile.c_str());
-    DEBUG1 << "init_cache() successful";
+    DEBUG1 << "Loaded " << path;
+    return std::make_shared<const MatrixCache>(storage);
 }
 
-void store_cache()
+static std::shared_ptr<const char> serialize(const matrix_set &ms)
 {
-    DEBUG1 << "storing cache: " << store_location;
-    int fd;
-    const std::string lockfile = store_location + ".lock";
-    fd = open(lockfile.c_str(), O_WRONLY | O_CREAT, 0600);
-    struct flock oflock;
-    oflock.l_type = F_WRLCK; /*Write lock*/
-    oflock.l_whence = SEEK_SET;
-    oflock.l_start = 0;
-    oflock.l_len = 0;/*Lock whole file*/
-    if (fd == -1 || fcntl(fd, F_SETLK, &oflock) == -1)
+    cache_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = cache_magic;
+    h.n = ms.n;
+    h.exact = ms.exact;
+    for (int i = 0; i < num_matrices; ++i)
     {
-        DEBUG1 << "Couldn't acquire lock in store_cache()";
-        return;
+        h.rows[i] = ms.mats[i].rows();
+        h.cols[i] = ms.mats[i].cols();
     }
-    DEBUG1 << "Acquired lock in store_cache()";
-    std::ofstream out(store_location, std::ios::binary);
-    if (out)
+    char* buf = new char[storage_size(h)];
+    std::memcpy(buf, &h, sizeof(h));
+    char* p = buf + sizeof(h);
+    for (int i = 0; i < num_matrices; ++i)
     {
-        cereal::PortableBinaryOutputArchive oarchive(out);
-        oarchive(cache);
+        const size_t sz = sizeof(double) * ms.mats[i].size();
+        std::memcpy(p, ms.mats[i].data(), sz);
+        p += sz;
     }
-    else
+    return std::shared_ptr<const char>(buf, std::default_delete<const char[]>());
+}
+
+static bool store_cache_file(const std::string &path, const std::shared_ptr<const char> &storage)
+{
+    DEBUG1 << "storing cache: " << path;
+    const size_t len = storage_size(*reinterpret_cast<const cache_header*>(storage.get()));
+    bool ret = write_file_atomic(path, storage.get(), len);
+    if (ret)
+        DEBUG1 << "store_cache() successful";
+    return ret;
+}
+
+// Exclusive, blocking lock on a per-n lock file. This makes concurrent
+// processes wait for each other instead of duplicating the computation.
+// The lock file is never removed, since doing so would race with other
+// processes that have it open.
+class cache_file_lock
+{
+    public:
+    cache_file_lock(const std::string &path) : fd(open(path.c_str(), O_WRONLY | O_CREAT, 0600))
     {
-        ERROR << "could not open cache file for storage";
+        struct flock fl;
+        std::memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        if (fd == -1 or fcntl(fd, F_SETLKW, &fl) == -1)
+            DEBUG1 << "Couldn't acquire lock on " << path;
     }
-    oflock.l_type = F_UNLCK;
-    if (fcntl(fd, F_UNLCK, &oflock) == -1)
-        ERROR << "Couldn't release lock in store_cache()";
-    close(fd);
-    remove(lockfile.c_str());
-    DEBUG1 << "store_cache() successful";
+    ~cache_file_lock()
+    {
+        if (fd != -1)
+            close(fd); // releases the lock
+    }
+    private:
+    const int fd;
+};
+
+static bool fast_matrices = false;
+static int fast_matrices_prec = 0;
+
+void set_fast_matrices(const bool fast, const int prec)
+{
+    fast_matrices = fast;
+    fast_matrices_prec = prec;
+}
+
+template <typename T>
+T rational(const long p, const long q);
+
+template <>
+mpq_class rational<mpq_class>(const long p, const long q)
+{
+    mpq_class ret(p, q);
+    ret.canonicalize();
+    return ret;
 }
 
-typedef struct { MatrixXq coeffs; } below_coeff;
+template <>
+mpfr::mpreal rational<mpfr::mpreal>(const long p, const long q)
+{
+    return mpfr::mpreal(p) / q;
+}
 
-std::map<int, below_coeff> below_coeffs_memo;
-below_coeff compute_below_coeffs(int n)
+template <typename T>
+Matrix<T> compute_below_coeffs(int n, const mpfr_prec_t prec)
 {
-    if (below_coeffs_memo.count(n) == 0)
+    DEBUG1 << "Computing below_coeffs";
+    Matrix<T> mlast;
+    for (int nn = 2; nn < n + 3; ++nn)
     {
-        DEBUG1 << "Computing below_coeffs";
-        below_coeff ret;
-        MatrixXq mlast;
-        for (int nn = 2; nn < n + 3; ++nn)
-        {
-            MatrixXq mnew(n + 1, nn - 1);
-            mnew.col(nn - 2).setZero();
-            mnew(nn - 2, nn - 2) = 1;
+        Matrix<T> mnew(n + 1, nn - 1);
+        mnew.col(nn - 2).setZero();
+        mnew(nn - 2, nn - 2) = 1;
 #pragma omp parallel for
-            for (int k = nn - 1; k > 1; --k)
-            {
-                long denom = (nn + 1) * (nn - 2) - (k + 1) * (k - 2);
-                mpq_class c1((nn + 1) * (nn - 2), denom);
-                mnew.col(k - 2) = mlast.col(k - 2) * c1;
-            }
-            for (int k = nn - 1; k > 1; --k)
-            {
-                long denom = (nn + 1) * (nn - 2) - (k + 1) * (k - 2);
-                mpq_class c2((k + 2) * (k - 1), denom);
-                mnew.col(k - 2) -= mnew.col(k - 1) * c2;
-            }
-            mlast = mnew;
+        for (int k = nn - 1; k > 1; --k)
+        {
+            set_precision<T>(prec);
+            long denom = (nn + 1) * (nn - 2) - (k + 1) * (k - 2);
+            mnew.col(k - 2) = mlast.col(k - 2) * rational<T>((nn + 1) * (nn - 2), denom);
+        }
+        for (int k = nn - 1; k > 1; --k)
+        {
+            long denom = (nn + 1) * (nn - 2) - (k + 1) * (k - 2);
+            mnew.col(k - 2) -= mnew.col(k - 1) * rational<T>((k + 2) * (k - 1), denom);
         }
-        ret.coeffs = mlast;
-        below_coeffs_memo.emplace(n, ret); 
+        mlast = mnew;
     }
-    return below_coeffs_memo.at(n);
+    return mlast;
 }
 
-std::map<std::array<int, 3>, mpq_class> _Wnbj_memo;
-mpq_class calculate_Wnbj(int n, int b, int j)
+// Wnbj(b - 1, j - 2) for 1 <= b < n, 2 <= j < n + 1, computed by running
+// the three-term recurrence in j for each b.
+template <typename T>
+Matrix<T> calculate_Wnbj(int n)
 {
-    switch (j)
-    {
-        case 2:
-            return mpq_class(6, n + 1);
-        case 3:
-            if (n == 2 * b) return 0;
-            return mpq_class(30 * (n - 2 * b), (n + 1) * (n + 2));
-        default:
-            std::array<int, 3> key = {n, b, j};
-            if (_Wnbj_memo.count(key) == 0)
+    Matrix<T> ret(n - 1, n - 1);
+    for (int b = 1; b < n; ++b)
+        for (int j = 2; j < n + 1; ++j)
+        {
+            T &r = ret(b - 1, j - 2);
+            switch (j)
             {
-                int jj = j - 2;
-                mpq_class c1(-(1 + jj) * (3 + 2 * jj) * (n - jj), jj * (2 * jj - 1) * (n + jj + 1));
-                mpq_class c2((3 + 2 * jj) * (n - 2 * b), jj * (n + jj + 1));
-                mpq_class ret = calculate_Wnbj(n, b, jj) * c1;
-                ret += calculate_Wnbj(n, b, jj + 1) * c2;
-                _Wnbj_memo[key] = ret;
+                case 2:
+                    r = rational<T>(6, n + 1);
+                    break;
+                case 3:
+                    r = rational<T>(30 * (n - 2 * b), (n + 1) * (n + 2));
+                    break;
+                default:
+                    long jj = j - 2;
+                    r = ret(b - 1, jj - 2) * 
+                        rational<T>(-(1 + jj) * (3 + 2 * jj) * (n - jj), jj * (2 * jj - 1) * (n + jj + 1));
+                    r += ret(b - 1, jj - 1) * 
+                        rational<T>((3 + 2 * jj) * (n - 2 * b), jj * (n + jj + 1));
             }
-            return _Wnbj_memo[key];
-    }
+        }
+    return ret;
 }
 
-std::map<std::array<int, 3>, mpq_class> pnkb_dist_memo;
 mpq_class pnkb_dist(int n, int m, int l1)
 {
     // Probability that lineage 1 has size |L_1|=l1 below tau,
     // the time at which 1 and 2 coalesce, when there are k 
     // undistinguished lineages remaining, in a sample of n
     // undistinguished (+2 distinguished) lineages overall.
-    std::array<int, 3> key{n, m, l1};
-    if (pnkb_dist_memo.count(key) == 0)
-    {
-        mpz_class binom1, binom2;
-        mpz_bin_uiui(binom1.get_mpz_t(), n + 2 - l1, m + 1);
-        mpz_bin_uiui(binom2.get_mpz_t(), n + 3, m + 3);
-        mpq_class ret(binom1, binom2);
-        ret *= l1;
-        pnkb_dist_memo[key] = ret;
-    }
-    return pnkb_dist_memo[key];
+    mpz_class binom1, binom2;
+    mpz_bin_uiui(binom1.get_mpz_t(), n + 2 - l1, m + 1);
+    mpz_bin_uiui(binom2.get_mpz_t(), n + 3, m + 3);
+    mpq_class ret(binom1, binom2);
+    ret.canonicalize();
+    ret *= l1;
+    return ret;
 }
 
-std::map<std::array<int, 3>, mpq_class> pnkb_undist_memo;
 mpq_class pnkb_undist(int n, int m, int l3)
 {
     // Probability that undistinguished lineage has size |L_1|=l1 below tau,
     // the time at which 1 and 2 coalesce, when there are k 
     // undistinguished lineages remaining, in a sample of n
     // undistinguished (+2 distinguished) lineages overall.
-    std::array<int, 3> key{n, m, l3};
-    if (pnkb_undist_memo.count(key) == 0)
+    mpz_class binom1, binom2;
+    mpz_bin_uiui(binom1.get_mpz_t(), n + 3 - l3, m + 2);
+    mpz_bin_uiui(binom2.get_mpz_t(), n + 3, m + 3);
+    mpq_class ret(binom1, binom2);
+    ret.canonicalize();
+    return ret;
+}
+
+// out = A * diag(d) * B, computed in square blocks of the output which
+// are distributed over threads.
+template <typename T>
+void parallel_matmul(const Matrix<T> &A, const Vector<T> &d, const Matrix<T> &B, 
+        Matrix<double> &out, const mpfr_prec_t prec)
+{
+    const int bs = 32;
+    const Matrix<T> dB = d.asDiagonal() * B;
+    const int rb = (A.rows() + bs - 1) / bs, cb = (B.cols() + bs - 1) / bs;
+    out.resize(A.rows(), B.cols());
+#pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int i = 0; i < rb; ++i)
+        for (int j = 0; j < cb; ++j)
+        {
+            set_precision<T>(prec);
+            const int r = std::min(bs, (int)A.rows() - i * bs);
+            const int c = std::min(bs, (int)B.cols() - j * bs);
+            Matrix<T> blk = A.middleRows(i * bs, r) * dB.middleCols(j * bs, c);
+            out.block(i * bs, j * bs, r, c) = blk.template cast<double>();
+        }
+}
+
+template <typename T>
+matrix_set compute_cached_matrices(const int n, const MoranEigensystemT<T> &mei, const mpfr_prec_t prec)
+{
+    set_precision<T>(prec);
+    matrix_set ret;
+    ret.n = n;
+    ret.exact = std::is_same<T, mpq_class>::value;
+    ret.mats[4] = mei.Uinv.rightCols(n).template cast<double>();
+    ret.mats[5] = mei.Uinv.reverse().leftCols(n).template cast<double>();
+
+    Vector<T> D_subtend_above(n);
+    for (int i = 0; i < n; ++i)
+        D_subtend_above(i) = rational<T>(i + 1, n + 1);
+
+    Vector<T> D_subtend_below(n + 1);
+    for (int i = 0; i < n + 1; ++i)
+        D_subtend_below(i) = rational<T>(2, i + 2);
+
+    Matrix<T> P_dist(n + 1, n + 1), P_undist(n + 1, n);
+    const Matrix<T> Wnbj = calculate_Wnbj<T>(n + 1);
+
+    // P_dist(k, b) = probability of state (1, b) when there are k undistinguished lineages remaining
+    P_dist.setZero();
+    for (int k = 0; k < n + 1; ++k)
+        for (int b = 1; b < n - k + 2; ++b)
+            P_dist(k, b - 1) = Eigen::internal::cast<mpq_class, T>(pnkb_dist(n, k, b));
+
+    // P_undist(k, b) = probability of state (0, b + 1) when there are k undistinguished lineages remaining
+    P_undist.setZero();
+    for (int k = 1; k < n + 1; ++k)
+        for (int b = 1; b < n - k + 2; ++b)
+            P_undist(k, b - 1) = Eigen::internal::cast<mpq_class, T>(pnkb_undist(n, k, b));
+
+    Vector<T> lsp(n + 1);
+    for (int i = 0; i < n + 1; ++i)
+        lsp(i) = i + 2;
+
+    const Matrix<T> bc = compute_below_coeffs<T>(n, prec);
+    const Matrix<T> WnbjT = Wnbj.transpose();
+
+    DEBUG1 << "X0";
+    parallel_matmul<T>(WnbjT, Vector<T>::Ones(n) - D_subtend_above, 
+            mei.U.bottomRows(n), ret.mats[0], prec);
+    DEBUG1 << "X2";
+    parallel_matmul<T>(WnbjT, D_subtend_above, 
+            mei.U.reverse().topRows(n), ret.mats[1], prec);
+    DEBUG1 << "M0";
+    parallel_matmul<T>(bc, lsp.cwiseProduct(Vector<T>::Ones(n + 1) - D_subtend_below),
+            P_undist, ret.mats[2], prec);
+    DEBUG1 << "M1";
+    parallel_matmul<T>(bc, lsp.cwiseProduct(D_subtend_below), P_dist, ret.mats[3], prec);
+    return ret;
+}
+
+// Working precision for the fast path. The entries of the Moran
+// eigenvectors grow combinatorially in n, and the products above suffer
+// cancellation of the same order, so the number of bits must grow
+// linearly in n.
+static mpfr_prec_t fast_prec(const int n)
+{
+    if (fast_matrices_prec > 0)
+        return fast_matrices_prec;
+    return 128 + 4 * n;
+}
+
+matrix_set compute_cached_matrices(const int n, const bool fast, const int prec)
+{
+    if (fast)
+    {
+        DEBUG1 << "moran eigensystem (fast, " << prec << " bits)";
+        const MoranEigensystemT<mpfr::mpreal> mei = compute_moran_eigensystem(n, prec);
+        return compute_cached_matrices<mpfr::mpreal>(n, mei, prec);
+    }
+    DEBUG1 << "moran eigensystem";
+    const MoranEigensystem mei = compute_moran_eigensystem(n);
+    DEBUG1 << "moran eigensystem done";
+    return compute_cached_matrices<mpq_class>(n, mei, 0);
+}
+
+std::shared_ptr<const MatrixCache> cached_matrices(const int n)
+{
+    std::mutex* n_mutex;
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache.count(n) > 0 and (fast_matrices or cache.at(n)->exact))
+            return cache.at(n);
+        std::unique_ptr<std::mutex> &m = cache_n_mutex[n];
+        if (not m)
+            m.reset(new std::mutex());
+        n_mutex = m.get();
+        dir = store_location;
+    }
+    std::lock_guard<std::mutex> n_lock(*n_mutex);
+    {
+        // Another thread may have finished while we were waiting.
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache.count(n) > 0 and (fast_matrices or cache.at(n)->exact))
+            return cache.at(n);
+    }
+    std::shared_ptr<const MatrixCache> ret;
+    if (dir.empty())
+        ret = std::make_shared<const MatrixCache>(
+                serialize(compute_cached_matrices(n, fast_matrices, fast_prec(n))));
+    else
+    {
+        const std::string path = cache_file(dir, n, not fast_matrices);
+        cache_file_lock file_lock(path + ".lock");
+        ret = load_cache_file(cache_file(dir, n, true), n);
+        if (not ret and fast_matrices)
+            ret = load_cache_file(path, n);
+        if (not ret)
+        {
+            std::shared_ptr<const char> storage = 
+                serialize(compute_cached_matrices(n, fast_matrices, fast_prec(n)));
+            if (store_cache_file(path, storage))
+                ret = load_cache_file(path, n);
+            if (not ret)
+                ret = std::make_shared<const MatrixCache>(storage);
+        }
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache[n] = ret;
+    return ret;
+}
+
+double fast_matrices_error(const int n, const int prec)
+{
+    const matrix_set exact = compute_cached_matrices(n, false, 0);
+    const matrix_set fast = compute_cached_matrices(n, true, prec > 0 ? prec : fast_prec(n));
+    double ret = 0.;
+    for (int i = 0; i < num_matrices; ++i)
+    {
+        const double scale = exact.mats[i].cwiseAbs().maxCoeff();
+        if (scale > 0)
+            ret = std::max(ret, (exact.mats[i] - fast.mats[i]).cwiseAbs().maxCoeff() / scale);
+    }
+    return ret;
+}
+
+// Bin maps are stored as a header identifying the sample configuration,
+// followed by each observed key and its bins, in key order:
+//
+//   magic, P, n[P], na[P], polarization_error, number of keys,
+//   { key[3P], number of bins, { bin[2P], weight }* }*
+//
+// Files are named by a hash of everything up to the bins, which is
+// compared in full when loading.
+namespace
+{
+    const uint32_t bins_magic = 0x534d4231; // "SMB1"
+
+    template <typename T>
+    void put(std::string &buf, const T &x) 
+    { 
+        buf.append(reinterpret_cast<const char*>(&x), sizeof(T)); 
+    }
+
+    template <typename T>
+    bool get(const std::string &buf, size_t &pos, T &x)
     {
-        mpz_class binom1, binom2;
-        mpz_bin_uiui(binom1.get_mpz_t(), n + 3 - l3, m + 2);
-        mpz_bin_uiui(binom2.get_mpz_t(), n + 3, m + 3);
-        mpq_class ret(binom1, binom2);
-        pnkb_undist_memo.emplace(key, ret);
+        if (pos + sizeof(T) > buf.size())
+            return false;
+        std::memcpy(&x, buf.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    void put_key(std::string &buf, const block_key &key)
+    {
+        for (int i = 0; i < key.size(); ++i)
+            put<int32_t>(buf, key(i));
+    }
+
+    std::string bins_header(const Vector<int> &n, const Vector<int> &na, 
+            const double polarization_error, const std::set<block_key> &keys)
+    {
+        std::string ret;
+        put<uint32_t>(ret, bins_magic);
+        put<int32_t>(ret, n.size());
+        for (int p = 0; p < n.size(); ++p)
+            put<int32_t>(ret, n(p));
+        for (int p = 0; p < na.size(); ++p)
+            put<int32_t>(ret, na(p));
+        put<double>(ret, polarization_error);
+        put<int64_t>(ret, keys.size());
+        for (const block_key &key : keys)
+            put_key(ret, key);
+        return ret;
+    }
+
+    std::string bins_file(const std::string &dir, const std::string &header)
+    {
+        std::ostringstream ss;
+        ss << dir << "/bins." << std::hex << std::hash<std::string>()(header);
+        return ss.str();
+    }
+
+    bool get_key(const std::string &buf, size_t &pos, Vector<int> &v)
+    {
+        int32_t x;
+        for (int i = 0; i < v.size(); ++i)
+        {
+            if (not get(buf, pos, x))
+                return false;
+            v(i) = x;
+        }
+        return true;
+    }
+
+    bool parse_bins(const std::string &buf, size_t pos, const int P, const size_t nkeys,
+            std::map<block_key, block_key_prob_map> &bins)
+    {
+        Vector<int> kv(3 * P), bv(2 * P);
+        for (size_t k = 0; k < nkeys; ++k)
+        {
+            int32_t nbins;
+            if (not get_key(buf, pos, kv) or not get(buf, pos, nbins))
+                return false;
+            block_key_prob_map &m = bins[block_key(kv)];
+            for (int j = 0; j < nbins; ++j)
+            {
+                double w;
+                if (not get_key(buf, pos, bv) or not get(buf, pos, w))
+                    return false;
+                m.emplace(block_key(bv), w);
+            }
+        }
+        return pos == buf.size() and bins.size() == nkeys;
+    }
+
+    std::string cache_dir()
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        return store_location;
     }
-    return pnkb_undist_memo[key];
 }
 
-MatrixCache& cached_matrices(const int n)
+bool load_bins(const Vector<int> &n, const Vector<int> &na, const double polarization_error,
+        const std::set<block_key> &keys, std::map<block_key, block_key_prob_map> &bins)
 {
-    if (cache.count(n) == 0)
+    const std::string dir = cache_dir();
+    if (dir.empty())
+        return false;
+    const std::string header = bins_header(n, na, polarization_error, keys);
+    const std::string path = bins_file(dir, header);
+    std::ifstream in(path, std::ios::binary);
+    if (not in)
+        return false;
+    const std::string buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::map<block_key, block_key_prob_map> ret;
+    if (buf.compare(0, header.size(), header) != 0 or 
+            not parse_bins(buf, header.size(), n.size(), keys.size(), ret))
     {
-        DEBUG1 << "moran eigensystem";
-        const MoranEigensystem mei = compute_moran_eigensystem(n);
-        DEBUG1 << "moran eigensystem done";
-        VectorXq D_subtend_above = VectorXq::LinSpaced(n, 1, n);
-        D_subtend_above /= n + 1;
-
-        VectorXq D_subtend_below = Eigen::Array<mpq_class, Eigen::Dynamic, 1>::Ones(n + 1) / 
-            Eigen::Array<mpq_class, Eigen::Dynamic, 1>::LinSpaced(n + 1, 2, n + 2);
-        D_subtend_below *= 2;
-
-        MatrixXq Wnbj(n, n), P_dist(n + 1, n + 1), P_undist(n + 1, n);
-        Wnbj.setZero();
-        for (int b = 1; b < n + 1; ++b)
-            for (int j = 2; j < n + 2; ++j)
-                Wnbj(b - 1, j - 2) = calculate_Wnbj(n + 1, b, j);
-
-        // P_dist(k, b) = probability of state (1, b) when there are k undistinguished lineages remaining
-        P_dist.setZero();
-        for (int k = 0; k < n + 1; ++k)
-            for (int b = 1; b < n - k + 2; ++b)
-                P_dist(k, b - 1) = pnkb_dist(n, k, b);
-
-        // P_undist(k, b) = probability of state (0, b + 1) when there are k undistinguished lineages remaining
-        P_undist.setZero();
-        for (int k = 1; k < n + 1; ++k)
-            for (int b = 1; b < n - k + 2; ++b)
-                P_undist(k, b - 1) = pnkb_undist(n, k, b);
-
-        VectorXq lsp = VectorXq::LinSpaced(n + 1, 2, n + 2);
-
-        DEBUG1 << "Eigen uses " << Eigen::nbThreads() << " for matmul";
-
-        below_coeff bc = compute_below_coeffs(n);
-
-        // This is too slow. 
-        DEBUG1 << "X0";
-        // parallel_matmul(Wnbj.transpose(), 
-        //         VectorXq::Ones(n) - D_subtend_above, 
-        //         mei.U.bottomRows(n), 
-        //         cache[n].X0);
-        cache[n].X0 = (Wnbj.transpose() * (VectorXq::Ones(n) - D_subtend_above).asDiagonal() * 
-                       mei.U.bottomRows(n)).template cast<double>();
-        DEBUG1 << "X2";
-        // parallel_matmul(Wnbj.transpose(), 
-        //         D_subtend_above, 
-        //         mei.U.reverse().topRows(n),
-        //         cache[n].X2);
-        cache[n].X2 = (Wnbj.transpose() * D_subtend_above.asDiagonal() * 
-                       mei.U.reverse().topRows(n)).template cast<double>();
-        DEBUG1 << "M0";
-        // parallel_matmul(bc.coeffs,
-        //         lsp.cwiseProduct((VectorXq::Ones(n + 1) - D_subtend_below)),
-        //         P_undist,
-        //         cache[n].M0);
-        cache[n].M0 = (bc.coeffs * lsp.asDiagonal() * (VectorXq::Ones(n + 1) - 
-                       D_subtend_below).asDiagonal() * P_undist).template cast<double>();
-        DEBUG1 << "M1";
-        cache[n].M1 = (bc.coeffs * lsp.asDiagonal() * D_subtend_below.asDiagonal() *
-                       P_dist).template cast<double>();
-        // parallel_matmul(bc.coeffs,
-        //         lsp.cwiseProduct(D_subtend_below),
-        //         P_dist,
-        //         cache[n].M1);
-        store_cache();
+        WARNING << "Ignoring invalid bin cache file " << path;
+        return false;
+    }
+    DEBUG1 << "Loaded " << path;
+    bins = std::move(ret);
+    return true;
+}
+
+void store_bins(const Vector<int> &n, const Vector<int> &na, const double polarization_error,
+        const std::map<block_key, block_key_prob_map> &bins)
+{
+    const std::string dir = cache_dir();
+    if (dir.empty())
+        return;
+    std::set<block_key> keys;
+    for (const auto &p : bins)
+        keys.insert(p.first);
+    const std::string header = bins_header(n, na, polarization_error, keys);
+    std::string buf = header;
+    for (const auto &p : bins)
+    {
+        put_key(buf, p.first);
+        put<int32_t>(buf, p.second.size());
+        for (const auto &q : p.second)
+        {
+            put_key(buf, q.first);
+            put<double>(buf, q.second);
+        }
     }
-    return cache.at(n);
+    const std::string path = bins_file(dir, header);
+    if (write_file_atomic(path, buf.data(), buf.size()))
+        DEBUG1 << "Stored " << path;
 }
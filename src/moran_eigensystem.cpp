@@ -1,8 +1,8 @@
 #include <map>
+#include <mutex>
 
 #include "moran_eigensystem.h"
 
-const mpq_class mpq_1(2, 1);
 const mpq_class mpq_2(2, 1);
 
 Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> moran_rate_matrix(int N)
@@ -51,11 +51,11 @@ Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> modified_moran_rate_matrix(int N
     return ret;
 }
 
-VectorXq solve(const Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> &M)
-// VectorXq solve(const Eigen::SparseMatrixBase<Derived> &M)
+template <typename T>
+Vector<T> solve(const Eigen::SparseMatrix<T, Eigen::RowMajor> &M)
 {
     int n = M.rows();
-    VectorXq ret(n);
+    Vector<T> ret(n);
     ret.setZero();
     ret(n - 1) = 1;
     for (int i = n - 2; i > -1; --i)
@@ -63,34 +63,60 @@ VectorXq solve(const Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> &M)
     return ret;
 }
 
-// This function is not thread safe. Do not call from multiple threads.
-std::map<int, MoranEigensystem> _memo;
-MoranEigensystem& compute_moran_eigensystem(int n)
+template <typename T>
+MoranEigensystemT<T> moran_eigensystem(const int n, const mpfr_prec_t prec)
 {
-    if (_memo.count(n) == 0)
+    set_precision<T>(prec);
+    const Eigen::SparseMatrix<T, Eigen::RowMajor> M = 
+        modified_moran_rate_matrix(n, 0, 2).template cast<T>();
+    const Eigen::SparseMatrix<T, Eigen::RowMajor> Mt = M.transpose();
+    MoranEigensystemT<T> ret(n);
+    ret.Uinv(0, 0) = 2;
+    // Each eigenvector is found by back-substitution in a tridiagonal
+    // system, independently of the others.
+#pragma omp parallel for schedule(dynamic)
+    for (int k = 2; k < n + 3; ++k)
     {
-        Eigen::SparseMatrix<mpq_class, Eigen::RowMajor> M = modified_moran_rate_matrix(n, 0, 2),
-            Mt, I(n + 1, n + 1), A;
-        Mt = M.transpose();
-        MoranEigensystem ret(n);
-        ret.Uinv(0, 0) = mpq_1;
+        set_precision<T>(prec);
+        Eigen::SparseMatrix<T, Eigen::RowMajor> I(n + 1, n + 1), A;
         I.setIdentity();
-        for (int k = 2; k < n + 3; ++k)
+        T rate = -(k * (k - 1) / 2 - 1);
+        ret.D(k - 2) = rate;
+        A = M - rate * I;
+        ret.U.col(k - 2) = solve(A);
+        if (k > 2)
         {
-            mpq_class rate = -(k * (k - 1) / 2 - 1);
-            ret.D(k - 2) = rate;
-            A = M - rate * I;
-            ret.U.col(k - 2) = solve(A);
-            if (k > 2)
-            {
-                A = Mt - rate * I;
-                ret.Uinv.row(k - 2).tail(n) = solve(A.bottomRightCorner(n, n));
-                ret.Uinv(k - 2, 0) = -ret.Uinv(k - 2, 1) * A.coeff(0, 1) / A.coeff(0, 0);
-            }
+            A = Mt - rate * I;
+            ret.Uinv.row(k - 2).tail(n) = solve(Eigen::SparseMatrix<T, Eigen::RowMajor>(A.bottomRightCorner(n, n)));
+            ret.Uinv(k - 2, 0) = -ret.Uinv(k - 2, 1) * A.coeff(0, 1) / A.coeff(0, 0);
         }
-        VectorXq D1 = (ret.Uinv * ret.U).diagonal().cwiseInverse();
-        ret.U = ret.U * D1.asDiagonal();
-        _memo.emplace(n, ret);
     }
+    // Only the diagonal of Uinv * U is needed to normalize the
+    // eigenvectors.
+    Vector<T> D1(n + 1);
+#pragma omp parallel for
+    for (int i = 0; i < n + 1; ++i)
+    {
+        set_precision<T>(prec);
+        D1(i) = 1 / ret.Uinv.row(i).transpose().cwiseProduct(ret.U.col(i)).sum();
+    }
+    ret.U = ret.U * D1.asDiagonal();
+    return ret;
+}
+
+// Entries are never erased, so references into _memo stay valid after
+// the lock is released.
+static std::map<int, MoranEigensystem> _memo;
+static std::mutex _memo_mutex;
+MoranEigensystem& compute_moran_eigensystem(int n)
+{
+    std::lock_guard<std::mutex> lock(_memo_mutex);
+    if (_memo.count(n) == 0)
+        _memo.emplace(n, moran_eigensystem<mpq_class>(n, 0));
     return _memo.at(n);
 }
+
+MoranEigensystemT<mpfr::mpreal> compute_moran_eigensystem(int n, mpfr_prec_t prec)
+{
+    return moran_eigensystem<mpfr::mpreal>(n, prec);
+}
@@ -0,0 +1,144 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <set>
+#include <mutex>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "numa_topology.h"
+
+namespace
+{
+    // Parse a list such as "0-15,32-47" from /sys.
+    std::set<int> parse_cpulist(const std::string &s)
+    {
+        std::set<int> ret;
+        std::stringstream ss(s);
+        std::string range;
+        while (std::getline(ss, range, ','))
+        {
+            if (range.empty() or range == "\n")
+                continue;
+            const size_t dash = range.find('-');
+            const int lo = std::stoi(range.substr(0, dash));
+            const int hi = (dash == std::string::npos) ? lo : std::stoi(range.substr(dash + 1));
+            for (int c = lo; c <= hi; ++c)
+                ret.insert(c);
+        }
+        return ret;
+    }
+
+#ifdef __linux__
+    std::vector<int> current_affinity()
+    {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        std::vector<int> ret;
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+            for (int c = 0; c < CPU_SETSIZE; ++c)
+                if (CPU_ISSET(c, &mask))
+                    ret.push_back(c);
+        return ret;
+    }
+#endif
+
+    numa_topology detect()
+    {
+        numa_topology ret;
+#ifdef __linux__
+        const std::vector<int> allowed = current_affinity();
+        // Node ids need not be contiguous.
+        std::set<int> online;
+        {
+            std::ifstream f("/sys/devices/system/node/online");
+            std::string line;
+            if (f and std::getline(f, line))
+                online = parse_cpulist(line);
+        }
+        std::set<int> seen;
+        for (int node : online)
+        {
+            if (allowed.empty())
+                break;
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (not f)
+                continue;
+            std::string line;
+            std::getline(f, line);
+            const std::set<int> cpus = parse_cpulist(line);
+            std::vector<int> v;
+            for (int c : allowed)
+                if (cpus.count(c))
+                    v.push_back(c);
+            seen.insert(v.begin(), v.end());
+            if (not v.empty())
+                ret.cpus.push_back(v);
+        }
+        // Anything the nodes did not account for, or everything if there
+        // is no node information.
+        std::vector<int> rest;
+        for (int c : allowed)
+            if (seen.count(c) == 0)
+                rest.push_back(c);
+        if (not rest.empty())
+        {
+            if (ret.cpus.empty())
+                ret.cpus.push_back(rest);
+            else
+                ret.cpus.front().insert(ret.cpus.front().end(), rest.begin(), rest.end());
+        }
+#endif
+        if (ret.cpus.empty())
+            ret.cpus.emplace_back();
+        return ret;
+    }
+}
+
+const numa_topology& get_numa_topology()
+{
+    static std::once_flag flag;
+    static numa_topology topology;
+    std::call_once(flag, [] { topology = detect(); });
+    return topology;
+}
+
+bool pin_thread(const int s)
+{
+#ifdef __linux__
+    const numa_topology &topology = get_numa_topology();
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int n = 0; n < topology.nodes(); ++n)
+        if (s < 0 or s == n)
+            for (int c : topology.cpus[n])
+                CPU_SET(c, &mask);
+    if (CPU_COUNT(&mask) == 0)
+        return false;
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+#else
+    return false;
+#endif
+}
+
+affinity_guard::affinity_guard()
+{
+#ifdef __linux__
+    cpus = current_affinity();
+#endif
+}
+
+affinity_guard::~affinity_guard()
+{
+#ifdef __linux__
+    if (cpus.empty())
+        return;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int c : cpus)
+        CPU_SET(c, &mask);
+    sched_setaffinity(0, sizeof(mask), &mask);
+#endif
+}
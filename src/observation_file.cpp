@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h> // for open()
+#include <sys/mman.h> // for mmap()
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "observation_file.h"
+
+namespace
+{
+    const uint32_t file_magic = 0x42434d53; // "SMCB"
+    const uint32_t file_version = 1;
+    const int default_block_rows = 1 << 16;
+    const size_t alignment = 64;
+
+    enum codec { codec_verbatim = 0, codec_deflate = 1 };
+
+    struct file_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t json_bytes;
+        int64_t rows;
+        int32_t cols;
+        int32_t codec;
+        int32_t block_rows;
+        int32_t nblocks;
+        uint64_t index_offset;
+        uint64_t pad[2];
+    };
+    static_assert(sizeof(file_header) == 64, "unexpected header size");
+
+    struct block_entry
+    {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    size_t align(const size_t off) { return (off + alignment - 1) / alignment * alignment; }
+
+    // Private, writable mapping of a whole file.
+    std::shared_ptr<char> map_file(const std::string &path, size_t &len)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw std::runtime_error("could not open " + path);
+        struct stat sb;
+        if (fstat(fd, &sb) == -1 or sb.st_size < (off_t)sizeof(file_header))
+        {
+            close(fd);
+            throw std::runtime_error(path + " is not a binary SMC++ file");
+        }
+        len = sb.st_size;
+        void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("could not map " + path);
+        const size_t l = len;
+        return std::shared_ptr<char>(static_cast<char*>(p), [l] (char* q) { munmap(q, l); });
+    }
+}
+
+bool is_observation_file(const std::string &path)
+{
+    std::ifstream f(path, std::ios::binary);
+    uint32_t magic = 0;
+    f.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    return f and magic == file_magic;
+}
+
+ObservationFile read_observations(const std::string &path)
+{
+    size_t len;
+    std::shared_ptr<char> mapping = map_file(path, len);
+    const file_header &h = *reinterpret_cast<const file_header*>(mapping.get());
+    if (h.magic != file_magic)
+        throw std::runtime_error(path + " is not a binary SMC++ file");
+    if (h.version != file_version)
+        throw std::runtime_error(path + ": unsupported version " + std::to_string(h.version));
+    const uint64_t index_bytes = (uint64_t)h.nblocks * sizeof(block_entry);
+    if (h.rows < 0 or h.rows > std::numeric_limits<int>::max() or h.cols <= 0 or
+            h.block_rows <= 0 or h.nblocks != (h.rows + h.block_rows - 1) / h.block_rows or
+            (h.codec != codec_verbatim and h.codec != codec_deflate) or
+            sizeof(file_header) + h.json_bytes > len or
+            h.index_offset % sizeof(uint64_t) != 0 or
+            h.index_offset > len or index_bytes > len - h.index_offset)
+        throw std::runtime_error(path + ": corrupt header");
+    const block_entry* index = reinterpret_cast<const block_entry*>(mapping.get() + h.index_offset);
+    const size_t row_bytes = h.cols * sizeof(int32_t);
+    bool contiguous = true;
+    for (int b = 0; b < h.nblocks; ++b)
+    {
+        const uint64_t rows = std::min<int64_t>(h.block_rows, h.rows - (int64_t)b * h.block_rows);
+        if (index[b].offset > len or index[b].bytes > len - index[b].offset or
+                (h.codec == codec_verbatim and index[b].bytes != rows * row_bytes))
+            throw std::runtime_error(path + ": corrupt block index");
+        contiguous = contiguous and (b == 0 or index[b].offset == index[b - 1].offset + index[b - 1].bytes);
+    }
+
+    ObservationFile ret;
+    ret.header.assign(mapping.get() + sizeof(file_header), h.json_bytes);
+    ret.rows = h.rows;
+    ret.cols = h.cols;
+    const uint64_t first = h.nblocks > 0 ? index[0].offset : 0;
+    if (h.codec == codec_verbatim and contiguous and first % alignment == 0 and h.nblocks > 0)
+    {
+        DEBUG1 << "mapping observations from " << path;
+        ret.storage = std::shared_ptr<int>(mapping, reinterpret_cast<int*>(mapping.get() + first));
+        return ret;
+    }
+    DEBUG1 << "reading " << h.nblocks << " blocks of observations from " << path;
+    const size_t total = (size_t)h.rows * h.cols;
+    ret.storage = std::shared_ptr<int>(new int[std::max<size_t>(total, 1)], std::default_delete<int[]>());
+    int* out = ret.storage.get();
+    const char* base = mapping.get();
+    bool ok = true;
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < h.nblocks; ++b)
+    {
+        const int64_t row = (int64_t)b * h.block_rows;
+        const uLongf want = std::min<int64_t>(h.block_rows, h.rows - row) * row_bytes;
+        Bytef* dst = reinterpret_cast<Bytef*>(out + row * h.cols);
+        const Bytef* src = reinterpret_cast<const Bytef*>(base + index[b].offset);
+        if (h.codec == codec_verbatim)
+            std::memcpy(dst, src, want);
+        else
+        {
+            uLongf got = want;
+            if (uncompress(dst, &got, src, index[b].bytes) != Z_OK or got != want)
+            {
+#pragma omp atomic write
+                ok = false;
+            }
+        }
+    }
+    if (not ok)
+        throw std::runtime_error(path + ": corrupt block");
+    return ret;
+}
+
+void write_observations(const std::string &path, const std::string &header,
+        const int* data, const int rows, const int cols, const bool compress)
+{
+    if (rows < 0 or cols <= 0)
+        throw std::runtime_error("invalid dimensions");
+    file_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = file_magic;
+    h.version = file_version;
+    h.json_bytes = header.size();
+    h.rows = rows;
+    h.cols = cols;
+    h.codec = compress ? codec_deflate : codec_verbatim;
+    h.block_rows = default_block_rows;
+    h.nblocks = (rows + h.block_rows - 1) / h.block_rows;
+    h.index_offset = align(sizeof(file_header) + header.size());
+    const size_t row_bytes = cols * sizeof(int32_t);
+
+    std::vector<std::vector<Bytef> > blocks(compress ? h.nblocks : 0);
+    bool ok = true;
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int b = 0; b < blocks.size(); ++b)
+    {
+        const int64_t row = (int64_t)b * h.block_rows;
+        const uLong n = std::min<int64_t>(h.block_rows, rows - row) * row_bytes;
+        uLongf sz = compressBound(n);
+        blocks[b].resize(sz);
+        if (compress2(blocks[b].data(), &sz, reinterpret_cast<const Bytef*>(data + row * cols),
+                    n, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+#pragma omp atomic write
+            ok = false;
+        }
+        blocks[b].resize(sz);
+    }
+    if (not ok)
+        throw std::runtime_error("could not compress observations");
+
+    std::vector<block_entry> index(h.nblocks);
+    uint64_t off = align(h.index_offset + index.size() * sizeof(block_entry));
+    for (int b = 0; b < h.nblocks; ++b)
+    {
+        const int64_t row = (int64_t)b * h.block_rows;
+        index[b].offset = off;
+        index[b].bytes = compress ? blocks[b].size() : std::min<int64_t>(h.block_rows, rows - row) * row_bytes;
+        off += index[b].bytes;
+    }
+    std::vector<char> buf(off, 0);
+    std::memcpy(buf.data(), &h, sizeof(h));
+    std::memcpy(buf.data() + sizeof(h), header.data(), header.size());
+    if (h.nblocks > 0)
+        std::memcpy(buf.data() + h.index_offset, index.data(), index.size() * sizeof(block_entry));
+    if (compress)
+        for (int b = 0; b < h.nblocks; ++b)
+            std::memcpy(buf.data() + index[b].offset, blocks[b].data(), blocks[b].size());
+    else if (h.nblocks > 0)
+        std::memcpy(buf.data() + index[0].offset, data, (size_t)rows * row_bytes);
+    if (not write_file_atomic(path, buf.data(), buf.size(), 0644))
+        throw std::runtime_error("could not write " + path);
+}
+
+void write_text_observations(const std::string &path, const std::string &header,
+        const int* data, const int rows, const int cols)
+{
+    const bool gz = path.size() >= 3 and path.compare(path.size() - 3, 3, ".gz") == 0;
+    gzFile f = gzopen(path.c_str(), gz ? "wb" : "wbT");
+    if (not f)
+        throw std::runtime_error("could not open " + path + " for writing");
+    std::string buf = "# SMC++ " + header + "\n";
+    char num[16];
+    bool ok = true;
+    for (int i = 0; ok and i < rows; ++i)
+    {
+        for (int j = 0; j < cols; ++j)
+        {
+            const int len = std::snprintf(num, sizeof(num), j ? " %d" : "%d", data[(size_t)i * cols + j]);
+            buf.append(num, len);
+        }
+        buf += '\n';
+        if (buf.size() > (1 << 20))
+        {
+            ok = gzwrite(f, buf.data(), buf.size()) == (int)buf.size();
+            buf.clear();
+        }
+    }
+    if (not buf.empty())
+        ok = ok and gzwrite(f, buf.data(), buf.size()) == (int)buf.size();
+    if (gzclose(f) != Z_OK or not ok)
+        throw std::runtime_error("could not write " + path);
+}
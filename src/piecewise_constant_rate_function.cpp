@@ -402,6 +402,26 @@ std::vector<T> PiecewiseConstantRateFunction<T>::average_coal_times() const
     return ret;
 }
 
+inline bool _same(const double a, const double b) { return a == b; }
+
+inline bool _same(const adouble &a, const adouble &b)
+{
+    return a.value() == b.value() and 
+        a.derivatives().size() == b.derivatives().size() and
+        a.derivatives() == b.derivatives();
+}
+
+template <typename T>
+int PiecewiseConstantRateFunction<T>::first_changed_piece(const PiecewiseConstantRateFunction<T> &other) const
+{
+    if (ts != other.ts or hidden_states != other.hidden_states or nder != other.nder)
+        return 0;
+    for (int k = 0; k < K; ++k)
+        if (not _same(ada[k], other.ada[k]))
+            return k;
+    return K;
+}
+
 template <typename T>
 T PiecewiseConstantRateFunction<T>::R(const T t) const
 {
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h> // for open()
+
+#include "posterior_writer.h"
+
+namespace
+{
+    const uint32_t file_magic = 0x50434d53; // "SMCP"
+    const uint32_t file_version = 1;
+    const size_t alignment = 64;
+
+    struct file_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t json_bytes;
+        int32_t M;
+        int32_t width;
+        int32_t nquantiles;
+        int32_t pad0;
+        uint64_t nchunks;
+        uint64_t index_offset;
+        uint64_t pad[2];
+    };
+    static_assert(sizeof(file_header) == 64, "unexpected header size");
+    static_assert(sizeof(posterior_chunk) == 40, "unexpected index entry size");
+
+    size_t align(const size_t off) { return (off + alignment - 1) / alignment * alignment; }
+
+    bool pwrite_all(const int fd, const void* data, const size_t len, const uint64_t off)
+    {
+        const char* p = static_cast<const char*>(data);
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t w = pwrite(fd, p + done, len - done, off + done);
+            if (w <= 0)
+                return false;
+            done += w;
+        }
+        return true;
+    }
+
+    bool pread_all(const int fd, void* data, const size_t len, const uint64_t off)
+    {
+        char* p = static_cast<char*>(data);
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t r = pread(fd, p + done, len - done, off + done);
+            if (r <= 0)
+                return false;
+            done += r;
+        }
+        return true;
+    }
+
+    struct fd_closer
+    {
+        int fd;
+        ~fd_closer() { ::close(fd); }
+    };
+
+    bool chunk_order(const posterior_chunk &a, const posterior_chunk &b)
+    {
+        return a.contig < b.contig or (a.contig == b.contig and a.start < b.start);
+    }
+}
+
+posterior_writer::posterior_writer(const posterior_options &opts, const std::vector<double> &hidden_states) :
+    opts(opts), hidden_states(hidden_states), M(hidden_states.size() - 1),
+    nvalues(opts.quantiles.empty() ? M : 2 + opts.quantiles.size()),
+    tmp(atomic_tmp_path(opts.path)), fd(-1), failed(false)
+{
+    if (M < 1 or opts.chunk_rows <= 0)
+        throw std::runtime_error("invalid posterior options");
+    for (unsigned int j = 0; j < opts.quantiles.size(); ++j)
+        if (not (opts.quantiles[j] > 0. and opts.quantiles[j] < 1.) or
+                (j > 0 and opts.quantiles[j] <= opts.quantiles[j - 1]))
+            throw std::runtime_error("quantiles must be increasing and in (0, 1)");
+    if (not opts.quantiles.empty() and (int)opts.times.size() != M)
+        throw std::runtime_error("a time is needed for each hidden state");
+    fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        throw std::runtime_error("could not open " + tmp + " for writing");
+    if (not pwrite_all(fd, opts.header.data(), opts.header.size(), sizeof(file_header)))
+        failed = true;
+    next = align(sizeof(file_header) + opts.header.size());
+}
+
+posterior_writer::~posterior_writer()
+{
+    if (fd != -1)
+    {
+        ::close(fd);
+        unlink(tmp.c_str());
+    }
+}
+
+void posterior_writer::encode(const double* p, float* out) const
+{
+    double total = 0.;
+    for (int k = 0; k < M; ++k)
+        total += p[k];
+    if (opts.quantiles.empty())
+    {
+        for (int k = 0; k < M; ++k)
+            out[k] = p[k] / total;
+        return;
+    }
+    double mean = 0.;
+    for (int k = 0; k < M; ++k)
+        mean += p[k] / total * opts.times[k];
+    out[0] = mean;
+    out[1] = std::max_element(p, p + M) - p;
+    // Quantiles are interpolated linearly within the hidden state which
+    // contains them, or are the start of the last state if it is
+    // unbounded.
+    double cum = 0.;
+    int k = 0;
+    for (unsigned int j = 0; j < opts.quantiles.size(); ++j)
+    {
+        const double q = opts.quantiles[j];
+        while (k < M - 1 and cum + p[k] / total < q)
+            cum += p[k++] / total;
+        const double t0 = hidden_states[k], t1 = hidden_states[k + 1];
+        const double f = p[k] > 0. ? std::min(1., std::max(0., (q - cum) * total / p[k])) : 0.;
+        out[2 + j] = std::isinf(t1) ? t0 : t0 + f * (t1 - t0);
+    }
+}
+
+void posterior_writer::write_chunk(const int c, const long start, const long end,
+        const std::vector<int> &spans, const std::vector<float> &values)
+{
+    const size_t rows = spans.size();
+    if (values.size() != rows * nvalues)
+        throw std::runtime_error("invalid posterior chunk");
+    std::vector<char> buf(rows * sizeof(int32_t) + values.size() * sizeof(float));
+    std::memcpy(buf.data(), spans.data(), rows * sizeof(int32_t));
+    std::memcpy(buf.data() + rows * sizeof(int32_t), values.data(), values.size() * sizeof(float));
+    uint64_t off;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        off = next;
+        next = align(next + buf.size());
+        index.push_back({c, (int32_t)rows, start, end, off, buf.size()});
+    }
+    if (not pwrite_all(fd, buf.data(), buf.size(), off))
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        failed = true;
+    }
+}
+
+void posterior_writer::close()
+{
+    if (fd == -1)
+        throw std::runtime_error(opts.path + " was already closed");
+    std::sort(index.begin(), index.end(), chunk_order);
+    file_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = file_magic;
+    h.version = file_version;
+    h.json_bytes = opts.header.size();
+    h.M = M;
+    h.width = nvalues;
+    h.nquantiles = opts.quantiles.size();
+    h.nchunks = index.size();
+    h.index_offset = next;
+    bool ok = not failed;
+    ok = ok and pwrite_all(fd, index.data(), index.size() * sizeof(posterior_chunk), next);
+    ok = ok and pwrite_all(fd, &h, sizeof(h), 0);
+    ok = (fsync(fd) == 0) and ok;
+    ok = (::close(fd) == 0) and ok;
+    fd = -1;
+    if (ok and rename(tmp.c_str(), opts.path.c_str()) == 0)
+        return;
+    unlink(tmp.c_str());
+    throw std::runtime_error("could not write " + opts.path);
+}
+
+posterior_stream::posterior_stream(posterior_writer &writer, const int contig, const long end) :
+    writer(writer), contig(contig), start(end), end(end) {}
+
+void posterior_stream::add(const int span, const double* p)
+{
+    const int w = writer.width();
+    start -= span;
+    spans.push_back(span);
+    values.resize(values.size() + w);
+    writer.encode(p, &values[values.size() - w]);
+    if ((int)spans.size() == writer.opts.chunk_rows)
+        flush();
+}
+
+void posterior_stream::flush()
+{
+    if (spans.empty())
+        return;
+    // Rows were added last first.
+    const int w = writer.width(), rows = spans.size();
+    std::reverse(spans.begin(), spans.end());
+    for (int i = 0; i < rows / 2; ++i)
+        std::swap_ranges(values.begin() + i * w, values.begin() + (i + 1) * w,
+                values.begin() + (rows - 1 - i) * w);
+    writer.write_chunk(contig, start, end, spans, values);
+    end = start;
+    spans.clear();
+    values.clear();
+}
+
+posterior_block read_posterior(const std::string &path, const int c, const long start, const long end)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("could not open " + path);
+    fd_closer closer{fd};
+    const off_t len = lseek(fd, 0, SEEK_END);
+    file_header h;
+    if (len < (off_t)sizeof(h) or not pread_all(fd, &h, sizeof(h), 0) or h.magic != file_magic)
+        throw std::runtime_error(path + " is not an SMC++ posterior file");
+    if (h.version != file_version)
+        throw std::runtime_error(path + ": unsupported version " + std::to_string(h.version));
+    if (h.M < 1 or h.width < 1 or sizeof(file_header) + h.json_bytes > (uint64_t)len or
+            h.index_offset > (uint64_t)len or
+            h.nchunks > ((uint64_t)len - h.index_offset) / sizeof(posterior_chunk))
+        throw std::runtime_error(path + ": corrupt header");
+    posterior_block ret;
+    ret.M = h.M;
+    ret.width = h.width;
+    ret.header.resize(h.json_bytes);
+    std::vector<posterior_chunk> index(h.nchunks);
+    if (not pread_all(fd, &ret.header[0], h.json_bytes, sizeof(file_header)) or
+            not pread_all(fd, index.data(), index.size() * sizeof(posterior_chunk), h.index_offset))
+        throw std::runtime_error("could not read " + path);
+    // Chunks of a contig are sorted and do not overlap.
+    auto it = std::partition_point(index.begin(), index.end(), [c, start] (const posterior_chunk &e)
+            { return e.contig < c or (e.contig == c and e.end <= start); });
+    std::vector<char> buf;
+    for (; it != index.end() and it->contig == c and it->start < end; ++it)
+    {
+        const uint64_t rows = it->rows;
+        if (it->rows < 0 or it->bytes != rows * (sizeof(int32_t) + h.width * sizeof(float)) or
+                it->offset > (uint64_t)len or it->bytes > (uint64_t)len - it->offset)
+            throw std::runtime_error(path + ": corrupt chunk index");
+        buf.resize(it->bytes);
+        if (not pread_all(fd, buf.data(), buf.size(), it->offset))
+            throw std::runtime_error("could not read " + path);
+        const int32_t* spans = reinterpret_cast<const int32_t*>(buf.data());
+        const float* values = reinterpret_cast<const float*>(buf.data() + rows * sizeof(int32_t));
+        long pos = it->start;
+        for (uint64_t i = 0; i < rows; pos += spans[i++])
+            if (pos < end and pos + spans[i] > start)
+            {
+                ret.starts.push_back(pos);
+                ret.spans.push_back(spans[i]);
+                ret.values.insert(ret.values.end(), values + i * h.width, values + (i + 1) * h.width);
+            }
+    }
+    return ret;
+}
@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include "common.h"
+#include "preprocess.h"
+
+namespace
+{
+    // Merges consecutive rows which differ only in their span, passing
+    // each merged row on once it is complete (cf.
+    // estimation_tools.compress_repeated_obs).
+    template <typename Sink>
+    class row_compressor
+    {
+        public:
+        row_compressor(const int cols, Sink sink) : last(cols), have(false), sink(sink) {}
+        void operator()(const int* row)
+        {
+            if (have and std::equal(row + 1, row + last.size(), last.begin() + 1))
+                last[0] += row[0];
+            else
+            {
+                flush();
+                std::copy(row, row + last.size(), last.begin());
+                have = true;
+            }
+        }
+        void flush()
+        {
+            if (have)
+                sink(last.data());
+            have = false;
+        }
+
+        private:
+        std::vector<int> last;
+        bool have;
+        Sink sink;
+    };
+
+    template <typename Sink>
+    row_compressor<Sink> make_compressor(const int cols, Sink sink)
+    {
+        return row_compressor<Sink>(cols, sink);
+    }
+
+    normalize_result normalize(const contig_data &c, const normalize_options &opts)
+    {
+        const int npop = (c.cols - 1) / 3;
+        normalize_result ret;
+        std::vector<int> miss(c.cols, 0);
+        miss[0] = 1;
+        for (int p = 0; p < npop; ++p)
+            miss[1 + 3 * p] = -1;
+        // BreakLongSpans and DropSmallContigs. Each piece starts with a
+        // missing observation.
+        std::vector<int> piece(miss);
+        long length = 1;
+        auto end_piece = [&] ()
+        {
+            if (length > opts.min_length)
+                ret.pieces.push_back(std::move(piece));
+            piece = miss;
+            length = 1;
+        };
+        auto split = [&] (const int* row)
+        {
+            bool missing = row[0] >= opts.span_cutoff;
+            for (int p = 0; p < npop; ++p)
+                missing = missing and row[1 + 3 * p] == -1 and row[3 + 3 * p] == 0;
+            if (missing)
+            {
+                ret.long_missing.push_back(row[0]);
+                end_piece();
+            }
+            else
+            {
+                piece.insert(piece.end(), row, row + c.cols);
+                length += row[0];
+            }
+        };
+        auto compress = make_compressor(c.cols, split);
+        // RecodeNonseg
+        std::vector<int> row(c.cols);
+        for (int i = 0; i < c.rows; ++i)
+        {
+            std::copy(c.data + (size_t)i * c.cols, c.data + (size_t)(i + 1) * c.cols, row.begin());
+            bool run = row[0] > opts.nonseg_cutoff;
+            for (int p = 0; p < npop; ++p)
+                run = run and row[1 + 3 * p] == 0 and row[2 + 3 * p] == 0;
+            if (run)
+            {
+                ret.long_runs.push_back(row[0]);
+                if (opts.recode_nonseg)
+                    for (int p = 0; p < npop; ++p)
+                    {
+                        row[1 + 3 * p] = -1;
+                        row[3 + 3 * p] = 0;
+                    }
+            }
+            compress(row.data());
+        }
+        compress.flush();
+        end_piece();
+        return ret;
+    }
+
+    prepare_result prepare(const contig_data &c, const int thinning, const int w)
+    {
+        const int npop = (c.cols - 1) / 3;
+        prepare_result ret;
+        ret.recoded = 0;
+        ret.informative = false;
+
+        // Validate and DropUninformativeContigs
+        std::vector<int> ob(c.cols);
+        auto validate = [&] (const int* r)
+        {
+            std::copy(r, r + c.cols, ob.begin());
+            bool all_a = true, all_missing = true, all_b = true, any_nb = false;
+            for (int p = 0; p < npop; ++p)
+            {
+                all_a = all_a and ob[1 + 3 * p] == c.a[p];
+                all_missing = all_missing and ob[1 + 3 * p] == -1;
+                all_b = all_b and ob[2 + 3 * p] == ob[3 + 3 * p];
+                any_nb = any_nb or ob[3 + 3 * p] > 0;
+            }
+            if ((all_a or all_missing) and all_b and any_nb)
+            {
+                ret.recoded++;
+                for (int p = 0; p < npop; ++p)
+                    ob[2 + 3 * p] = 0;
+            }
+            bool bad = ob[0] <= 0;
+            int sa = 0, sb = 0;
+            for (int p = 0; p < npop; ++p)
+            {
+                bad = bad or ob[1 + 3 * p] > c.a[p] or ob[2 + 3 * p] > ob[3 + 3 * p] or
+                    ob[3 + 3 * p] > c.n[p];
+                sa += ob[1 + 3 * p];
+                sb += ob[2 + 3 * p];
+            }
+            if (bad)
+                ret.invalid.push_back(ret.data.size() / c.cols);
+            ret.informative = ret.informative or sa > 0 or sb > 0;
+            ret.data.insert(ret.data.end(), ob.begin(), ob.end());
+        };
+        auto compress = make_compressor(c.cols, validate);
+
+        // RecodeMonomorphic
+        std::vector<int> binned(c.cols);
+        auto recode = [&] (const int* best)
+        {
+            binned[0] = 1;
+            std::copy(best + 1, best + c.cols, binned.begin() + 1);
+            bool mono = true;
+            for (int p = 0; p < npop; ++p)
+                mono = mono and binned[1 + 3 * p] == c.a[p] and binned[2 + 3 * p] == binned[3 + 3 * p];
+            if (mono)
+                for (int p = 0; p < npop; ++p)
+                    binned[1 + 3 * p] = binned[2 + 3 * p] = 0;
+            compress(binned.data());
+        };
+
+        // BinObservations: each bin of w bases is represented by the
+        // observation with the largest sample size, preferring a
+        // singleton among those of sample size 2. A bin with no
+        // observations of positive span gets the first observation, as
+        // _estimation_tools.bin_observations does.
+        std::vector<int> first, best(c.cols);
+        long seen = 0;
+        int max_ss = -2;
+        bool have_best = false;
+        auto consider = [&] (const int* row)
+        {
+            int ss = 0, seg = 0;
+            for (int p = 0; p < npop; ++p)
+            {
+                ss += row[3 + 3 * p] + c.a[p] * (row[1 + 3 * p] >= 0);
+                seg += std::max(0, row[1 + 3 * p]);
+            }
+            if (ss > max_ss)
+            {
+                std::copy(row, row + c.cols, best.begin());
+                max_ss = ss;
+                have_best = true;
+            }
+            if (max_ss == 2 and seg == 1)
+                std::copy(row, row + c.cols, best.begin());
+        };
+        auto end_bin = [&] ()
+        {
+            recode(have_best ? best.data() : first.data());
+            max_ss = -2;
+            have_best = false;
+            seen = 0;
+        };
+        auto bin = [&] (const int* row, long span)
+        {
+            if (first.empty())
+                first.assign(row, row + c.cols);
+            while (seen + span > w)
+            {
+                if (w - seen > 0)
+                    consider(row);
+                span -= w - seen;
+                end_bin();
+            }
+            if (span > 0)
+                consider(row);
+            seen += span;
+        };
+
+        // Thin: outside of every thinning-th base, only the distinguished
+        // genotypes are kept (cf. _estimation_tools.thin_data).
+        std::vector<int> thin(c.cols), nonseg(c.cols, 0), full(c.cols);
+        nonseg[0] = full[0] = 1;
+        long pos = 0;
+        for (int i = 0; i < c.rows; ++i)
+        {
+            const int* row = c.data + (size_t)i * c.cols;
+            long span = row[0];
+            if (thinning <= 1)
+            {
+                bin(row, span);
+                continue;
+            }
+            int sa = 0;
+            for (int p = 0; p < npop; ++p)
+            {
+                sa += row[1 + 3 * p];
+                thin[1 + 3 * p] = row[1 + 3 * p];
+            }
+            if (sa == 2)
+                for (int p = 0; p < npop; ++p)
+                    thin[1 + 3 * p] = 0;
+            std::copy(row + 1, row + c.cols, full.begin() + 1);
+            while (span > 0)
+            {
+                if (pos + span >= thinning)
+                {
+                    if (thinning - pos > 1)
+                    {
+                        thin[0] = thinning - pos - 1;
+                        bin(thin.data(), thin[0]);
+                    }
+                    if (sa == 2)
+                        bin(nonseg.data(), 1);
+                    else
+                        bin(full.data(), 1);
+                    span -= thinning - pos;
+                    pos = 0;
+                }
+                else
+                {
+                    thin[0] = span;
+                    bin(thin.data(), span);
+                    pos += span;
+                    break;
+                }
+            }
+        }
+        if (not first.empty())
+            end_bin();
+        compress.flush();
+        return ret;
+    }
+
+    template <typename T, typename F>
+    std::vector<T> map_contigs(const std::vector<contig_data> &contigs, F f)
+    {
+        for (const contig_data &c : contigs)
+            if (c.cols < 4 or (c.cols - 1) % 3 != 0 or (int)c.a.size() != (c.cols - 1) / 3 or
+                    c.n.size() != c.a.size())
+                throw std::runtime_error("invalid contig dimensions");
+        std::vector<T> ret(contigs.size());
+        std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic)
+        for (unsigned int i = 0; i < contigs.size(); ++i)
+        {
+            try
+            {
+                ret[i] = f(i);
+            }
+            catch (...)
+            {
+#pragma omp critical(preprocess_error)
+                if (not error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+        return ret;
+    }
+}
+
+std::vector<normalize_result> normalize_contigs(const std::vector<contig_data> &contigs,
+        const normalize_options &opts)
+{
+    DEBUG1 << "normalizing " << contigs.size() << " contigs";
+    return map_contigs<normalize_result>(contigs,
+            [&] (const int i) { return normalize(contigs[i], opts); });
+}
+
+std::vector<prepare_result> prepare_contigs(const std::vector<contig_data> &contigs,
+        const std::vector<int> &thinning, const int w)
+{
+    if (thinning.size() != contigs.size() or w <= 0)
+        throw std::runtime_error("invalid preprocessing options");
+    DEBUG1 << "preparing " << contigs.size() << " contigs";
+    return map_contigs<prepare_result>(contigs,
+            [&] (const int i) { return prepare(contigs[i], thinning[i], w); });
+}
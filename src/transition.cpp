@@ -4,6 +4,7 @@
 #include "mpreal.h"
 
 #include "transition.h"
+#include "timer.h"
 #include "piecewise_constant_rate_function.h"
 
 namespace hj_matrix_exp {
@@ -130,14 +131,125 @@ Matrix<T> matrix_exp(T c_rho, T c_eta)
 }
 
 
+// phi(u) = 1 - (1 - exp(-u)) / u, using its Taylor series for small u
+// where the closed form cancels.
 template <typename T>
-void HJTransition<T>::compute_expms()
+T phi(const T &u)
+{
+    if (toDouble(u) < 0.1)
+    {
+        // Horner evaluation of sum_{k=1}^9 (-1)^(k+1) u^k / (k+1)!
+        T ret = 0. * u;
+        double fac = 3628800.; // 10!
+        for (int k = 9; k > 0; --k)
+        {
+            ret = u * ((k % 2 ? 1. : -1.) / fac + ret);
+            fac /= k + 1;
+        }
+        return ret;
+    }
+    return 1. + expm1(-u) / u;
+}
+
+// Same as matrix_exp(), but every entry is computed as a sum of
+// nonnegative terms, so that it has small relative error in double
+// precision. In particular the absorption probabilities in the last
+// column are not computed as 1 - (row sum), which cancels when they
+// are small. The eigenvalues of the transient block are -mu1, -mu2,
+// with mu1 * mu2 = c_eta * c_rho and mu2 - mu1 = 2x.
+template <typename T>
+Matrix<T> matrix_exp_stable(const T &c_rho, const T &c_eta)
+{
+    Matrix<T> Q(3, 3);
+    Q.fill(0. * c_eta);
+    Q(2, 2) += 1.;
+    const T x = sqrt(c_eta * c_eta + c_rho * c_rho / 4.);
+    if (toDouble(x) == 0.)
+    {
+        Q(0, 0) += 1.;
+        Q(1, 1) += 1.;
+        return Q;
+    }
+    const T mu2 = c_eta + c_rho / 2. + x;
+    const T mu1 = c_eta * c_rho / mu2;
+    const T em1 = exp(-mu1), em2 = exp(-mu2);
+    const T D = -em1 * expm1(-2. * x) / (2. * x);
+    // alpha = x + d, beta = x - d, where |d| <= x.
+    const T d = c_eta - c_rho / 2.;
+    T alpha, beta;
+    if (toDouble(d) >= 0.)
+    {
+        alpha = x + d;
+        beta = c_eta * c_rho / alpha;
+    }
+    else
+    {
+        beta = x - d;
+        alpha = c_eta * c_rho / beta;
+    }
+    Q(0, 0) = (alpha * em1 + beta * em2) / (2. * x);
+    Q(0, 1) = c_rho * D;
+    Q(0, 2) = mu1 * mu2 * (phi(mu2) - phi(mu1)) / (2. * x);
+    Q(1, 0) = c_eta * D;
+    Q(1, 1) = (beta * em1 + alpha * em2) / (2. * x);
+    Q(1, 2) = Q(0, 2) + c_eta * D;
+    return Q;
+}
+
+template <typename T>
+bool all_finite(const T &x);
+
+template <>
+bool all_finite(const double &x) { return std::isfinite(x); }
+
+template <>
+bool all_finite(const adouble &x) { return std::isfinite(x.value()) and x.derivatives().allFinite(); }
+
+template <typename T>
+bool HJTransition<T>::compute_expms_double(const int reuse)
+{
+    const std::vector<double> ts = this->eta.getTs();
+    const std::vector<T> ada = this->eta.getAda();
+    for (int i = reuse + 1; i < (int)ts.size(); ++i)
+    {
+        const Matrix<T> &P = expm_prods.at(i - 1);
+        if (std::isinf(ts[i]))
+        {
+            // Everything is eventually absorbed.
+            expms.at(i) = Matrix<T>::Identity(3, 3);
+            absorb.at(i) = P(0, 0) + P(0, 1);
+        }
+        else
+        {
+            double delta = ts[i] - ts[i - 1];
+            T c_eta = ada[i - 1] * delta;
+            T c_rho = 0. * c_eta;
+            c_rho += delta * this->rho;
+            expms.at(i) = matrix_exp_stable(c_rho, c_eta);
+            absorb.at(i) = P(0, 0) * expms.at(i)(0, 2) + P(0, 1) * expms.at(i)(1, 2);
+        }
+        expm_prods.at(i) = P * expms.at(i);
+        // Conditioning check: the products are stochastic matrices, and
+        // a failure here indicates overflow or underflow somewhere above.
+        const double rs = toDouble(expm_prods.at(i).row(0).sum());
+        if (not all_finite(absorb.at(i)) or std::abs(rs - 1.) > 1e-8 or 
+                toDouble(expm_prods.at(i).minCoeff()) < 0.)
+            return false;
+        for (int j = 0; j < 3; ++j)
+            for (int k = 0; k < 3; ++k)
+                if (not all_finite(expm_prods.at(i)(j, k)))
+                    return false;
+    }
+    return true;
+}
+
+template <typename T>
+void HJTransition<T>::compute_expms_mpfr()
 {
     typedef typename mpfr_promote<T>::type U;
     mpfr::mpreal::set_default_prec(256);
     const std::vector<double> ts = this->eta.getTs();
     const std::vector<int> hs_indices = this->eta.getHsIndices();
-    const std::vector<T> Rrng = this->eta.getRrng();
     const std::vector<T> ada = this->eta.getAda();
     std::vector<Matrix<U> > expm_U(ts.size(), Matrix<U>::Identity(3, 3));
     std::vector<Matrix<U> > expm_prods_U(ts.size(), Matrix<U>::Identity(3, 3));
@@ -163,13 +275,57 @@ void HJTransition<T>::compute_expms()
     }
     for (int i = 0; i < (int)ts.size(); ++i)
     {
-        expms.push_back(mpfr_promote<T>::back_cast(expm_U.at(i)));
-        expm_prods.push_back(mpfr_promote<T>::back_cast(expm_prods_U.at(i)));
+        expms.at(i) = mpfr_promote<T>::back_cast(expm_U.at(i));
+        expm_prods.at(i) = mpfr_promote<T>::back_cast(expm_prods_U.at(i));
+        if (i > 0)
+        {
+            Matrix<U> a = expm_prods_U.at(i).block(0, 2, 1, 1) - expm_prods_U.at(i - 1).block(0, 2, 1, 1);
+            absorb.at(i) = mpfr_promote<T>::back_cast(a)(0, 0);
+        }
     }
 }
 
+template <typename T>
+void HJTransition<T>::compute_expms(const HJTransition<T> *previous, const bool force_mpfr)
+{
+    const std::vector<double> ts = this->eta.getTs();
+    const std::vector<int> hs_indices = this->eta.getHsIndices();
+    const T zero = this->eta.zero();
+    // The exponential for piece i - 1 is stored at index i, and the
+    // products are cumulative, so everything up to and including the
+    // first changed piece can be taken from previous.
+    int reuse = 0;
+    if (previous != nullptr and previous->rho == this->rho)
+        reuse = this->eta.first_changed_piece(previous->eta);
+    if (reuse > hs_indices[0] and not force_mpfr)
+    {
+        DEBUG1 << "reusing matrix exponentials for " << reuse << " pieces";
+        expms = previous->expms;
+        expm_prods = previous->expm_prods;
+        absorb = previous->absorb;
+    }
+    else
+    {
+        reuse = hs_indices[0];
+        expms.assign(ts.size(), Matrix<T>::Identity(3, 3));
+        expm_prods.assign(ts.size(), Matrix<T>::Identity(3, 3));
+        absorb.assign(ts.size(), zero);
+    }
+    if (not force_mpfr and compute_expms_double(reuse))
+        return;
+    if (not force_mpfr)
+        WARNING << "matrix exponentials are ill-conditioned; falling back to mpfr";
+    absorb.assign(ts.size(), zero);
+    compute_expms_mpfr();
+}
+
 template <typename T>
 HJTransition<T>::HJTransition(const PiecewiseConstantRateFunction<T> &eta, const double rho) : 
+    HJTransition(eta, rho, nullptr, false) {}
+
+template <typename T>
+HJTransition<T>::HJTransition(const PiecewiseConstantRateFunction<T> &eta, const double rho,
+        const HJTransition<T> *previous, const bool force_mpfr) : 
     Transition<T>(eta, rho) 
 {
     const std::vector<double> ts = eta.getTs();
@@ -179,7 +335,7 @@ HJTransition<T>::HJTransition(const PiecewiseConstantRateFunction<T> &eta, const
     const std::vector<T> avg_coal_times = eta.average_coal_times();
     const std::vector<double> hidden_states = eta.getHiddenStates();
 
-    compute_expms();
+    compute_expms(previous, force_mpfr);
     std::vector<int> avc_ip;
     for (T x : avg_coal_times)
     {
@@ -187,9 +343,14 @@ HJTransition<T>::HJTransition(const PiecewiseConstantRateFunction<T> &eta, const
         avc_ip.push_back(ip);
     }
     Vector<T> expm_diff(this->M - 2);
+    // Probability of absorption in hidden state k - 1, accumulated from
+    // its pieces instead of as a difference of cumulative probabilities.
     for (int k = 1; k < this->M - 1; ++k)
-        expm_diff(k - 1) = expm_prods.at(hs_indices.at(k))(0, 2) - 
-                expm_prods.at(hs_indices.at(k - 1))(0, 2);
+    {
+        expm_diff(k - 1) = eta.zero();
+        for (int i = hs_indices.at(k - 1) + 1; i <= hs_indices.at(k); ++i)
+            expm_diff(k - 1) += absorb.at(i);
+    }
     this->Phi.fill(eta.zero());
 #pragma omp parallel for
     for (int j = 1; j < this->M; ++j)
@@ -261,5 +422,45 @@ Matrix<T> compute_transition(const PiecewiseConstantRateFunction<T> &eta, const
     return ret;
 }
 
+template <typename T>
+Matrix<T> compute_transition(const PiecewiseConstantRateFunction<T> &eta, const double rho,
+        std::unique_ptr<HJTransition<T> > &previous)
+{
+    DEBUG1 << "computing transition";
+    std::unique_ptr<HJTransition<T> > tr(new HJTransition<T>(eta, rho, previous.get(), false));
+    previous = std::move(tr);
+    DEBUG1 << "done computing transition";
+    return previous->matrix();
+}
+
 template Matrix<double> compute_transition(const PiecewiseConstantRateFunction<double> &eta, const double rho);
 template Matrix<adouble> compute_transition(const PiecewiseConstantRateFunction<adouble> &eta, const double rho);
+template Matrix<double> compute_transition(const PiecewiseConstantRateFunction<double> &eta, const double rho,
+        std::unique_ptr<HJTransition<double> > &);
+template Matrix<adouble> compute_transition(const PiecewiseConstantRateFunction<adouble> &eta, const double rho,
+        std::unique_ptr<HJTransition<adouble> > &);
+
+std::vector<double> benchmark_transition(const ParameterVector &params, 
+        const std::vector<double> &hidden_states, const double rho, const int reps)
+{
+    const PiecewiseConstantRateFunction<adouble> eta(params, hidden_states);
+    Matrix<adouble> fast, ref;
+    Timer timer;
+    for (int i = 0; i < reps; ++i)
+        fast = HJTransition<adouble>(eta, rho, nullptr, false).matrix();
+    const double t_fast = timer.elapsed() / reps;
+    timer.reset();
+    for (int i = 0; i < reps; ++i)
+        ref = HJTransition<adouble>(eta, rho, nullptr, true).matrix();
+    const double t_ref = timer.elapsed() / reps;
+    double dev = 0., ddev = 0.;
+    for (int i = 0; i < fast.rows(); ++i)
+        for (int j = 0; j < fast.cols(); ++j)
+        {
+            dev = std::max(dev, std::abs(fast(i, j).value() - ref(i, j).value()));
+            if (fast(i, j).derivatives().size() == ref(i, j).derivatives().size() and 
+                    fast(i, j).derivatives().size() > 0)
+                ddev = std::max(ddev, (fast(i, j).derivatives() - ref(i, j).derivatives()).cwiseAbs().maxCoeff());
+        }
+    return {t_fast, t_ref, dev, ddev};
+}
@@ -1,3 +1,6 @@
+#include <memory>
+#include <set>
+
 #include "transition_bundle.h"
 
 void TransitionBundle::update(const Matrix<adouble> &new_T, const bool recompute_eigs)
@@ -5,57 +8,59 @@ void TransitionBundle::update(const Matrix<adouble> &new_T, const bool recompute
     T = new_T;
     Td = T.template cast<double>();
     if (! recompute_eigs) return;
-    eigensystems.clear();
     const int M = T.rows();
     span_Qs.clear();
-    Matrix<double> tmp;
-
     eigensystems.clear();
-    for (auto it = targets.begin(); it != targets.end(); ++it)
+
+    // Each distinct key needs one eigendecomposition, and each target
+    // one matrix Q computed from it. Both are independent across keys
+    // and targets, so they are computed in parallel and then stored.
+    std::vector<block_key> keys;
     {
-        block_key key = it->second;
-        if (this->eigensystems.count(key) == 0)
-        {
-            Vector<double> ep = this->emission_probs->at(key).template cast<double>();
-            tmp = ep.template cast<double>().asDiagonal() * this->Td.transpose();
-            DEBUG1 << key << "\n" << ep.transpose();
-            Eigen::EigenSolver<Matrix<double> > es(tmp);
-            this->eigensystems.emplace(key, es);
-        }
+        std::set<block_key> seen;
+        for (const std::pair<int, block_key> &t : targets)
+            if (seen.insert(t.second).second)
+                keys.push_back(t.second);
+    }
+    std::vector<std::unique_ptr<eigensystem> > eigs(keys.size());
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < keys.size(); ++i)
+    {
+        Vector<double> ep = this->emission_probs->at(keys[i]).template cast<double>();
+        Matrix<double> tmp = ep.asDiagonal() * this->Td.transpose();
+        Eigen::EigenSolver<Matrix<double> > es(tmp);
+        eigs[i].reset(new eigensystem(es));
     }
+    for (unsigned int i = 0; i < keys.size(); ++i)
+        this->eigensystems.emplace(keys[i], *eigs[i]);
 
-//#pragma omp parallel
-//#pragma omp single
-    for (auto it = targets.begin(); it != targets.end(); ++it)
+    const std::vector<std::pair<int, block_key> > tv(targets.begin(), targets.end());
+    std::vector<Matrix<double> > Qs(tv.size());
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < tv.size(); ++i)
     {
-// #pragma omp task firstprivate(it)
+        const int span = tv[i].first;
+        const eigensystem &eig = this->eigensystems.at(tv[i].second);
+        Matrix<double> &Q = Qs[i];
+        Q.resize(M, M);
+        for (int a = 0; a < M; ++a)
         {
-            const int span = it->first;
-            const block_key key = it->second;
-            const eigensystem eig = this->eigensystems.at(key);
-            Matrix<double> Q(M, M);
-            for (int a = 0; a < M; ++a)
-            {
-                double d1 = eig.d_r_scaled(a);
-                Q(a, a) = std::pow(d1, span - 1) * (double)span;
-                for (int b = a + 1; b < M; ++b)
-                {
-                    d1 = eig.d_r_scaled(a);
-                    double d2 = eig.d_r_scaled(b);
-                    if (std::abs(d1) < std::abs(d2))
-                        std::swap(d1, d2);
-                    Q(a, b) = std::exp(
-                            (double)span * std::log(d1) + std::log1p(-std::pow(d2 / d1, span))
-                            );
-                    Q(a, b) /= d1 - d2;
-                    Q(b, a) = Q(a, b);
-                }
-            }
-//#pragma omp critical(emplace_Q)
+            double d1 = eig.d_r_scaled(a);
+            Q(a, a) = std::pow(d1, span - 1) * (double)span;
+            for (int b = a + 1; b < M; ++b)
             {
-                this->span_Qs.emplace(*it, Q);
+                d1 = eig.d_r_scaled(a);
+                double d2 = eig.d_r_scaled(b);
+                if (std::abs(d1) < std::abs(d2))
+                    std::swap(d1, d2);
+                Q(a, b) = std::exp(
+                        (double)span * std::log(d1) + std::log1p(-std::pow(d2 / d1, span))
+                        );
+                Q(a, b) /= d1 - d2;
+                Q(b, a) = Q(a, b);
             }
         }
     }
-//#pragma omp taskwait
+    for (unsigned int i = 0; i < tv.size(); ++i)
+        this->span_Qs.emplace(tv[i], std::move(Qs[i]));
 }
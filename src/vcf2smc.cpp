@@ -0,0 +1,549 @@
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "common.h"
+#include "vcf2smc.h"
+
+#ifdef HAVE_HTSLIB
+
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+#include <htslib/tbx.h>
+#include <htslib/vcf.h>
+
+namespace
+{
+    // Records of one region of the contig, in file order: the (one-based)
+    // position of each SNP and, for each conversion, its (a, b, nb) for
+    // each population.
+    struct snp_table
+    {
+        std::vector<long> pos;
+        std::vector<std::vector<int> > abnb;
+        // Genotypes which could not be converted, by conversion and SNP.
+        // These are only errors if the SNP is not masked.
+        std::vector<std::map<size_t, std::string> > errors;
+    };
+
+    // Iterates over the records of a VCF or BCF file which overlap a
+    // region, reading only the given samples.
+    class region_reader
+    {
+        public:
+        region_reader(const std::string &path, const std::string &contig,
+                const std::string &samples, const hts_pos_t beg, const hts_pos_t end) :
+            fp(hts_open(path.c_str(), "r")), hdr(nullptr), idx(nullptr), tbx(nullptr),
+            itr(nullptr), rec(bcf_init()), str{0, 0, nullptr}
+        {
+            if (not fp)
+                throw std::runtime_error("could not open " + path);
+            hdr = bcf_hdr_read(fp);
+            if (not hdr)
+                throw std::runtime_error("could not read the header of " + path);
+            if (bcf_hdr_set_samples(hdr, samples.c_str(), 0) != 0)
+                throw std::runtime_error("samples not found in " + path);
+            int tid;
+            if (hts_get_format(fp)->format == bcf)
+            {
+                idx = bcf_index_load(path.c_str());
+                tid = idx ? bcf_hdr_name2id(hdr, contig.c_str()) : -1;
+                if (tid >= 0)
+                    itr = bcf_itr_queryi(idx, tid, beg, end);
+            }
+            else
+            {
+                tbx = tbx_index_load(path.c_str());
+                tid = tbx ? tbx_name2id(tbx, contig.c_str()) : -1;
+                if (tid >= 0)
+                    itr = tbx_itr_queryi(tbx, tid, beg, end);
+            }
+            if (not idx and not tbx)
+                throw std::runtime_error("could not load the index of " + path +
+                        ". Make sure the VCF is indexed: tabix " + path);
+            if (not itr)
+                throw std::runtime_error("contig " + contig + " not found in " + path);
+        }
+
+        ~region_reader()
+        {
+            free(str.s);
+            bcf_destroy(rec);
+            if (itr) hts_itr_destroy(itr);
+            if (tbx) tbx_destroy(tbx);
+            if (idx) hts_idx_destroy(idx);
+            if (hdr) bcf_hdr_destroy(hdr);
+            if (fp) hts_close(fp);
+        }
+
+        // Read the next record into rec. Returns false at the end of the
+        // region.
+        bool next()
+        {
+            int r;
+            if (tbx)
+            {
+                r = tbx_itr_next(fp, tbx, itr, &str);
+                if (r >= 0 and vcf_parse(&str, hdr, rec) < 0)
+                    throw std::runtime_error("could not parse VCF record");
+            }
+            else
+            {
+                r = bcf_itr_next(fp, itr, rec);
+                // Iterators bypass the sample subsetting done by bcf_read.
+                if (r >= 0 and hdr->keep_samples)
+                    bcf_subset_format(hdr, rec);
+            }
+            if (r < -1)
+                throw std::runtime_error("error reading VCF record");
+            return r >= 0;
+        }
+
+        htsFile *fp;
+        bcf_hdr_t *hdr;
+        hts_idx_t *idx;
+        tbx_t *tbx;
+        hts_itr_t *itr;
+        bcf1_t *rec;
+        kstring_t str;
+
+        private:
+        region_reader(const region_reader&) = delete;
+        region_reader& operator=(const region_reader&) = delete;
+    };
+
+    struct lineage { int sample, hap; };
+
+    // The lineages used by any conversion, which are decoded once per
+    // record. Conversions refer to them by position in all.
+    struct lineage_index
+    {
+        std::vector<lineage> all;
+        // dist[j][p] and undist[j][p] are the lineages of population p in
+        // conversion j.
+        std::vector<std::vector<std::vector<int> > > dist, undist;
+        // shared[p] is the union of undist[j][p] over all j, and
+        // excluded[j][p] is shared[p] less undist[j][p]. Typically only the
+        // distinguished individual is excluded, so the counts over shared[p]
+        // are computed once and corrected for each conversion.
+        std::vector<std::vector<int> > shared;
+        std::vector<std::vector<std::vector<int> > > excluded;
+    };
+
+    std::string sample_list(const vcf2smc_options &opts)
+    {
+        std::set<std::string> seen;
+        std::string ret;
+        for (auto *l : {&opts.dist, &opts.undist})
+            for (auto &conv : *l)
+                for (auto &pop : conv)
+                    for (auto &p : pop)
+                        if (seen.insert(p.first).second)
+                            ret += (ret.empty() ? "" : ",") + p.first;
+        return ret;
+    }
+
+    lineage_index index_lineages(const bcf_hdr_t *hdr, const vcf2smc_options &opts)
+    {
+        lineage_index ret;
+        std::map<std::pair<std::string, int>, int> ids;
+        auto resolve = [&] (const lineage_list &pops)
+        {
+            std::vector<std::vector<int> > r;
+            for (auto &pop : pops)
+            {
+                r.emplace_back();
+                for (auto &p : pop)
+                {
+                    auto it = ids.find(p);
+                    if (it == ids.end())
+                    {
+                        it = ids.emplace(p, ret.all.size()).first;
+                        ret.all.push_back({bcf_hdr_id2int(hdr, BCF_DT_SAMPLE, p.first.c_str()), p.second});
+                    }
+                    r.back().push_back(it->second);
+                }
+            }
+            return r;
+        };
+        for (unsigned int j = 0; j < opts.dist.size(); ++j)
+        {
+            ret.dist.push_back(resolve(opts.dist[j]));
+            ret.undist.push_back(resolve(opts.undist[j]));
+        }
+        const int npop = opts.dist.front().size();
+        ret.shared.resize(npop);
+        for (int p = 0; p < npop; ++p)
+        {
+            std::set<int> u;
+            for (auto &conv : ret.undist)
+                u.insert(conv[p].begin(), conv[p].end());
+            ret.shared[p].assign(u.begin(), u.end());
+        }
+        ret.excluded.resize(ret.undist.size(), std::vector<std::vector<int> >(npop));
+        for (unsigned int j = 0; j < ret.undist.size(); ++j)
+            for (int p = 0; p < npop; ++p)
+            {
+                const std::set<int> u(ret.undist[j][p].begin(), ret.undist[j][p].end());
+                for (int i : ret.shared[p])
+                    if (u.count(i) == 0)
+                        ret.excluded[j][p].push_back(i);
+            }
+        return ret;
+    }
+
+    // Decode the SNPs of [beg, end), computing (a, b, nb) for each
+    // conversion and population as the Python implementation does.
+    snp_table read_region(const vcf2smc_options &opts, const std::string &samples,
+            const hts_pos_t beg, const hts_pos_t end)
+    {
+        region_reader r(opts.vcf, opts.contig, samples, beg, end);
+        const lineage_index li = index_lineages(r.hdr, opts);
+        const int nconv = li.dist.size();
+        const int npop = li.shared.size();
+        snp_table ret;
+        ret.abnb.resize(nconv);
+        ret.errors.resize(nconv);
+        int32_t *gt = nullptr;
+        int mgt = 0;
+        // Allele of each lineage: -2 if the sample has fewer alleles than
+        // the haplotype requires, -1 if it is missing, and otherwise 1 if it
+        // differs from the reference. Also the ploidy of each lineage's
+        // sample.
+        std::vector<int> x(li.all.size()), ploidy_of(li.all.size());
+        std::vector<int> b(npop), nb(npop), bad(npop);
+        try
+        {
+            while (r.next())
+            {
+                bcf1_t *rec = r.rec;
+                // Records overlapping the start of the region belong to the
+                // previous one.
+                if (rec->pos < beg or rec->pos >= end)
+                    continue;
+                bcf_unpack(rec, BCF_UN_STR);
+                bool snp = rec->n_allele <= 2;
+                for (int i = 0; snp and i < rec->n_allele; ++i)
+                    snp = std::strlen(rec->d.allele[i]) == 1;
+                if (not snp)
+                    continue;
+                const long pos = rec->pos + 1;
+                const char* ref = rec->d.allele[0];
+                const int ngt = bcf_get_genotypes(r.hdr, rec, &gt, &mgt);
+                const int ploidy = (ngt > 0 and rec->n_sample > 0) ? ngt / rec->n_sample : 0;
+                for (unsigned int i = 0; i < li.all.size(); ++i)
+                {
+                    const lineage &l = li.all[i];
+                    const int32_t *g = gt + l.sample * ploidy;
+                    int pl = 0;
+                    while (pl < ploidy and g[pl] != bcf_int32_vector_end)
+                        pl++;
+                    ploidy_of[i] = pl;
+                    if (l.hap >= pl)
+                        x[i] = -2;
+                    else if (bcf_gt_is_missing(g[l.hap]))
+                        x[i] = -1;
+                    else if (bcf_gt_allele(g[l.hap]) >= rec->n_allele)
+                        throw std::runtime_error("invalid genotype at position " + std::to_string(pos));
+                    else
+                        x[i] = (int)(std::strcmp(rec->d.allele[bcf_gt_allele(g[l.hap])], ref) != 0);
+                }
+                for (int p = 0; p < npop; ++p)
+                {
+                    b[p] = nb[p] = bad[p] = 0;
+                    for (int i : li.shared[p])
+                    {
+                        bad[p] += (x[i] == -2);
+                        nb[p] += (x[i] >= 0);
+                        b[p] += (x[i] == 1);
+                    }
+                }
+                auto diploid_error = [&] (const int i)
+                {
+                    std::ostringstream oss;
+                    oss << "Expected a diploid genotype at position " << pos << " for individual "
+                        << r.hdr->samples[li.all[i].sample];
+                    return oss.str();
+                };
+                for (int j = 0; j < nconv; ++j)
+                {
+                    std::string error;
+                    for (auto &pop : li.dist[j])
+                        for (int i : pop)
+                            if (error.empty() and ploidy_of[i] != 2)
+                                error = diploid_error(i);
+                    std::vector<int> &out = ret.abnb[j];
+                    const size_t start = out.size();
+                    bool folded = true;
+                    for (int p = 0; p < npop; ++p)
+                    {
+                        int a = 0;
+                        for (int i : li.dist[j][p])
+                        {
+                            if (x[i] < 0)
+                            {
+                                a = -1;
+                                break;
+                            }
+                            a += x[i];
+                        }
+                        int bj = b[p], nbj = nb[p], badj = bad[p];
+                        for (int i : li.excluded[j][p])
+                        {
+                            badj -= (x[i] == -2);
+                            nbj -= (x[i] >= 0);
+                            bj -= (x[i] == 1);
+                        }
+                        if (badj > 0 and error.empty())
+                            for (int i : li.undist[j][p])
+                                if (error.empty() and x[i] == -2)
+                                    error = diploid_error(i);
+                        out.push_back(a);
+                        out.push_back(bj);
+                        out.push_back(nbj);
+                        folded = folded and bj == nbj and a == (int)li.dist[j][p].size();
+                    }
+                    // Fold non-polymorphic (in subsample) sites
+                    if (folded)
+                        for (int p = 0; p < npop; ++p)
+                            out[start + 3 * p] = out[start + 3 * p + 1] = 0;
+                    if (not error.empty())
+                        ret.errors[j].emplace(ret.pos.size(), error);
+                }
+                ret.pos.push_back(pos);
+            }
+        }
+        catch (...)
+        {
+            free(gt);
+            throw;
+        }
+        free(gt);
+        return ret;
+    }
+
+    std::vector<std::pair<long, long> > read_mask(const vcf2smc_options &opts)
+    {
+        std::vector<std::pair<long, long> > ret;
+        if (opts.mask.empty())
+            return ret;
+        htsFile *fp = hts_open(opts.mask.c_str(), "r");
+        tbx_t *tbx = fp ? tbx_index_load(opts.mask.c_str()) : nullptr;
+        hts_itr_t *itr = tbx ? tbx_itr_querys(tbx, opts.contig.c_str()) : nullptr;
+        kstring_t str = {0, 0, nullptr};
+        bool ok = (itr != nullptr);
+        while (ok and tbx_itr_next(fp, tbx, itr, &str) >= 0)
+        {
+            std::istringstream iss(std::string(str.s, str.l));
+            std::string chrom;
+            long start, end;
+            ok = (bool)(iss >> chrom >> start >> end);
+            ret.emplace_back(start, end);
+        }
+        free(str.s);
+        if (itr) hts_itr_destroy(itr);
+        if (tbx) tbx_destroy(tbx);
+        if (fp) hts_close(fp);
+        if (not ok)
+            throw std::runtime_error("could not read mask " + opts.mask + " for contig " + opts.contig);
+        return ret;
+    }
+
+    // Merges consecutive observations which differ only in their span,
+    // dropping those with a span <= 0. Same as util.RepeatingWriter.
+    class repeating_writer
+    {
+        public:
+        repeating_writer(std::vector<int> &out) : out(out) {}
+        void write(const std::vector<long> &ob)
+        {
+            if (last.empty())
+                last = ob;
+            else if (std::equal(ob.begin() + 1, ob.end(), last.begin() + 1))
+                last[0] += ob[0];
+            else
+            {
+                flush();
+                last = ob;
+            }
+        }
+        void flush()
+        {
+            if (not last.empty() and last[0] > 0)
+                out.insert(out.end(), last.begin(), last.end());
+        }
+
+        private:
+        std::vector<int> &out;
+        std::vector<long> last;
+    };
+
+    // Interleave SNPs and masked intervals, and run-length encode the
+    // result of conversion j, exactly as the Python implementation does.
+    vcf2smc_result merge(const vcf2smc_options &opts, const std::vector<snp_table> &tables,
+            const std::vector<std::pair<long, long> > &masks, const int j)
+    {
+        const int npop = opts.dist[j].size();
+        const long cutoff = opts.missing_cutoff < 0 ? std::numeric_limits<long>::max() : opts.missing_cutoff;
+        std::vector<long> nonseg(1 + 3 * npop, 0), miss(1 + 3 * npop, 0);
+        for (int p = 0; p < npop; ++p)
+        {
+            nonseg[3 + 3 * p] = opts.undist[j][p].size();
+            miss[1 + 3 * p] = -1;
+        }
+        vcf2smc_result ret;
+        std::set<long> multiples;
+        repeating_writer rw(ret.rows);
+        bool first = true;
+        auto write = [&] (const std::vector<long> &x)
+        {
+            if (not first or not opts.drop_first_last)
+                rw.write(x);
+            first = false;
+        };
+        auto with_span = [] (std::vector<long> x, const long span) { x[0] = span; return x; };
+
+        // SNPs inside a masked interval are dropped.
+        long last_pos = 0;
+        unsigned int t = 0, k = 0, m = 0;
+        auto next_snp = [&] ()
+        {
+            if (k + 1 < tables[t].pos.size())
+                k++;
+            else
+            {
+                k = 0;
+                t++;
+                while (t < tables.size() and tables[t].pos.empty())
+                    t++;
+            }
+        };
+        while (t < tables.size() and tables[t].pos.empty())
+            t++;
+        std::vector<long> ob(1 + 3 * npop);
+        while (m < masks.size() or t < tables.size())
+        {
+            bool use_mask;
+            if (m == masks.size())
+                use_mask = false;
+            else if (t == tables.size())
+                use_mask = true;
+            else if (tables[t].pos[k] < masks[m].first)
+                use_mask = false;
+            else
+            {
+                if (tables[t].pos[k] < masks[m].second)
+                    while (t < tables.size() and tables[t].pos[k] < masks[m].second)
+                        next_snp();
+                use_mask = true;
+            }
+            if (use_mask)
+            {
+                write(with_span(nonseg, masks[m].first - last_pos));
+                write(with_span(miss, masks[m].second - masks[m].first + 1));
+                last_pos = masks[m].second;
+                m++;
+                continue;
+            }
+            const long pos = tables[t].pos[k];
+            if (tables[t].errors[j].count(k))
+                throw std::runtime_error(tables[t].errors[j].at(k));
+            ob[0] = 1;
+            const std::vector<int> &abnb = tables[t].abnb[j];
+            std::copy(abnb.begin() + 3 * npop * k, abnb.begin() + 3 * npop * (k + 1), ob.begin() + 1);
+            next_snp();
+            if (pos == last_pos)
+            {
+                multiples.insert(pos);
+                continue;
+            }
+            const long span = pos - last_pos - 1;
+            if (1 <= span and span <= cutoff)
+                write(with_span(nonseg, span));
+            else if (span > cutoff)
+                write(with_span(miss, span));
+            write(ob);
+            last_pos = pos;
+        }
+        if (not opts.drop_first_last)
+            write(with_span(nonseg, opts.contig_length - last_pos));
+        rw.flush();
+        ret.multiples = multiples.size();
+        return ret;
+    }
+}
+
+bool vcf2smc_available() { return true; }
+
+std::vector<vcf2smc_result> vcf2smc(const vcf2smc_options &opts)
+{
+    bool valid = not opts.dist.empty() and opts.undist.size() == opts.dist.size() and opts.contig_length > 0;
+    for (unsigned int j = 0; valid and j < opts.dist.size(); ++j)
+        valid = not opts.dist[j].empty() and opts.dist[j].size() == opts.dist[0].size() and
+            opts.undist[j].size() == opts.dist[j].size();
+    if (not valid)
+        throw std::runtime_error("invalid vcf2smc options");
+    const std::string samples = sample_list(opts);
+    const int R = std::max(1, opts.regions);
+
+    // Decoding the genotypes is by far the most expensive part, so
+    // regions are decoded in parallel, once for all conversions.
+    // Everything after that depends on the preceding records, and is done
+    // in one pass per conversion.
+    std::vector<snp_table> tables(R);
+    std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic) num_threads(R)
+    for (int i = 0; i < R; ++i)
+    {
+        const hts_pos_t beg = opts.contig_length * i / R;
+        const hts_pos_t end = (i == R - 1) ? HTS_POS_MAX : (hts_pos_t)(opts.contig_length * (i + 1) / R);
+        try
+        {
+            tables[i] = read_region(opts, samples, beg, end);
+            DEBUG1 << "region " << i << ": " << tables[i].pos.size() << " SNPs";
+        }
+        catch (...)
+        {
+#pragma omp critical(vcf2smc_error)
+            if (not error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+    const std::vector<std::pair<long, long> > masks = read_mask(opts);
+    std::vector<vcf2smc_result> ret(opts.dist.size());
+#pragma omp parallel for schedule(dynamic)
+    for (unsigned int j = 0; j < ret.size(); ++j)
+    {
+        try
+        {
+            ret[j] = merge(opts, tables, masks, j);
+        }
+        catch (...)
+        {
+#pragma omp critical(vcf2smc_error)
+            if (not error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+    return ret;
+}
+
+#else
+
+bool vcf2smc_available() { return false; }
+
+std::vector<vcf2smc_result> vcf2smc(const vcf2smc_options&)
+{
+    throw std::runtime_error("smcpp was built without htslib");
+}
+
+#endif
@@ -0,0 +1,239 @@
+import gc
+import json
+import os
+from dataclasses import dataclass
+import numpy as np
+import pytest
+
+import smcpp._smcpp
+from smcpp import estimation_tools, data_filter, shared_data
+from smcpp.contig import Contig
+
+header = json.dumps({"pids": ["pop1"], "dist": [["s1", "s1"]], "undist": [["s2", "s3"]]})
+
+
+def make_data(L=200000):
+    np.random.seed(1)
+    A = np.random.randint(0, 3, size=(L, 4)).astype(np.int32)
+    A[:, 0] = np.random.randint(1, 1000, size=L)
+    return A
+
+
+@pytest.mark.parametrize("compress", [True, False])
+def test_binary_roundtrip(tmpdir, compress):
+    A = make_data()
+    fn = str(tmpdir.join("data.smc.bin"))
+    smcpp._smcpp.write_binary_data(fn, header, A, compress)
+    assert smcpp._smcpp.is_binary_data(fn)
+    h, B = smcpp._smcpp.read_binary_data(fn)
+    assert h == header
+    assert B.dtype == np.int32
+    np.testing.assert_array_equal(A, B)
+
+
+def test_text_to_binary(tmpdir):
+    A = make_data(1000)
+    txt = str(tmpdir.join("data.smc.gz"))
+    np.savetxt(txt, A, fmt="%d", header="SMC++ " + header)
+    assert not smcpp._smcpp.is_binary_data(txt)
+    h, B = estimation_tools.read_text_data(txt)
+    fn = str(tmpdir.join("data.smc.bin"))
+    smcpp._smcpp.write_binary_data(fn, h, B)
+    c1 = estimation_tools._load_data_helper(txt)
+    c2 = estimation_tools._load_data_helper(fn)
+    assert c1.key == c2.key
+    np.testing.assert_array_equal(c1.data, c2.data)
+
+
+def test_load_data_order(tmpdir):
+    fns = []
+    for i, L in enumerate([300, 100, 200]):
+        A = make_data(L)
+        if i == 1:
+            fns.append(str(tmpdir.join("data%d.smc.gz" % i)))
+            np.savetxt(fns[-1], A, fmt="%d", header="SMC++ " + header)
+        else:
+            fns.append(str(tmpdir.join("data%d.smc.bin" % i)))
+            smcpp._smcpp.write_binary_data(fns[-1], header, A)
+    contigs = estimation_tools.load_data(fns)
+    assert [c.fn for c in contigs] == fns
+
+
+def make_contig(L=20000, n=4):
+    np.random.seed(2)
+    A = np.zeros([L, 4], dtype=np.int32)
+    A[:, 0] = np.random.choice([1, 10, 1000, 200000], size=L, p=[.6, .3, .09, .01])
+    A[:, 1] = np.random.choice([-1, 0, 1, 2], size=L, p=[.1, .7, .15, .05])
+    A[:, 3] = np.random.randint(0, n + 1, size=L)
+    A[:, 2] = (np.random.rand(L) * (A[:, 3] + 1)).astype(np.int32)
+    return Contig(pid=("pop1",), data=A, n=[n], a=[2], fn="test")
+
+
+@pytest.mark.parametrize("thinning", [None, 1, 7])
+def test_fused_filters(thinning):
+    c = make_contig()
+    fused = [data_filter.Normalize(nonseg_cutoff=50000, span_cutoff=100000, min_length=100000),
+             data_filter.PrepareObservations(thinning=thinning, w=100)]
+    unfused = [[data_filter.RecodeNonseg(cutoff=50000), data_filter.Compress(),
+                data_filter.BreakLongSpans(cutoff=100000), data_filter.DropSmallContigs(100000)],
+               [data_filter.Thin(thinning=thinning), data_filter.BinObservations(w=100),
+                data_filter.RecodeMonomorphic(), data_filter.Compress(), data_filter.Validate(),
+                data_filter.DropUninformativeContigs()]]
+    c1 = c2 = [c]
+    for f, fs in zip(fused, unfused):
+        c1 = f(c1)
+        c2 = [Contig(pid=x.pid, data=x.data.copy(), n=x.n, a=x.a, fn=x.fn) for x in c2]
+        for g in fs:
+            c2 = g(c2)
+        assert len(c1) == len(c2) > 1
+        for x, y in zip(c1, c2):
+            np.testing.assert_array_equal(x.data, y.data)
+
+
+def test_fused_validate(caplog):
+    c = make_contig()
+    c.data[100] = [10, 0, 3, 2]  # b > n, in a long span
+    c.data[200] = [1, 3, 0, 2]  # a > 2
+    c.data[300] = [1, 0, 0, 5]  # n > sample size
+
+    def invalid():
+        ret = [r.args[1] for r in caplog.records if "invalid observations" in r.msg]
+        caplog.clear()
+        return ret
+    with pytest.raises(RuntimeError):
+        data_filter.PrepareObservations(thinning=1, w=1)([c])
+    fused = invalid()
+    d = [Contig(pid=c.pid, data=c.data.copy(), n=c.n, a=c.a, fn=c.fn)]
+    for g in [data_filter.Thin(thinning=1), data_filter.BinObservations(w=1),
+              data_filter.RecodeMonomorphic(), data_filter.Compress()]:
+        d = g(d)
+    # Validate itself, in this process.
+    with pytest.raises(RuntimeError):
+        data_filter.Validate().run(d[0])
+    unfused = invalid()
+    assert len(fused) == len(unfused) == 1
+    assert len(fused[0]) == 3
+    np.testing.assert_array_equal(fused[0], unfused[0])
+
+
+@dataclass
+class Scale(data_filter.Filter):
+    "Multiplies the spans in place, counting its runs."
+    k: int
+    modifies_data = True
+    calls = 0
+
+    def run(self, contigs):
+        Scale.calls += 1
+        for c in contigs:
+            c.data[:, 0] *= self.k
+        return contigs
+
+
+def make_pipeline(fn, cache_dir=None, k=2):
+    pipe = data_filter.DataPipeline([fn], cache_dir)
+    pipe.add_filter(load_data=data_filter.LoadData())
+    pipe.add_filter(first=Scale(k))
+    return pipe
+
+
+def test_pipeline_memoization(tmpdir):
+    A = make_data(1000)
+    fn = str(tmpdir.join("data.smc.bin"))
+    smcpp._smcpp.write_binary_data(fn, header, A)
+    Scale.calls = 0
+    pipe = make_pipeline(fn)
+    first = pipe.run()
+    pipe.add_filter(second=Scale(3))
+    second = pipe.run()
+    assert Scale.calls == 2
+    # Only the last two stages are kept.
+    assert pipe._stages[0] is None
+    # The second filter did not alter the results of the first.
+    np.testing.assert_array_equal(first[0].data[:, 0], 2 * A[:, 0])
+    np.testing.assert_array_equal(second[0].data[:, 0], 6 * A[:, 0])
+    # Replacing a filter only reruns it and those after it.
+    pipe.add_filter(second=Scale(5))
+    np.testing.assert_array_equal(pipe.run()[0].data[:, 0], 10 * A[:, 0])
+    assert Scale.calls == 3
+
+
+def test_pipeline_cache(tmpdir):
+    A = make_data(1000)
+    fn = str(tmpdir.join("data.smc.bin"))
+    smcpp._smcpp.write_binary_data(fn, header, A)
+    cache_dir = str(tmpdir.mkdir("cache"))
+    Scale.calls = 0
+    for _ in range(2):
+        pipe = make_pipeline(fn, cache_dir)
+        np.testing.assert_array_equal(pipe.run()[0].data[:, 0], 2 * A[:, 0])
+        assert pipe["load_data"].populations == ("pop1",)
+    assert Scale.calls == 1
+    make_pipeline(fn, cache_dir, k=3).run()
+    assert Scale.calls == 2
+    # Changing the data invalidates the cache.
+    smcpp._smcpp.write_binary_data(fn, header, A[:500])
+    assert len(make_pipeline(fn, cache_dir).run()[0].data) == 500
+    assert Scale.calls == 3
+    data_filter.clear_cache(cache_dir)
+    assert os.listdir(cache_dir) == []
+    make_pipeline(fn, cache_dir).run()
+    assert Scale.calls == 4
+
+
+def test_shared_process_filters():
+    def files():
+        return {f for f in os.listdir(shared_data._dir) if f.startswith("smcpp-")}
+
+    before = files()
+    c = make_contig()
+    expected = estimation_tools.compress_repeated_obs(c.data)
+    (d,) = data_filter.Compress()([c])
+    np.testing.assert_array_equal(d.data, expected)
+    assert isinstance(d.data, np.memmap)
+    # Validated in place, without copying.
+    (v,) = data_filter.Validate()([d])
+    assert v.data is d.data
+    del c, d, v
+    gc.collect()
+    assert files() <= before
+
+
+def test_pipeline_source(tmpdir):
+    fns = []
+    for i in range(3):
+        fns.append(str(tmpdir.join("data%d.smc.bin" % i)))
+        smcpp._smcpp.write_binary_data(fns[-1], header, make_data(1000 * (i + 1)))
+
+    def pipeline(files, source=None):
+        pipe = data_filter.DataPipeline(files, source=source)
+        pipe.add_filter(load_data=data_filter.LoadData())
+        pipe.add_filter(normalize=data_filter.Normalize(
+            nonseg_cutoff=50000, span_cutoff=100000, min_length=100000))
+        pipe.add_filter(watterson=data_filter.Watterson())
+        return pipe
+    source = pipeline(fns)
+    pipe = pipeline(fns[1:], source)
+    assert source.keep_stages
+    fresh = pipeline(fns[1:])
+    assert [c.fn for c in pipe.run()] == [c.fn for c in fresh.run()]
+    # The contigs are those of the source, but the passthrough filter
+    # ran on the subset.
+    by_fn = {c.fn: c for c in source.run()}
+    for c, d in zip(pipe.run(), fresh.run()):
+        assert c.data is by_fn[c.fn].data
+        np.testing.assert_array_equal(c.data, d.data)
+    assert pipe["watterson"].theta_hat == fresh["watterson"].theta_hat
+    assert pipe["watterson"].theta_hat != source["watterson"].theta_hat
+    assert pipe["load_data"].populations == fresh["load_data"].populations
+
+
+def test_split_blocks():
+    c = make_contig()
+    blocks = data_filter.SplitBlocks(100000)([c])
+    assert len(blocks) > 1
+    np.testing.assert_array_equal(np.concatenate([b.data for b in blocks]), c.data)
+    ends = np.cumsum([b.data[:, 0].sum() for b in blocks])
+    # Each block holds the observations ending in one interval of size
+    # positions.
+    assert np.all(np.diff((ends - 1) // 100000) > 0)
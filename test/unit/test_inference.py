@@ -1,8 +1,17 @@
 import smcpp._smcpp, smcpp.model, smcpp.spline
 import numpy as np
+import itertools
+import os
 import sys
 import logging
 import ad
+import types
+
+from smcpp.analysis.base import BaseAnalysis
+from smcpp.contig import Contig
+from smcpp.observe import Observer
+from smcpp.optimize.optimizers import AbstractOptimizer
+from smcpp.optimize.plugins.loglikelihood_monitor import LoglikelihoodMonitor
 
 
 
@@ -72,3 +81,245 @@ def test_inference():
         print(k, a, dq)
         print(k, b, dr)
         model[k] -= 1e-8
+
+
+n = 10
+hs = np.concatenate([[0.], np.logspace(-2, 1, 5), [np.inf]])
+obs = [np.array([[1, 0, 0, n - 2], [100, 0, 0, 0], [1, 1, 2, n - 2]], dtype=np.int32),
+       np.array([[50, 0, 0, 0], [1, 2, n - 2, n - 2], [3, 0, 0, 0]], dtype=np.int32)]
+
+
+def make(obs_list, hidden_states=hs):
+    model = smcpp.model.SMCModel([.1, 1., 2.], 1e4, pid="pop1")
+    im = smcpp._smcpp.PyOnePopInferenceManager(n - 2, obs_list, hidden_states, ("pop1",), 0.)
+    im.model = model
+    im.theta = 1e-3
+    im.rho = 1e-3
+    return im
+
+
+def test_add_remove_observations():
+    full = make(obs)
+    full.E_step()
+    im = make(obs[:1])
+    im.add_observations(obs[1:])
+    im.E_step()
+    np.testing.assert_allclose(im.loglik(), full.loglik())
+    im.remove_observations([1])
+    im.E_step()
+    first = make(obs[:1])
+    first.E_step()
+    np.testing.assert_allclose(im.loglik(), first.loglik())
+
+
+def test_set_hidden_states():
+    hs2 = np.concatenate([[0.], np.logspace(-3, 1, 9), [np.inf]])
+    im = make(obs)
+    im.E_step()
+    im.hidden_states = hs2
+    im.E_step()
+    fresh = make(obs, hs2)
+    fresh.E_step()
+    np.testing.assert_allclose(im.loglik(), fresh.loglik())
+    assert im.xisums[0].shape == (len(hs2) - 1, len(hs2) - 1)
+
+
+def test_set_hidden_states_two_pop():
+    hs2 = np.concatenate([[0.], np.logspace(-3, 1, 9), [np.inf]])
+    obs2 = [np.array([[1, 0, 0, 2, 0, 0, 2], [100, 0, 0, 0, 0, 0, 0], [1, 1, 1, 2, 0, 1, 2],
+                      [50, 0, 0, 0, 0, 0, 0], [1, 2, 2, 2, 0, 2, 2]], dtype=np.int32)]
+
+    def make2(hidden_states):
+        m1 = smcpp.model.SMCModel([.1, 1., 2.], 1e4, pid="pop1")
+        m2 = smcpp.model.SMCModel([.1, 1., 2.], 1e4, pid="pop2")
+        m2[:] = [.5, 0., -.5]
+        im = smcpp._smcpp.PyTwoPopInferenceManager(
+            2, 2, 2, 0, obs2, hidden_states, ("pop1", "pop2"), 0.)
+        im.model = smcpp.model.SMCTwoPopulationModel(m1, m2, .5)
+        im.theta = 1e-3
+        im.rho = 1e-3
+        return im
+    im = make2(hs)
+    im.E_step()
+    im.hidden_states = hs2
+    im.E_step()
+    fresh = make2(hs2)
+    fresh.E_step()
+    np.testing.assert_allclose(float(im.Q()), float(fresh.Q()))
+    np.testing.assert_allclose(im.loglik(), fresh.loglik())
+
+
+def test_fixed_size_hmm():
+    for M in [16, 20]:
+        hs2 = np.concatenate([[0.], np.logspace(-3, 1, M - 1), [np.inf]])
+        im = make(obs, hs2)
+        r = im.benchmark_E_step()
+        assert r["M"] == M
+        assert r["max_loglik_deviation"] < 1e-8
+
+
+def test_quantize_forward():
+    im = make(obs)
+    im.save_gamma = True
+    r = im.validate_quantization()
+    ll, ll_q = r["loglik"]
+    q, q_q = r["Q"]
+    assert abs(ll - ll_q) < 1e-3 * abs(ll)
+    assert abs(q - q_q) < 1e-3 * abs(q)
+    assert r["bytes"][1] < r["bytes"][0] / 2
+
+
+def test_numa_aware():
+    im = make(obs)
+    im.E_step()
+    ll = im.loglik()
+    q = float(im.Q())
+    cpus = os.sched_getaffinity(0)
+    im.numa_aware = True
+    im.E_step()
+    assert np.allclose(im.loglik(), ll)
+    assert abs(float(im.Q()) - q) < 1e-8 * abs(q)
+    # The calling thread is not left pinned to a node.
+    assert os.sched_getaffinity(0) == cpus
+    im.remove_observations([0])
+    im.E_step()
+    im.numa_aware = False
+    im.E_step()
+
+
+def test_write_posterior(tmpdir):
+    im = make(obs)
+    im.save_gamma = True
+    im.E_step()
+    gammas = [g / g.sum(axis=0) for g in im.gammas]
+    fn = str(tmpdir.join("posterior.smcp"))
+    im.write_posterior(fn, '{"x": 1}', origins=[0, 1000], chunk_rows=2)
+    for i, ob in enumerate(obs):
+        header, starts, spans, values = smcpp._smcpp.read_posterior(fn, i)
+        assert header == '{"x": 1}'
+        np.testing.assert_array_equal(spans, ob[:, 0])
+        np.testing.assert_array_equal(starts, [0, 1000][i] + np.cumsum(ob[:, 0]) - ob[:, 0])
+        np.testing.assert_allclose(values, gammas[i][:, 1:].T, atol=1e-6)
+    _, starts, _, _ = smcpp._smcpp.read_posterior(fn, 1, 1050, 1052)
+    assert list(starts) == [1050, 1051]
+    times = (hs[:-1] + np.minimum(hs[1:], 2 * hs[-2])) / 2
+    im.write_posterior(fn, "{}", times=times, quantiles=[.5])
+    _, _, _, values = smcpp._smcpp.read_posterior(fn, 0)
+    g = gammas[0][:, 1:]
+    np.testing.assert_allclose(values[:, 0], times @ g, rtol=1e-5)
+    np.testing.assert_array_equal(values[:, 1], g.argmax(axis=0))
+
+
+def test_forward_loglik():
+    im = make(obs)
+    ll = im.forward_loglik()
+    im.E_step()
+    np.testing.assert_allclose(ll, im.loglik(), rtol=1e-6)
+
+
+def test_weights():
+    im = make(obs)
+    im.set_weights([2, 0])
+    im.E_step()
+    first = make(obs[:1])
+    first.E_step()
+    np.testing.assert_allclose(im.loglik(), 2 * first.loglik())
+    np.testing.assert_allclose(float(im.Q()), 2 * float(first.Q()))
+    im.set_weights([1, 1])
+    im.E_step()
+    full = make(obs)
+    full.E_step()
+    np.testing.assert_allclose(im.loglik(), full.loglik())
+
+
+class _ConstantIM:
+    "Inference manager whose log-likelihood never changes."
+
+    def __init__(self):
+        self.weights = []
+
+    def set_weights(self, weights):
+        self.weights.append(list(weights))
+
+    def E_step(self):
+        pass
+
+    def loglik(self):
+        return -100.
+
+
+class _NoOpOptimizer(AbstractOptimizer):
+
+    def _coordinates(self):
+        return []
+
+
+class _StepCounter(Observer):
+
+    def __init__(self):
+        self.steps = []
+
+    def update(self, message, *args, **kwargs):
+        if message == "begin":
+            self.steps.append(0)
+        elif message == "post M-step":
+            self.steps[-1] += 1
+
+
+def test_bootstrap_replicates_step():
+    class A(BaseAnalysis):
+        # Split into four blocks of two observations by bootstrap(2, 20).
+        contigs = [Contig(data=np.tile([[10, 0, 0, 0]], (8, 1)), pid=("pop1",),
+                          fn="x", n=[2], a=[2])]
+
+        def __init__(self):
+            self._args = types.SimpleNamespace(polarization_error=0.)
+            self._hs = None
+            self._ims = {("pop1",): _ConstantIM()}
+            self._model = np.zeros(3)
+            self._rho = 1.
+            self._penalty = 0.
+            self._niter = 5
+            self._saver = None
+            self._optimizer = _NoOpOptimizer(self, "L-BFGS-B", 1e-4, 1e-4, False)
+
+        def loglik(self, reg=True):
+            return sum(im.loglik() for im in self._ims.values())
+
+        def _make_inference_managers(self, contigs, polarization_error, hs):
+            self.block_ims = {("pop1",): _ConstantIM()}
+            return self.block_ims
+
+    a = A()
+    monitor = LoglikelihoodMonitor()
+    counter = _StepCounter()
+    a._optimizer.register_plugin(monitor)
+    a._optimizer.register_plugin(counter)
+    main = a._ims
+    a.run()
+    a.bootstrap(2, 20, seed=1)
+    # The point estimate keeps the unsplit contigs.
+    assert a._ims is main and main[("pop1",)].weights == []
+    weights = a.block_ims[("pop1",)].weights
+    assert len(weights[0]) == 4 and weights[0] != weights[1]
+    # The main fit and both replicates converge after one step; a
+    # log-likelihood left over from the last fit would stop a replicate
+    # before its first.
+    assert counter.steps == [1, 1, 1]
+
+
+def test_viterbi():
+    im = make(obs)
+    paths = im.viterbi()
+    pi = im.pi.astype(float).reshape(-1)
+    T = im.transition.astype(float)
+    ep = {k: v.astype(float) for k, v in im.emission_probs.items()}
+    M = len(hs) - 1
+    for ob, (states, logp) in zip(obs, paths):
+        A = [np.linalg.matrix_power(np.diag(ep[tuple(row[1:])]) @ T.T, row[0]) for row in ob]
+
+        def score(p):
+            return np.log(pi[p[0]]) + sum(np.log(a[j, i]) for a, i, j in zip(A, p, p[1:]))
+        best = max(itertools.product(range(M), repeat=len(ob) + 1), key=score)
+        assert list(states) == list(best[1:])
+        assert abs(logp - score(best)) < 1e-6 * abs(logp)
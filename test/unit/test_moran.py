@@ -8,3 +8,8 @@ def test_moran():
     for a in range(2):
         _check(MoranEigensystem(N, a))
     _check(MoranEigensystem(N))
+
+def test_fast_matrices():
+    from smcpp._smcpp import check_fast_matrices
+    for n in (2, 5, 10, 20):
+        assert check_fast_matrices(n) < 1e-12
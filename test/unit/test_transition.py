@@ -50,3 +50,11 @@ def test_d(im):
 # def test_sum_to_one(constant_demo_1, hs):
 #     trans1 = _pypsmcpp.transition(constant_demo_1, hs, rho, False)
 #     assert np.allclose(np.sum(trans1, axis=1), 1.0)
+
+def test_double_matches_mpfr():
+    model = smcpp.model.PiecewiseModel([1., 2., .5, 3.], [.1, .5, 1., 2.])
+    hs = np.concatenate([[0.], np.logspace(-3, 1, 31), [np.inf]])
+    for rho in [1e-4, 1e-2, 1.]:
+        r = smcpp._smcpp.check_transition(model, hs, rho)
+        assert r['max_deviation'] < 1e-10
+        assert r['max_deriv_deviation'] < 1e-8
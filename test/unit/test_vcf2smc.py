@@ -0,0 +1,58 @@
+import gzip
+import subprocess
+import sys
+import numpy as np
+import pysam
+import pytest
+
+import smcpp._smcpp
+
+
+def smcpp_cmd(*args):
+    subprocess.check_call([sys.executable, "-c",
+        "from smcpp.frontend.console import main; main()"] + list(args))
+
+
+def make_vcf(path, L=100000, n=6):
+    np.random.seed(1)
+    samples = ["s%d" % i for i in range(n)]
+    with open(path, "wt") as f:
+        f.write("##fileformat=VCFv4.2\n")
+        f.write("##contig=<ID=1,length=%d>\n" % L)
+        f.write('##FORMAT=<ID=GT,Number=1,Type=String,Description="Genotype">\n')
+        f.write("\t".join(["#CHROM", "POS", "ID", "REF", "ALT", "QUAL", "FILTER", "INFO", "FORMAT"] + samples) + "\n")
+        for pos in sorted(set(np.random.randint(1, L, size=2000))):
+            alt = np.random.choice(["T", "TA"], p=[.9, .1])
+            gts = []
+            for _ in samples:
+                g = np.random.choice(["0", "1", "."], size=2, p=[.6, .35, .05])
+                gts.append("/".join(g))
+            f.write("\t".join(["1", str(pos), ".", "A", alt, ".", "PASS", ".", "GT"] + gts) + "\n")
+    return pysam.tabix_index(path, preset="vcf", force=True)
+
+
+@pytest.mark.skipif(not smcpp._smcpp.vcf2smc_available(), reason="built without htslib")
+def test_native_matches_python(tmpdir):
+    vcf = make_vcf(str(tmpdir.join("test.vcf")))
+    out = {}
+    for impl in ["native", "python"]:
+        fn = str(tmpdir.join(impl + ".smc.gz"))
+        args = ["vcf2smc", "-c", "50", vcf, fn, "1", "pop1:s0,s1,s2,s3,s4,s5"]
+        if impl == "python":
+            args.insert(1, "--python")
+        smcpp_cmd(*args)
+        out[impl] = gzip.open(fn, "rt").read()
+    assert out["native"] == out["python"]
+
+
+@pytest.mark.skipif(not smcpp._smcpp.vcf2smc_available(), reason="built without htslib")
+def test_batch_matches_single(tmpdir):
+    vcf = make_vcf(str(tmpdir.join("test.vcf")))
+    pop = "pop1:s0,s1,s2,s3,s4,s5"
+    smcpp_cmd("vcf2smc", "-c", "50", "-D", "s0,s3", vcf,
+              str(tmpdir.join("batch.{contig}.{sample}.smc.gz")), "all", pop)
+    for sid in ["s0", "s3"]:
+        fn = str(tmpdir.join(sid + ".smc.gz"))
+        smcpp_cmd("vcf2smc", "-c", "50", "-d", sid, sid, vcf, fn, "1", pop)
+        batch = str(tmpdir.join("batch.1.%s.smc.gz" % sid))
+        assert gzip.open(batch, "rt").read() == gzip.open(fn, "rt").read()